@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "buffer.h"
+
+/* Halve a buffer that has been emptied this many times in a row
+   without holding more than a quarter of its size. */
+#define BUFFER_SHRINK_DRAINS 16
+
+void
+buffer_init(struct buffer *b, size_t min_size, size_t max_size)
+{
+	memset(b, 0, sizeof(*b));
+	b->min_size = min_size;
+	b->max_size = max_size;
+}
+
+void
+buffer_release(struct buffer *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->size = 0;
+	b->head = b->tail = 0;
+	b->recent_peak = 0;
+	b->drains = 0;
+}
+
+size_t
+buffer_fill(const struct buffer *b)
+{
+	return b->head - b->tail;
+}
+
+int
+buffer_full(const struct buffer *b)
+{
+	return buffer_fill(b) >= b->max_size;
+}
+
+/* Move what is held into storage of the given size, where it starts at
+   the beginning. Returns -1, leaving things as they were, if there is
+   no memory for it. */
+static int
+resize(struct buffer *b, size_t size)
+{
+	unsigned char *data;
+	size_t fill = buffer_fill(b);
+	size_t off, first;
+
+	data = malloc(size);
+	if (!data) {
+		return -1;
+	}
+	if (fill) {
+		off = b->tail & (b->size - 1);
+		first = b->size - off;
+		if (first > fill) first = fill;
+		memcpy(data, b->data + off, first);
+		memcpy(data + first, b->data, fill - first);
+	}
+	free(b->data);
+	b->data = data;
+	b->size = size;
+	b->tail = 0;
+	b->head = fill;
+	b->recent_peak = fill;
+	b->drains = 0;
+	if (size > b->stats.peak_size) {
+		b->stats.peak_size = size;
+	}
+	return 0;
+}
+
+/* Returns how many pieces count bytes from offset pos make. */
+static int
+pieces(const struct buffer *b, size_t pos, size_t count, struct iovec *iov)
+{
+	size_t off, first;
+
+	if (count == 0) {
+		return 0;
+	}
+	off = pos & (b->size - 1);
+	first = b->size - off;
+	iov[0].iov_base = b->data + off;
+	if (first >= count) {
+		iov[0].iov_len = count;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = b->data;
+	iov[1].iov_len = count - first;
+	return 2;
+}
+
+int
+buffer_space(struct buffer *b, size_t count, struct iovec *iov)
+{
+	size_t room;
+
+	if (b->size == 0) {
+		if (resize(b, b->min_size) < 0) {
+			return 0;
+		}
+		b->stats.grows++;
+	} else if ((buffer_fill(b) == b->size) && (b->size < b->max_size)) {
+		/* Growing under load: the copy is paid once per doubling. */
+		if (resize(b, b->size * 2) == 0) {
+			b->stats.grows++;
+		}
+	}
+	room = b->size - buffer_fill(b);
+	if (count > room) {
+		count = room;
+	}
+	return pieces(b, b->head, count, iov);
+}
+
+void
+buffer_produce(struct buffer *b, size_t count)
+{
+	size_t fill;
+
+	b->head += count;
+	b->stats.bytes_in += count;
+	fill = buffer_fill(b);
+	if (fill > b->recent_peak) {
+		b->recent_peak = fill;
+	}
+	if (fill > b->stats.peak_fill) {
+		b->stats.peak_fill = fill;
+	}
+}
+
+int
+buffer_data(const struct buffer *b, size_t count, struct iovec *iov)
+{
+	size_t fill = buffer_fill(b);
+
+	if (count > fill) {
+		count = fill;
+	}
+	return pieces(b, b->tail, count, iov);
+}
+
+size_t
+buffer_peek(const struct buffer *b, const void **data)
+{
+	struct iovec iov[2];
+
+	if (buffer_data(b, buffer_fill(b), iov) == 0) {
+		return 0;
+	}
+	*data = iov[0].iov_base;
+	return iov[0].iov_len;
+}
+
+void
+buffer_consume(struct buffer *b, size_t count)
+{
+	b->tail += count;
+	b->stats.bytes_out += count;
+	if (b->head != b->tail) {
+		return;
+	}
+	/* Empty: start again at the beginning, so that the next lot is
+	   in one piece, and see whether the buffer is bigger than it
+	   needs to be lately. */
+	b->head = b->tail = 0;
+	if (b->size <= b->min_size) {
+		return;
+	}
+	if (b->recent_peak > b->size / 4) {
+		b->recent_peak = 0;
+		b->drains = 0;
+		return;
+	}
+	if (++(b->drains) < BUFFER_SHRINK_DRAINS) {
+		return;
+	}
+	if (resize(b, b->size / 2) == 0) {
+		b->stats.shrinks++;
+	}
+}
+
+size_t
+buffer_put(struct buffer *b, const void *data, size_t count)
+{
+	struct iovec iov[2];
+	size_t done = 0;
+	int i, n;
+
+	while (done < count) {
+		n = buffer_space(b, count - done, iov);
+		if (n == 0) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			memcpy(iov[i].iov_base, (const char *)data + done, iov[i].iov_len);
+			buffer_produce(b, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+	}
+	return done;
+}
+
+ssize_t
+buffer_read(struct buffer *b, int fd, size_t count)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	int iovcnt;
+
+	iovcnt = buffer_space(b, count, iov);
+	if (iovcnt == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	n = readv(fd, iov, iovcnt);
+	if (n > 0) {
+		buffer_produce(b, n);
+	}
+	return n;
+}
+
+ssize_t
+buffer_write(struct buffer *b, int fd)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	int iovcnt;
+
+	iovcnt = buffer_data(b, buffer_fill(b), iov);
+	if (iovcnt == 0) {
+		return 0;
+	}
+	n = writev(fd, iov, iovcnt);
+	if (n > 0) {
+		buffer_consume(b, n);
+	}
+	return n;
+}
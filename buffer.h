@@ -0,0 +1,87 @@
+#ifndef _DECK_BUFFER_H
+#define _DECK_BUFFER_H
+
+/* A byte queue for the relay loops, in which data is never moved up
+   to make room: it is a ring, so what it holds and the room it has are
+   each in at most two pieces, which go straight to readv() and
+   writev().
+
+   The storage is only allocated when something is first put in, at
+   min_size. Each time the buffer fills up it doubles, up to max_size,
+   which is when it is copied. A buffer that keeps being emptied
+   without getting anywhere near full halves again, so a relay that
+   has gone quiet does not hold on to what it needed when it was busy.
+
+   There is no locking: whoever uses a buffer from more than one
+   thread locks around it. */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct buffer_stats {
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	/* Most ever held, and the biggest the storage got */
+	size_t peak_fill;
+	size_t peak_size;
+	unsigned int grows;
+	unsigned int shrinks;
+};
+
+struct buffer {
+	unsigned char *data;
+	/* 0 before anything is allocated, otherwise a power of 2 */
+	size_t size;
+	size_t min_size;
+	size_t max_size;
+	/* Free-running counts of bytes put and taken */
+	size_t head;
+	size_t tail;
+	/* Most held at once, and times emptied, since the last resize */
+	size_t recent_peak;
+	unsigned int drains;
+	struct buffer_stats stats;
+};
+
+/* min_size and max_size must be powers of 2. */
+void buffer_init(struct buffer *b, size_t min_size, size_t max_size);
+
+/* Frees the storage. The buffer can be used again afterwards. */
+void buffer_release(struct buffer *b);
+
+size_t buffer_fill(const struct buffer *b);
+
+/* Holding max_size bytes, so nothing more will fit. */
+int buffer_full(const struct buffer *b);
+
+/* Point iov, which must have room for 2, at up to count bytes of free
+   space, growing the buffer first if it is full. Returns how many of
+   iov were used, which is 0 if no more fits or there is no memory.
+   Follow with buffer_produce(). */
+int buffer_space(struct buffer *b, size_t count, struct iovec *iov);
+
+/* count bytes of the space from buffer_space() were filled in. */
+void buffer_produce(struct buffer *b, size_t count);
+
+/* Point iov, which must have room for 2, at up to count of the oldest
+   bytes held. Returns how many of iov were used. */
+int buffer_data(const struct buffer *b, size_t count, struct iovec *iov);
+
+/* Point *data at the oldest bytes held and return how many of them are
+   contiguous there, or 0 if the buffer is empty. */
+size_t buffer_peek(const struct buffer *b, const void **data);
+
+/* Drop count of the oldest bytes, which have been used. */
+void buffer_consume(struct buffer *b, size_t count);
+
+/* Copy in as much of data as fits and return how much that was. */
+size_t buffer_put(struct buffer *b, const void *data, size_t count);
+
+/* Read up to count bytes from fd into the buffer, and write as much
+   of what it holds as fd takes to fd. These return what readv() and
+   writev() do; buffer_read() fails with ENOBUFS if there was no room. */
+ssize_t buffer_read(struct buffer *b, int fd, size_t count);
+ssize_t buffer_write(struct buffer *b, int fd);
+
+#endif /* _DECK_BUFFER_H */
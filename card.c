@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -7,6 +8,16 @@
 #include "cardclient.h"
 #include "util.h"
 
+/* Output classes, as shorthand for weights. */
+static const struct {
+	const char *name;
+	int weight;
+} classes[] = {
+	{ "bulk", 1 },
+	{ "normal", 4 },
+	{ "interactive", 16 },
+};
+
 int
 main(int argc, char **argv)
 {
@@ -14,15 +25,72 @@ main(int argc, char **argv)
 	int ttyfd;
 	char *var;
 	struct sockaddr_un cardserver_socket_name;
+	socklen_t salen;
 	struct tty_settings ts;
+	char options[80];
+	int weight = 0;
+	int screen = 0;
+	int tail = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "+c:stw:")) != -1) {
+		switch (opt) {
+		case 'c':
+			for (i = 0; i < sizeof(classes)/sizeof(classes[0]); i++) {
+				if (0 == strcmp(optarg, classes[i].name)) {
+					weight = classes[i].weight;
+					break;
+				}
+			}
+			if (weight == 0) {
+				fprintf(stderr, "Unknown class \"%s\"\n", optarg);
+				goto usage;
+			}
+			break;
+		case 's':
+			screen = 1;
+			break;
+		case 't':
+			tail = 1;
+			break;
+		case 'w':
+			weight = atoi(optarg);
+			if (weight < 1) {
+				goto usage;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s command [args...]\n"
+usage:
+		fprintf(stderr, "Usage: %s [-c bulk|normal|interactive] [-w weight] [-s] [-t] command [args...]\n"
 			"Starts the given command in a card using the\n"
-			"cardserver that exists in the environment.\n",
+			"cardserver that exists in the environment.\n"
+			"The class or weight says how big a share of the\n"
+			"output the card gets when others are busy too.\n"
+			"With -s, if the card's output cannot keep up, only\n"
+			"what changes on its screen is sent, a few times a\n"
+			"second, for commands like top that redraw a lot.\n"
+			"With -t, if the card's output cannot keep up, the\n"
+			"middle of it is skipped and only the latest is sent,\n"
+			"for commands like a noisy build whose last lines are\n"
+			"what matter.\n",
 			argv[0]);
 		return 3;
 	}
+	options[0] = 0;
+	if (weight) {
+		snprintf(options, sizeof(options), "\n" CARD_OPTION_WEIGHT "=%d", weight);
+	}
+	if (tail) {
+		snprintf(options + strlen(options), sizeof(options) - strlen(options),
+			"\n" CARD_OPTION_TAIL "=1");
+	}
 	var = getenv(CARDDECK_SOCKET_VAR_NAME);
 	if ((!var) || (!(*var))) {
 		fprintf(stderr, "No $" CARDDECK_SOCKET_VAR_NAME ". "
@@ -39,23 +107,35 @@ fallback:
 		goto fallback;
 	}
 	collect_tty_settings(ttyfd, &ts);
+	if (screen) {
+		/* The pty will be the same size, or the usual default if
+		   the tty does not say. */
+		if ((!ts.winp) || (ts.win.ws_col == 0) || (ts.win.ws_row == 0)) {
+			ts.win.ws_col = 80;
+			ts.win.ws_row = 24;
+			ts.winp = &(ts.win);
+		}
+		snprintf(options + strlen(options), sizeof(options) - strlen(options),
+			"\n" CARD_OPTION_SCREEN "=%dx%d", ts.win.ws_col, ts.win.ws_row);
+	}
 
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	salen = unix_socket_address(var, &cardserver_socket_name);
+	if (salen == 0) {
+		fprintf(stderr, "$" CARDDECK_SOCKET_VAR_NAME " is too long.\n");
+		goto fallback;
+	}
+	/* Straight to the deck's own socket however deep we are. */
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		perror("socket");
 		goto fallback;
 	}
-	memset(&cardserver_socket_name, 0, sizeof(cardserver_socket_name));
-	cardserver_socket_name.sun_family = AF_UNIX;
-	strncpy(cardserver_socket_name.sun_path, var, sizeof(cardserver_socket_name.sun_path)-1);
-	if (connect(sock,
-			(struct sockaddr*)&cardserver_socket_name,
-			sizeof(cardserver_socket_name)) < 0) {
+	if (connect(sock, (struct sockaddr*)&cardserver_socket_name, salen) < 0) {
 		perror("connect to cardserver");
 		close(sock);
 		goto fallback;
 	}
 
-	int status = cardclient(sock, &(stdio_is_tty[0]), &ts, -1, argv+1);
+	int status = cardclient(sock, options, &(stdio_is_tty[0]), &ts, -1, 1, argv+1);
 	exit(status);
 }
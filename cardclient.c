@@ -1,140 +1,432 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <pthread.h>
 #include <poll.h>
 #include <pty.h>
 #include <string.h>
 #include <alloca.h>
+#include <time.h>
 #include <termios.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/un.h>
 #include "global.h"
 #include "cardclient.h"
 #include "util.h"
+#include "credit.h"
+#include "buffer.h"
+
+/* What relaying through buf starts with, and the most it holds. */
+#define RELAY_BUFFER_MIN 4096
+#define RELAY_BUFFER_MAX 65536
+
+/* Relay this much through buf before setting up a pipe to splice()
+   through. Most cards say little and are gone before the pipe would
+   pay for itself. */
+#define RELAY_SPLICE_AFTER 65536
+
+/* How long to wait for the cardserver to answer with a pty. */
+#define CARD_PTY_WAIT_MSEC 1000
+
+/* Moves bytes one way between two fds. Once it has carried enough to
+   be worth it, it goes through a pipe with splice() if it can, so that
+   the data never comes into user space. Until then, or if the kernel
+   turns out not to support splice() on one of the fds, it is read into
+   and written out of buf. */
+struct relay {
+	int from;
+	int to;
+	int pipe[2];	/* or -1 when copying through buf */
+	int splice_pending;
+	size_t capacity;
+	size_t fill;
+	int eof;
+	unsigned long long total;
+	/* Do not read beyond this much in total, as the far end of to
+	   has given no credit for more. */
+	unsigned long long limit;
+	struct buffer buf;
+};
+
+static void
+relay_init(struct relay *r, int from, int to)
+{
+	memset(r, 0, sizeof(*r));
+	r->from = from;
+	r->to = to;
+	r->pipe[0] = r->pipe[1] = -1;
+	r->splice_pending = 1;
+	buffer_init(&(r->buf), RELAY_BUFFER_MIN, RELAY_BUFFER_MAX);
+	r->capacity = RELAY_BUFFER_MAX;
+	r->limit = ULLONG_MAX;
+}
 
+/* Switch to splicing. Only when buf is empty. */
 static void
-maybe_write(size_t *tocopyp, char *buf, short revents, int fd)
+relay_start_splice(struct relay *r)
 {
-	if ((*tocopyp) == 0) {
+	int size;
+
+	r->splice_pending = 0;
+	if (pipe2(&(r->pipe[0]), O_NONBLOCK | O_CLOEXEC) < 0) {
+		r->pipe[0] = r->pipe[1] = -1;
 		return;
 	}
-	if (!(revents & POLLOUT)) {
+	buffer_release(&(r->buf));
+	/* Only ever fill the pipe halfway. Letting it fill right up was
+	   measured to make relaying a lot slower. No more than buf can
+	   take either, so that it can always be copied back out. */
+	size = fcntl(r->pipe[0], F_GETPIPE_SZ);
+	r->capacity = ((size > 0) ? size : 65536) / 2;
+	if (r->capacity > RELAY_BUFFER_MAX) {
+		r->capacity = RELAY_BUFFER_MAX;
+	}
+}
+
+static void
+relay_fall_back(struct relay *r)
+{
+	close(r->pipe[0]);
+	close(r->pipe[1]);
+	r->pipe[0] = r->pipe[1] = -1;
+	r->capacity = RELAY_BUFFER_MAX;
+}
+
+/* One of the fds turned out not to splice. Move whatever is in the pipe
+   into buf and copy from now on. Returns -1 if it could not be kept. */
+static int
+relay_unsplice(struct relay *r)
+{
+	size_t left = r->fill;
+	ssize_t n;
+
+	while (left > 0) {
+		n = buffer_read(&(r->buf), r->pipe[0], left);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		left -= n;
+	}
+	relay_fall_back(r);
+	return 0;
+}
+
+static void
+relay_close(struct relay *r)
+{
+	if (r->pipe[0] >= 0) {
+		relay_fall_back(r);
+	}
+	buffer_release(&(r->buf));
+}
+
+static int
+relay_wants_read(struct relay *r)
+{
+	return (!(r->eof)) && (r->fill < r->capacity) && (r->total < r->limit);
+}
+
+/* Called when from has something for us (or has hung up). */
+static void
+relay_read(struct relay *r)
+{
+	ssize_t nread;
+	size_t want;
+
+	if (!relay_wants_read(r)) {
 		return;
 	}
-	ssize_t written = write(fd, buf, *tocopyp);
-	if (written <= 0) {
+	if (r->splice_pending && (r->fill == 0) && (r->total >= RELAY_SPLICE_AFTER)) {
+		relay_start_splice(r);
+	}
+	want = r->capacity - r->fill;
+	if (want > r->limit - r->total) {
+		want = r->limit - r->total;
+	}
+	if (r->pipe[0] >= 0) {
+		nread = splice(r->from, NULL, r->pipe[1], NULL, want,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ((nread < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+			if (relay_unsplice(r) < 0) {
+				perror("relay");
+				r->eof = 1;
+				return;
+			}
+		}
+	}
+	if (r->pipe[0] < 0) {
+		nread = buffer_read(&(r->buf), r->from, want);
+	}
+	if (nread < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+		/* A pty master gets EIO once the slave side is closed. */
+		r->eof = 1;
 		return;
 	}
-	if (written == (*tocopyp)) {
-		*tocopyp = 0;  /* wrote everything */
-	} else {
-		memmove(buf, buf+written, (*tocopyp) - written);
-		*tocopyp -= written;
+	if (nread == 0) {
+		r->eof = 1;
+		return;
 	}
+	r->fill += nread;
+	r->total += nread;
 }
 
+/* Called when to can take more. Returns -1 if it never will. */
 static int
-maybe_read(size_t *tocopyp, char *buf, size_t buf_size, short revents, int fd)
+relay_write(struct relay *r)
 {
-	if ((*tocopyp) >= buf_size) {
+	ssize_t written;
+
+	if (r->fill == 0) {
 		return 0;
 	}
-	if (!(revents & POLLIN)) {
-		return 0;
+	if (r->pipe[0] >= 0) {
+		written = splice(r->pipe[0], NULL, r->to, NULL, r->fill,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ((written < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+			if (relay_unsplice(r) < 0) {
+				perror("relay");
+				return -1;
+			}
+		}
 	}
-	ssize_t nread = read(fd, buf + *tocopyp, buf_size - (*tocopyp));
-	if (nread > 0) {
-		*tocopyp += nread;
+	if (r->pipe[0] < 0) {
+		written = buffer_write(&(r->buf), r->to);
 	}
-	return nread <= 0;
+	if (written < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+		return -1;
+	}
+	r->fill -= written;
+	return 0;
 }
 
+struct childio {
+	int sock;
+	/* Credit for the card's socket in both directions, or -1 */
+	int flow;
+	/* A grant could not be sent and is still to go. */
+	int flow_blocked;
+	struct credit input_credit;
+	int pty;
+	pid_t child;
+	/* Becomes readable when the child exits; -1 once it has been
+	   waited for, or if the kernel cannot give us one. */
+	int pidfd;
+	/* Whether this process is a subreaper, so that every other child
+	   it has was left behind by ours. */
+	int adopts;
+	int exited;
+	int status;
+	struct relay to_pty;
+	struct relay from_pty;
+	struct timespec start;
+};
+
 static void
-childio(int fd0, int fd1, int quit_pipe)
+report_iostats(struct childio *io)
 {
-	struct pollfd pollfd[3];
-	int nfds = (quit_pipe == -1) ? 2 : 3;
-	char buf0to1[4096];
-	size_t tocopy_0to1 = 0;
-	char buf1to0[4096];
-	size_t tocopy_1to0 = 0;
-	int err = 0;
-
-	pollfd[0].fd = fd0;
-	pollfd[1].fd = fd1;
-	pollfd[2].fd = quit_pipe;
-
-	setnonblock(fd0);
-	setnonblock(fd1);
-	setnonblock(quit_pipe);
-
-	while (!err) {
+	struct timespec now;
+	double elapsed;
+
+	if (!getenv(CARDDECK_IOSTATS_VAR_NAME)) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - io->start.tv_sec) +
+		(now.tv_nsec - io->start.tv_nsec) / 1e9;
+	if (elapsed <= 0) elapsed = 1e-9;
+	fprintf(stderr, "card: %llu bytes out, %llu bytes in, %.3fs, %.1f MB/s out (",
+		io->from_pty.total, io->to_pty.total, elapsed,
+		io->from_pty.total / elapsed / 1e6);
+	if (io->from_pty.pipe[0] >= 0) {
+		fprintf(stderr, "splice)\n");
+	} else {
+		fprintf(stderr, "copy, at most %zu bytes buffered in %zu)\n",
+			io->from_pty.buf.stats.peak_fill, io->from_pty.buf.stats.peak_size);
+	}
+}
+
+/* Collect the child if it has exited, and, if we are a subreaper,
+   anything left behind by its own children that was handed to us.
+   Other children of the process are none of our business. With wait
+   set, waits for the child if it has not exited yet. */
+static void
+reap(struct childio *io, int wait)
+{
+	pid_t pid;
+	int status;
+
+	for (;;) {
+		if ((!(io->adopts)) && io->exited) break;
+		pid = waitpid(io->adopts ? -1 : io->child, &status,
+			(wait && !(io->exited)) ? 0 : WNOHANG);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (pid == 0) break;
+		if ((pid == io->child) && (WIFEXITED(status) || WIFSIGNALED(status))) {
+			io->exited = 1;
+			io->status = status;
+		}
+	}
+	if (io->exited && (io->pidfd >= 0)) {
+		close(io->pidfd);
+		io->pidfd = -1;
+	}
+}
+
+/* Give the cardserver more room to send input once some of it has
+   gone into the pty. */
+static void
+grant_input(struct childio *io)
+{
+	unsigned long long limit;
+
+	if (io->flow < 0) {
+		return;
+	}
+	limit = credit_due(&(io->input_credit),
+		io->to_pty.total - io->to_pty.fill, io->to_pty.fill > 0);
+	if (limit) {
+		io->flow_blocked = (credit_send(&(io->input_credit), io->flow, limit) < 0);
+	}
+}
+
+static void
+childio_run(struct childio *io)
+{
+	struct pollfd pollfd[4];
+	int timeout;
+
+	for (;;) {
+		if (io->from_pty.eof && (io->from_pty.fill == 0)) {
+			/* Everything the card had to say is out. Once the
+			   child has exited this is when nothing else is left
+			   with the pty open. */
+			return;
+		}
+		if (io->to_pty.eof) {
+			/* The cardserver is gone. */
+			return;
+		}
+		pollfd[0].fd = io->sock;
 		pollfd[0].events =
-			/* Space available to read? */
-			((tocopy_0to1 < sizeof(buf0to1)) ? POLLIN : 0) |
-			/* Things need to be written? */
-			((tocopy_1to0 > 0) ? POLLOUT : 0);
+			(relay_wants_read(&(io->to_pty)) ? POLLIN : 0) |
+			((io->from_pty.fill > 0) ? POLLOUT : 0);
 		pollfd[1].events =
-			/* Space available to read? */
-			((tocopy_1to0 < sizeof(buf1to0)) ? POLLIN : 0) |
-			/* Things need to be written? */
-			((tocopy_0to1 > 0) ? POLLOUT : 0);
+			(relay_wants_read(&(io->from_pty)) ? POLLIN : 0) |
+			((io->to_pty.fill > 0) ? POLLOUT : 0);
+		/* Once the pty has hung up it would keep waking us, so
+		   leave it out unless there is something to do with it. */
+		pollfd[1].fd = ((pollfd[1].events == 0) && io->from_pty.eof) ? -1 : io->pty;
+		pollfd[2].fd = io->pidfd;
 		pollfd[2].events = POLLIN;
-		if (poll(&(pollfd[0]), nfds, -1) <= 0) {
+		pollfd[3].fd = io->flow;
+		pollfd[3].events = POLLIN | (io->flow_blocked ? POLLOUT : 0);
+		/* Without a pidfd, look for the child now and again. */
+		timeout = ((io->pidfd < 0) && !(io->exited)) ? 200 : -1;
+		if (poll(&(pollfd[0]), 4, timeout) < 0) {
 			if (errno == EAGAIN) continue;
 			if (errno == EINTR) continue;
 			sleep(1);
 			continue;
 		}
 
-		if ((pollfd[0].revents & POLLHUP) || (pollfd[1].revents & POLLHUP)) {
-			break;
+		if (pollfd[0].revents & (POLLHUP | POLLERR)) {
+			/* There is no point in reading any more input or
+			   waiting to send output. */
+			return;
 		}
-		if ((nfds > 2) && (pollfd[2].revents)) {
-			/* The child has died, but there might be grandchildren
-			   still going. We can continue, but we have to get out
-			   of the way of the process parentage chain. */
-			if (fork() == 0) {
-				close(quit_pipe);
-				childio(fd0, fd1, -1);
-				_exit(0);
+		if ((io->pidfd >= 0) ? (pollfd[2].revents != 0) : (timeout >= 0)) {
+			/* Anything the child left running carries on in the
+			   card until it lets go of the pty too. */
+			reap(io, 0);
+		}
+		if (pollfd[3].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (credit_receive(io->flow, &(io->from_pty.limit)) < 0) {
+				/* The cardserver will not be giving any more, so
+				   do without. */
+				io->flow = -1;
+				io->from_pty.limit = ULLONG_MAX;
 			}
-			break;
 		}
-		maybe_write(&tocopy_1to0, buf1to0, pollfd[0].revents, fd0);
-		maybe_write(&tocopy_0to1, buf0to1, pollfd[1].revents, fd1);
-		err |= maybe_read(&tocopy_0to1, buf0to1, sizeof(buf0to1), pollfd[0].revents, fd0);
-		err |= maybe_read(&tocopy_1to0, buf1to0, sizeof(buf1to0), pollfd[1].revents, fd1);
+		if (pollfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			relay_read(&(io->from_pty));
+		}
+		if (pollfd[0].revents & POLLIN) {
+			relay_read(&(io->to_pty));
+		}
+		if (pollfd[0].revents & POLLOUT) {
+			if (relay_write(&(io->from_pty)) < 0) {
+				return;
+			}
+		}
+		if (pollfd[1].revents & (POLLOUT | POLLERR)) {
+			if (relay_write(&(io->to_pty)) < 0) {
+				/* Nothing is reading the pty any more. */
+				io->to_pty.fill = 0;
+				relay_close(&(io->to_pty));
+			}
+		}
+		if ((pollfd[1].revents & POLLOUT) || (pollfd[3].revents & POLLOUT)) {
+			grant_input(io);
+		}
 	}
 }
 
-struct waitpid_thread_args {
-	pid_t pid;
-	int notify_fd;
-	int status;
-};
-
-static void *
-do_waitpid(void *varg)
+/* Relays between the card and the pty until both are done with, and
+   returns the child's status as from waitpid(). */
+static int
+childio(int sock, int flow, int pty, pid_t child, int adopts)
 {
-	struct waitpid_thread_args *arg = (struct waitpid_thread_args *)varg;
+	struct childio *io = malloc(sizeof(*io));
+	int status;
 
-	for (;;) {
-		if (waitpid(arg->pid, &(arg->status), 0) < 0) {
-			if (errno == EINTR) continue;
-			if (errno == EAGAIN) continue;
-			sleep(1);
-			continue;
-		}
-		if (WIFEXITED(arg->status)) break;
-	}
-	close(arg->notify_fd);
-	return varg;
+	if (!io) {
+		perror("malloc");
+		while ((waitpid(child, &status, 0) < 0) && (errno == EINTR));
+		return status;
+	}
+	memset(io, 0, sizeof(*io));
+	io->sock = sock;
+	io->flow = flow;
+	io->pty = pty;
+	io->child = child;
+	io->adopts = adopts;
+	io->pidfd = syscall(SYS_pidfd_open, child, 0);
+	/* The card's sockets were made non-blocking. */
+	setnonblock(pty);
+	relay_init(&(io->to_pty), sock, pty);
+	relay_init(&(io->from_pty), pty, sock);
+	if (flow >= 0) {
+		io->from_pty.limit = CARD_CREDIT_INITIAL;
+		credit_init(&(io->input_credit));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &(io->start));
+
+	childio_run(io);
+	report_iostats(io);
+	reap(io, 1);
+	status = io->status;
+	if (io->pidfd >= 0) {
+		close(io->pidfd);
+	}
+	relay_close(&(io->to_pty));
+	relay_close(&(io->from_pty));
+	free(io);
+	return status;
 }
 
 void
@@ -150,226 +442,134 @@ collect_tty_settings(int ttyfd, struct tty_settings *ts)
 	}
 }
 
-struct socket_param {
-	char *socket_dir;
-	char *socket_name;
-	char *env_var;
-};
-
+/* Hands fds to the cardserver along with the message, and closes them. */
 static int
-setup_socket(struct socket_param *p)
+pass_card(int upperdeck, int *fds, int nfds, const char *cardname)
 {
-	int fd;
-	char socket_dir_template[30];
-	char *socket_dir;
-	struct sockaddr_un socket_name;
+	int i, ret = 0;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fd < 0) {
-		return -1;
-	}
-	sprintf(socket_dir_template, "/tmp/carddeck.XXXXXX");
-	socket_dir = mkdtemp(socket_dir_template);
-	if (!socket_dir) {
-		perror("mkdtemp");
-		return -1;
-	}
-	memset(&socket_name, 0, sizeof(socket_name));
-	socket_name.sun_family = AF_UNIX;
-	sprintf(socket_name.sun_path, "%s/sock", socket_dir);
-	if (bind(fd, (struct sockaddr*)&socket_name, sizeof(socket_name)) < 0) {
-		perror("bind master socket");
-giveup:
-		close(fd);
-		unlink(socket_name.sun_path);
-		rmdir(socket_dir);
-		return -1;
-	}
-	if (listen(fd, 15) < 0) {
-		perror("listen");
-		goto giveup;
-	}
-
-	p->env_var = malloc(sizeof(CARDDECK_SOCKET_VAR_NAME) + 3 + strlen(socket_name.sun_path));
-	if (!(p->env_var)) {
-		perror("malloc");
-		goto giveup;
-	}
-	sprintf(p->env_var, CARDDECK_SOCKET_VAR_NAME "=%s", socket_name.sun_path);
-	p->socket_name = p->env_var + sizeof(CARDDECK_SOCKET_VAR_NAME);
-	p->socket_dir = strdup(socket_dir);
-	if (!(p->socket_dir)) {
-		perror("malloc");
-		free(p->env_var);
-		goto giveup;
-	}
-	return fd;
-}
-
-static void
-cleanup_socket(struct socket_param *p)
-{
-	unlink(p->socket_name);
-	rmdir(p->socket_dir);
-	free(p->env_var);
-	free(p->socket_dir);
-}
-
-static int
-pass_card(int upperdeck, int fd, const char *cardname)
-{
-	struct msghdr msg = { 0 };
-	char buf[CMSG_SPACE(sizeof(int))];
-	struct iovec io;
-	struct cmsghdr *cmsg;
-
-	memset(buf, 0, sizeof(buf));
-	io.iov_base = (void *)cardname;
-	io.iov_len = strlen(cardname);
-	msg.msg_iov = &io;
-	msg.msg_iovlen = 1;
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	*((int *)CMSG_DATA(cmsg)) = fd;
-	msg.msg_controllen = cmsg->cmsg_len;
-
-	if (sendmsg(upperdeck, &msg, 0) < 0) {
+	if (send_fds(upperdeck, cardname, strlen(cardname), fds, nfds) < 0) {
 		perror("sendmsg");
-		close(fd);
-		return -1;
+		ret = -1;
 	}
-	close(fd);
-	return 0;
+	for (i = 0; i < nfds; i++) {
+		close(fds[i]);
+	}
+	return ret;
 }
 
+/* Returns our end of the card's socket, and puts our end of the credit
+   socket for it in *flow, or -1 if it could not have one. Both are
+   non-blocking, as are the cardserver's ends. */
 static int
-make_card(int upperdeck, const char *cardname)
+make_card(int upperdeck, const char *cardname, const char *options, int *flow)
 {
-	int sv[2];
+	int sv[2], fv[2];
+	int theirs[2];
+	char *msg;
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, &(sv[0])) < 0) {
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, &(sv[0])) < 0) {
 		perror("socketpair");
 		return -1;
 	}
-	int ret = pass_card(upperdeck, sv[0], cardname);
+	theirs[0] = sv[0];
+	*flow = -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, &(fv[0])) == 0) {
+		theirs[1] = fv[0];
+		*flow = fv[1];
+	}
+	if (!options) options = "";
+	msg = alloca(strlen(cardname) + strlen(options) + 1);
+	sprintf(msg, "%s%s", cardname, options);
+	int ret = pass_card(upperdeck, &(theirs[0]), (*flow >= 0) ? 2 : 1, msg);
 	if (ret < 0) {
 		close(sv[1]);
+		if (*flow >= 0) {
+			close(*flow);
+		}
 		return -1;
 	}
 	return sv[1];
 }
 
-struct card_receiver {
-	struct card_receiver *next;
-	pthread_t self;
-	int upperdeck;
-	int card_number;
-};
-
-static void
-accept_card(void *arg, int fd, const char *name_in)
-{
-	struct card_receiver *r = (struct card_receiver *)arg;
-	size_t namelen = strlen(name_in);
-	if ((namelen < 1) || (name_in[namelen-1] != '.') || (name_in[0] != '.')) {
-		close(fd);
-		return;
-	}
-	char *name_out = alloca(strlen(name_in) + 15);
-	sprintf(name_out, ".%d.%s", r->card_number, name_in+1);
-	(void)pass_card(r->upperdeck, fd, name_out);
-}
-
-struct acceptor_args {
-	int master_socket;
-	int upperdeck;
-	int next_card_number;
-	struct card_receiver *card_receivers;
-};
-
-static void
-acceptor_cleanup(void *arg)
+/* Take the pty the cardserver answers a card with, and give it the
+   settings openpty() would have. Returns -1 if there was none, and
+   then we make our own. */
+static int
+take_pty(int upperdeck, int *ptymaster, int *ptyslave, struct tty_settings *ts)
 {
-	struct acceptor_args *a = (struct acceptor_args *)arg;
-	void *unused;
-
-	close(a->master_socket);
-	while (a->card_receivers) {
-		struct card_receiver *r = a->card_receivers;
-		a->card_receivers = r->next;
-		pthread_cancel(r->self);
-		pthread_join(r->self, &unused);
+	struct pollfd pfd;
+	char buf[16];
+	int fds[2], nfds = 2;
+
+	/* A cardserver that does not know about pools never answers. */
+	pfd.fd = upperdeck;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, CARD_PTY_WAIT_MSEC) <= 0) {
+		return -1;
 	}
-}
-
-static void *
-acceptor(void *arg)
-{
-	struct acceptor_args *a = (struct acceptor_args *)arg;
-	struct sockaddr_un sa;
-	socklen_t salen;
-	int s;
-	struct card_receiver *receiver;
-
-	pthread_cleanup_push(acceptor_cleanup, arg);
-	for (;;) {
-		salen = sizeof(sa);
-		s = accept(a->master_socket, (struct sockaddr *)(&sa), &salen);
-		if (s < 0) {
-			perror("cardserver accept");
-			break;
-		}
-		receiver = malloc(sizeof(*receiver));
-		if (!receiver) {
-			perror("malloc");
-			close(s);
-			continue;
+	if ((recv_fds(upperdeck, buf, sizeof(buf), &(fds[0]), &nfds) < 0) || (nfds < 2)) {
+		if (nfds == 1) {
+			close(fds[0]);
 		}
-		memset(receiver, 0, sizeof(*receiver));
-		receiver->card_number = a->next_card_number++;
-		receiver->upperdeck = a->upperdeck;
-		receiver->next = a->card_receivers;
-		a->card_receivers = receiver;
-		receive_fds(s, accept_card, receiver, &(receiver->self));
-	}
-	pthread_cleanup_pop(1);
-	return NULL;
+		return -1;
+	}
+	if (ts->attrsp) {
+		tcsetattr(fds[1], TCSAFLUSH, ts->attrsp);
+	}
+	if (ts->winp) {
+		ioctl(fds[1], TIOCSWINSZ, ts->winp);
+	}
+	*ptymaster = fds[0];
+	*ptyslave = fds[1];
+	return 0;
 }
 
 int
-cardclient(int sock_to_cardserver, int *stdio_is_tty, struct tty_settings *ts,
-	int extra_fd_to_close_in_child, char **argv)
+cardclient(int sock_to_cardserver, const char *card_options,
+	int *stdio_is_tty, struct tty_settings *ts,
+	int extra_fd_to_close_in_child, int adopt_orphans, char **argv)
 {
-	int ptymaster, ptyslave, root_card;
+	int ptymaster, ptyslave, root_card, flow;
 	pid_t child;
 	int i;
-	int notify_pipe[2];
-	pthread_t waitpid_thread, acceptor_thread;
-	struct waitpid_thread_args waitpid_thread_args;
-	struct socket_param socket_param;
-	struct acceptor_args acceptor_args;
-	int master_socket;
-	void *unused;
-
-	root_card = make_card(sock_to_cardserver, ".");
+	int status;
+	char token[17];
+	const char *parent;
+	char *options;
+
+	/* The cardserver knows the card by this, and works out where to
+	   put cards started under it from it. */
+	snprintf(token, sizeof(token), "%016llx", (unsigned long long)random_u64());
+	parent = getenv(CARDDECK_PARENT_VAR_NAME);
+	if (!card_options) card_options = "";
+	options = alloca(strlen(card_options) + sizeof(token) + (parent ? strlen(parent) : 0) + 32);
+	sprintf(options, "%s\n" CARD_OPTION_TOKEN "=%s\n" CARD_OPTION_PTY "=1",
+		card_options, token);
+	if (parent) {
+		sprintf(options + strlen(options), "\n" CARD_OPTION_PARENT "=%s", parent);
+	}
+
+	root_card = make_card(sock_to_cardserver, ".", options, &flow);
 	if (root_card < 0) {
+		close(sock_to_cardserver);
 		return 1;
 	}
+	if (take_pty(sock_to_cardserver, &ptymaster, &ptyslave, ts) < 0) {
+		ptymaster = -1;
+	}
+	/* That is all the cardserver needs from this connection. Hanging
+	   up now lets it stop listening to it straight away. */
+	close(sock_to_cardserver);
 
-	master_socket = setup_socket(&socket_param);
-	if (master_socket >= 0) {
-		memset(&acceptor_args, 0, sizeof(acceptor_args));
-		acceptor_args.master_socket = master_socket;
-		acceptor_args.upperdeck = sock_to_cardserver;
-		pthread_create(&acceptor_thread, NULL, acceptor, &acceptor_args);
+	/* Whatever the child leaves running when it exits is handed to us
+	   instead of to init, so that we can see it through to the end
+	   without getting out of its way first. */
+	if (adopt_orphans) {
+		prctl(PR_SET_CHILD_SUBREAPER, 1);
 	}
 
-	if (openpty(&ptymaster, &ptyslave, NULL, ts->attrsp, ts->winp) < 0) {
+	if ((ptymaster < 0) && (openpty(&ptymaster, &ptyslave, NULL, ts->attrsp, ts->winp) < 0)) {
 		perror("openpty");
 		return 1;
 	}
@@ -382,14 +582,11 @@ cardclient(int sock_to_cardserver, int *stdio_is_tty, struct tty_settings *ts,
 	}
 	if (child == 0) {
 		close(ptymaster);
-		close(sock_to_cardserver);
 		close(root_card);
-		if (master_socket >= 0) {
-			close(master_socket);
-			putenv(socket_param.env_var);
-		} else {
-			putenv(CARDDECK_SOCKET_VAR_NAME "=(error)");
+		if (flow >= 0) {
+			close(flow);
 		}
+		setenv(CARDDECK_PARENT_VAR_NAME, token, 1);
 		if (extra_fd_to_close_in_child != -1) {
 			close(extra_fd_to_close_in_child);
 		}
@@ -409,32 +606,17 @@ cardclient(int sock_to_cardserver, int *stdio_is_tty, struct tty_settings *ts,
 	}
 	close(ptyslave);
 
-	if (pipe(&(notify_pipe[0])) == 0) {
-		waitpid_thread_args.pid = child;
-		waitpid_thread_args.notify_fd = notify_pipe[1];
-		pthread_create(&waitpid_thread, NULL, do_waitpid, &waitpid_thread_args);
-	} else {
-		/* I guess we are not going to watch the child! */
-		notify_pipe[0] = -1;
-	}
-
 	/* Just copy, but also wait for the child. */
-	childio(root_card, ptymaster, notify_pipe[0]);
+	status = childio(root_card, flow, ptymaster, child, adopt_orphans);
 
-	if (master_socket >= 0) {
-		pthread_cancel(acceptor_thread);
-	}
 	close(root_card);
-	close(ptymaster);
-	if (notify_pipe[0] != -1) {
-		close(notify_pipe[0]);
-	}
-	cleanup_socket(&socket_param);
-	pthread_join(waitpid_thread, &unused);
-	if (master_socket >= 0) {
-		pthread_join(acceptor_thread, &unused);
+	if (flow >= 0) {
+		close(flow);
 	}
-	close(sock_to_cardserver);
+	close(ptymaster);
 
-	return WEXITSTATUS(waitpid_thread_args.status);
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
 }
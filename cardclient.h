@@ -23,10 +23,15 @@ struct tty_settings {
    initialize the settings of the new pty we will create. */
 void collect_tty_settings(int ttyfd, struct tty_settings *);
 
-/* Returns the child's exit status */
+/* Returns the child's exit status, or 128 plus the signal that killed
+   it, once it and anything it left running have let go of the pty. */
 int cardclient(
-	/* Must be already connected. */
+	/* Must be already connected. Closed once the card has been
+	   handed over. */
 	int sock_to_cardserver,
+	/* Options for the new card, each "\n" key=value (see global.h),
+	   or NULL. */
+	const char *card_options,
 	/* Array of 3 ints. Indicates which stdio fds already have
 	   a tty connected. Those and only those will, in the child
 	   process, be replaced with the new pty we allocate. */
@@ -36,6 +41,10 @@ int cardclient(
 	struct tty_settings *,
 	/* In case you need it (deck.c does). If not used, set to -1. */
 	int extra_fd_to_close_in_child,
+	/* Nonzero if nothing else in this process has children, so that
+	   whatever the child leaves running can be adopted and collected
+	   here. Otherwise only the child itself is waited for. */
+	int adopt_orphans,
 	/* The child process to run. */
 	char **argv
 );
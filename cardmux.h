@@ -4,46 +4,320 @@
 /* Defines the common structures shared by cardserver.[ch] and stub.[ch] */
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include "ioloop.h"
+#include "ring.h"
+#include "scrollback.h"
+#include "credit.h"
+#include "screen.h"
+#include "buffer.h"
+#include "ptypool.h"
+
+/* Default share of the tty for a card, and the most it may ask for. */
+#define CARD_DEFAULT_WEIGHT 4
+#define CARD_MAX_WEIGHT 64
+
+/* Counters which the control socket reads while they are being updated.
+   Each one only ever has one writer at a time (the card's loop, or
+   whoever holds tty_lock for the totals), so updating them is a plain
+   load and store and never a locked instruction. */
+struct card_sched_stats {
+	atomic_ullong bytes;		/* written to the renderer */
+	atomic_ullong turns;		/* times given the tty */
+	atomic_ullong preempted;	/* turns ended by the quantum running out */
+	atomic_ullong yielded;		/* turns cut short for a card being typed at */
+	atomic_ullong wait_nsec;	/* total time waiting for the tty */
+	atomic_ullong max_wait_nsec;
+	atomic_ullong hold_nsec;	/* total time owning the tty */
+	atomic_ullong max_hold_nsec;
+};
+
+static inline void
+stat_add(atomic_ullong *s, unsigned long long n)
+{
+	atomic_store_explicit(s, atomic_load_explicit(s, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static inline void
+stat_max(atomic_ullong *s, unsigned long long n)
+{
+	if (n > atomic_load_explicit(s, memory_order_relaxed)) {
+		atomic_store_explicit(s, n, memory_order_relaxed);
+	}
+}
+
+static inline unsigned long long
+stat_get(const atomic_ullong *s)
+{
+	return atomic_load_explicit((atomic_ullong *)s, memory_order_relaxed);
+}
+
+/* Durations in buckets by powers of 2 of microseconds: bucket 0 is
+   under 2us, bucket i is from 2^i up to 2^(i+1)us, and the last one
+   is everything longer. */
+#define STATS_HIST_BUCKETS 24
+
+struct stats_hist {
+	atomic_ullong count[STATS_HIST_BUCKETS];
+};
+
+/* Kept for each I/O thread, which is the only one to write to it,
+   and added up only when somebody asks. */
+struct loop_stats {
+	struct stats_hist tty_wait;	/* from claim_tty() to take_tty() */
+	struct stats_hist tty_hold;	/* from take_tty() to give_up_tty() */
+};
+
+enum tty_state {
+	TTY_NONE,	/* neither have nor want the tty */
+	TTY_WAITING,	/* queued in claim_tty() */
+	TTY_GRANTED,	/* it is ours but the renderer was not told yet */
+	TTY_OWNED,
+};
 
 struct cardclient {
-	struct cardclient *next;
-	struct cardclient *prev;
+	uint32_t id;
 	const char *card_name;
-
-	/* For other clients to ask for ownership of the tty */
-	int notify_pipe;
+	/* The cardclient's, as the socket it came on says */
+	pid_t pid;
+	/* Cards nested in this one name it by this, see new_card(). */
+	uint64_t token;
+	/* Numbers the next card nested in this one. Only touched on the
+	   loop that creates cards. */
+	unsigned int next_child;
 
 	/* private */
 	struct cardserver *srv;
 	int sock;
-	int notify_pipe_read;
-
-	pthread_mutex_t input_lock;
-	pthread_cond_t input_cv;
-	struct cardinput *input_head;
-	struct cardinput *input_tail;
-	int input_stop;
-	int input_broken;
+
+	/* Everything below is only touched from the loop thread the card
+	   lives on, except where noted. */
+	struct iowatch watch;
+	struct iowatch tty_watch;
+	struct iowatch flow_watch;
+	/* dup of the renderer's fd registered in our loop when we are
+	   waiting for the renderer to accept more output, or -1, and
+	   which renderer it was (see srv->renderer_gen). */
+	int tty_watch_fd;
+	unsigned int tty_watch_gen;
+	int sock_readable;
+	int sock_writable;
+	int client_running;
+	int tty_running;
+	int tty_blocked;
+
+	/* The socket on which the client and we give each other credit
+	   (see global.h), or -1 if it did not come with one. */
+	int flow_sock;
+	int flow_readable;
+	int flow_blocked;
+	/* What we let the client send */
+	struct credit output_credit;
+	/* How much input the client has let us send in all, and how much
+	   we have. Also read by the renderer's input thread, and input_sent
+	   is written by it when it sends input directly. */
+	atomic_ullong input_limit;
+	atomic_ullong input_sent;
+
+	/* Protected by srv->tty_lock */
+	enum tty_state tty_state;
+	struct cardclient *next_tty_waiter;
+	struct timespec claimed_at;
+	struct timespec took_tty_at;
+
+	/* Output scheduling: the card's share of the tty relative to
+	   others, and how many more bytes it may write in its turn. */
+	unsigned int weight;
+	size_t deficit;
+	size_t turn_bytes;
+	struct timespec time_last_written_anything;
+	struct card_sched_stats sched_stats;
+	/* Read from the client by the loop, and accepted from the
+	   renderer by its input thread. Readable from anywhere. */
+	atomic_ullong bytes_from_client;
+	atomic_ullong bytes_to_client;
+	/* Output read from the client and not yet taken by the renderer */
+	struct buffer buf;
+
+	/* The card's screen, if it asked for its output to be cut down to
+	   what changes on it when it falls behind (see screen.h). All
+	   output goes through it. */
+	struct screen *screen;
+	/* Output has been waiting, in buf or on the socket, since
+	   backlog_since. */
+	int backlogged;
+	struct timespec backlog_since;
+	/* Fallen behind: output goes only to the screen, and what changes
+	   on it is sent as frames, no sooner than next_frame each. */
+	int eliding;
+	struct timespec next_frame;
+	const char *frame;
+	size_t frame_len;
+	size_t frame_off;
+	/* Output never sent as it was because of that, or cut out of the
+	   middle (below). Readable from anywhere. */
+	atomic_ullong bytes_elided;
+
+	/* A card without a screen may instead ask for the middle of its
+	   output to be cut out when the tty falls far behind, keeping the
+	   latest. How much has been cut since the tty was last told so, and
+	   the note saying so, while it is being written. */
+	int tail_only;
+	unsigned long long tail_cut;
+	char cut_note[64];
+	size_t cut_note_len;
+	size_t cut_note_off;
+
+	/* Input from the renderer which needs to be sent to the client.
+	   The renderer's input thread is the only producer and the card's
+	   loop is the only consumer. */
+	struct ring input;
+	/* No more input will be sent: the renderer said so or the client
+	   stopped taking it. */
+	atomic_int input_closed;
+	/* The renderer's input thread is waiting for room in the ring. */
+	atomic_int input_wanted;
+
+	/* Everything the client has output. Appended to by the card's
+	   loop as output is read from the client. */
+	struct scrollback scrollback;
+	/* Set from elsewhere when a new renderer has been attached, which
+	   has not seen anything from this card yet. */
+	atomic_int resync;
 };
 
 struct cardserver {
+	/* Only changed under tty_lock while no card has the tty, so the
+	   card that has it can use it without a lock. */
 	struct renderer *renderer;
+	/* Bumped each time the renderer is replaced. */
+	unsigned int renderer_gen;
+	/* What new_renderer() is asked for when a tty is attached. */
+	const char *renderer_name;
+	/* Taken while detaching from or attaching to a tty. */
+	pthread_mutex_t attach_lock;
+	/* The tty attached by cardserver_attach(), which is ours to close,
+	   and the socket to close to tell whoever passed it that we are
+	   done with it. -1 if none. */
+	int attached_fd;
+	int attach_sock;
+
+	struct card_registry *registry;
+	struct ring_pool *input_pool;
+	struct scrollback_store *scrollback;
+
+	/* The renderer's input thread waits for input_space_gen to change
+	   when a card's input ring is full. */
+	pthread_mutex_t input_space_lock;
+	pthread_cond_t input_space_cv;
+	unsigned int input_space_gen;
 
-	pthread_mutex_t clients_lock;
-	struct cardclient *clients_head;
-	struct cardclient *clients_tail;
+	/* The I/O threads. Cards are spread over them by id. */
+	struct ioloop **loops;
+	struct loop_stats *loop_stats;
+	int nloops;
 
-	pthread_mutex_t tty_owner_check_lock;
+	pthread_mutex_t tty_lock;
+	pthread_cond_t tty_cv;
 	struct cardclient *tty_owner;
+	struct cardclient *tty_waiters_head;
+	struct cardclient *tty_waiters_tail;
+	int tty_closed;
+	/* Nobody may have the tty while the renderer is being replaced. */
+	int tty_switching;
+	/* Totals over all cards, also protected by tty_lock */
+	struct card_sched_stats sched_stats;
+	/* The card last typed at, and when, as CLOCK_MONOTONIC nsec */
+	atomic_uint typed_card;
+	atomic_ullong typed_nsec;
+	/* Set under tty_lock while a card being typed at is at the head
+	   of the queue, so that the owner gives way as soon as it looks. */
+	atomic_int tty_yield;
 
-	pthread_mutex_t tty_owner_lock;
-	pthread_mutex_t tty_next_owner_lock;
+	/* If set, everything that goes through the deck is recorded
+	   there, see record.h */
+	struct record_log *record;
+
+	/* The control socket, see control.h */
+	int control_sock;
+	char *control_path;
+	pthread_t control_thread;
+
+	/* Numbers the next top-level card, like next_child. */
+	unsigned int next_top_level;
+
+	/* Ptys to hand to cards that ask, see global.h */
+	struct pty_pool ptys;
 
 	/* private */
 	int master_sock;
+	struct listener *listener;
 };
 
-void claim_tty(struct cardserver *srv, struct cardclient *for_client);
-void give_up_tty(struct cardserver *srv);
+/* The tty is shared out by deficit round robin. Cards that want it wait
+   in a queue and get it in turn. Each turn, a card may write
+   tty_quantum bytes for each unit of its weight (plus whatever it did
+   not get to use in its last turn, if it has been busy since). Once
+   that is used up the card goes to the back of the queue, unless
+   nobody else is waiting. A card with nothing to write hands the tty
+   on as soon as somebody else wants it. */
+
+/* Output from the card last typed at jumps the queue for a while after
+   each keystroke, and whoever has the tty gives way to it right away
+   rather than at the end of its turn, so that echo is never stuck
+   behind busy cards. */
+
+/* Ask for the tty on behalf of c, without blocking. If it was free, c gets
+   it right away. Otherwise c is queued, at the front if it is being
+   typed at (and the current owner can find out with tty_is_wanted());
+   c->tty_state becomes TTY_GRANTED and c's loop is kicked when its
+   turn comes. Either way the card must then call take_tty() once it
+   sees TTY_GRANTED. */
+void claim_tty(struct cardserver *srv, struct cardclient *c);
+
+/* Called from c's own loop once it has been granted the tty. Tells the
+   renderer that further output is for c and starts c's turn. */
+void take_tty(struct cardserver *srv, struct cardclient *c);
+
+/* c owns the tty and has written all it may this turn. If anybody else
+   is waiting, give up the tty and return 1. Otherwise start another
+   turn for c and return 0. */
+int tty_quantum_spent(struct cardserver *srv, struct cardclient *c);
+
+/* c owns the tty and has more to write. If a card being typed at is
+   waiting for it, give up the tty and return 1, keeping what is left of
+   c's quantum for its next turn. Otherwise return 0. */
+int tty_give_way(struct cardserver *srv, struct cardclient *c);
+
+/* c must own the tty. Pass it on to the next card waiting for it, if any. */
+void give_up_tty(struct cardserver *srv, struct cardclient *c);
+
+/* c is going away. Drop it from the tty queue or give the tty up,
+   whichever applies. */
+void forget_tty(struct cardserver *srv, struct cardclient *c);
+
+/* Is any other card waiting for the tty? */
+int tty_is_wanted(struct cardserver *srv);
+
+/* Read c->tty_state, which may be changed by other threads. */
+enum tty_state get_tty_state(struct cardserver *srv, struct cardclient *c);
+
+/* Called from c's loop when its input ring has drained, or c is going
+   away. Wakes the renderer's input thread if it is waiting for c. */
+void input_drained(struct cardserver *srv, struct cardclient *c);
+
+/* When the renderer's tty goes away (its input ends), the deck carries
+   on without one: output is thrown away as it comes, as it is all in
+   the scrollback anyway. A new tty can then be attached in its place.
+   Each card starts it off with a snapshot of what it last showed: its
+   screen, if it keeps one, or else the tail of its output.
+   Returns 0, or -1 with errno EBUSY if there is still a tty attached,
+   or as set by new_renderer(). On success fd and sock belong to the cardserver,
+   which closes sock once it has finished with fd. */
+int cardserver_attach(struct cardserver *srv, int fd, int sock);
 
 #endif /* _DECK_CARDMUX_H */
@@ -3,86 +3,693 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <termios.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include "global.h"
 #include "cardserver.h"
 #include "cardmux.h"
 #include "stub.h"
+#include "registry.h"
+#include "control.h"
+#include "ring.h"
 #include "util.h"
 #include "renderer.h"
+#include "record.h"
 
-void
-claim_tty(struct cardserver *srv, struct cardclient *c)
+/* Cards are spread over at most this many I/O threads. */
+const int max_io_threads = 4;
+
+/* A card may write this many bytes to the tty per turn for each unit
+   of its weight. */
+const size_t tty_quantum = 1024;
+
+/* Output from the card last typed at goes first for this long after
+   each keystroke. Input of up to keystroke_max bytes at once counts as
+   typing; more is a paste or a program, and gets no priority. */
+const unsigned long long keystroke_priority_nsec = 200*1000*1000ULL;
+const size_t keystroke_max = 64;
+
+/* Scrollback of all cards together is kept in memory up to this size,
+   and beyond that in a temporary file up to the second size. */
+const size_t scrollback_memory_budget = 32*1024*1024;
+const size_t scrollback_disk_budget = 1024*1024*1024;
+
+static unsigned long long
+nsec_since(const struct timespec *then)
 {
-	struct cardclient *other_client;
-	const char *dummy = "1";
+	struct timespec now;
 
-	pthread_mutex_lock(&(srv->tty_next_owner_lock));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000000LL + (now.tv_nsec - then->tv_nsec);
+}
 
-	pthread_mutex_lock(&(srv->tty_owner_check_lock));
-	other_client = srv->tty_owner;
-	if (other_client) {
-		write(other_client->notify_pipe, &dummy, 1);
+static unsigned long long
+monotonic_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* The stats of the I/O thread c runs on. */
+static struct loop_stats *
+card_loop_stats(struct cardserver *srv, struct cardclient *c)
+{
+	return &(srv->loop_stats[c->id % srv->nloops]);
+}
+
+static void
+hist_add(struct stats_hist *h, unsigned long long nsec)
+{
+	unsigned long long usec = nsec / 1000;
+	int i = 0;
+
+	while ((usec >= 2) && (i < STATS_HIST_BUCKETS-1)) {
+		usec >>= 1;
+		i++;
 	}
-	pthread_mutex_unlock(&(srv->tty_owner_check_lock));
+	stat_add(&(h->count[i]), 1);
+}
+
+/* Must hold tty_lock */
+static void
+count_turn(struct card_sched_stats *s, unsigned long long waited)
+{
+	stat_add(&(s->turns), 1);
+	stat_add(&(s->wait_nsec), waited);
+	stat_max(&(s->max_wait_nsec), waited);
+}
 
-	pthread_mutex_lock(&(srv->tty_owner_lock));
-	pthread_mutex_lock(&(srv->tty_owner_check_lock));
+/* Must hold tty_lock */
+static void
+count_hold(struct card_sched_stats *s, unsigned long long bytes, unsigned long long held)
+{
+	stat_add(&(s->bytes), bytes);
+	stat_add(&(s->hold_nsec), held);
+	stat_max(&(s->max_hold_nsec), held);
+}
+
+/* Must hold tty_lock. Called from c's loop. */
+static void
+end_turn(struct cardserver *srv, struct cardclient *c)
+{
+	unsigned long long held = 0;
+
+	if (c->tty_state == TTY_OWNED) {
+		held = nsec_since(&(c->took_tty_at));
+		hist_add(&(card_loop_stats(srv, c)->tty_hold), held);
+	}
+	count_hold(&(c->sched_stats), c->turn_bytes, held);
+	count_hold(&(srv->sched_stats), c->turn_bytes, held);
+	c->turn_bytes = 0;
+}
+
+/* Must hold tty_lock. Whether the tty is to be kept from every card,
+   for now or for good. */
+static int
+tty_held(struct cardserver *srv)
+{
+	return srv->tty_closed || srv->tty_switching;
+}
+
+/* Must hold tty_lock */
+static void
+grant_tty(struct cardserver *srv, struct cardclient *c)
+{
 	srv->tty_owner = c;
-	pthread_mutex_unlock(&(srv->tty_owner_check_lock));
+	c->tty_state = TTY_GRANTED;
+}
 
-	pthread_mutex_unlock(&(srv->tty_next_owner_lock));
+static int
+being_typed_at(struct cardserver *srv, struct cardclient *c)
+{
+	return (atomic_load(&(srv->typed_card)) == c->id) &&
+		(monotonic_nsec() - atomic_load(&(srv->typed_nsec)) < keystroke_priority_nsec);
+}
 
-	if (c != NULL) {
-		srv->renderer->intf->claim(srv->renderer, c->card_name);
+/* Must hold tty_lock. Put c in the queue of cards waiting for the tty,
+   at the front if it is being typed at, in which case the owner is
+   asked to give way. */
+static void
+queue_for_tty(struct cardserver *srv, struct cardclient *c, int typed)
+{
+	if (typed) {
+		c->next_tty_waiter = srv->tty_waiters_head;
+		srv->tty_waiters_head = c;
+		if (!(srv->tty_waiters_tail)) {
+			srv->tty_waiters_tail = c;
+		}
+		atomic_store(&(srv->tty_yield), 1);
+		return;
+	}
+	c->next_tty_waiter = NULL;
+	if (srv->tty_waiters_tail) {
+		srv->tty_waiters_tail->next_tty_waiter = c;
+	} else {
+		srv->tty_waiters_head = c;
+	}
+	srv->tty_waiters_tail = c;
+}
+
+/* Must hold tty_lock. Take c, which is waiting, out of the queue. */
+static void
+unqueue_for_tty(struct cardserver *srv, struct cardclient *c)
+{
+	struct cardclient **cp, *prev = NULL;
+
+	if (srv->tty_waiters_head == c) {
+		/* Whoever it was put at the front for is not there now. */
+		atomic_store(&(srv->tty_yield), 0);
+	}
+	for (cp = &(srv->tty_waiters_head); *cp; cp = &((*cp)->next_tty_waiter)) {
+		if (*cp == c) {
+			*cp = c->next_tty_waiter;
+			if (srv->tty_waiters_tail == c) {
+				srv->tty_waiters_tail = prev;
+			}
+			return;
+		}
+		prev = *cp;
 	}
 }
 
 void
-give_up_tty(struct cardserver *srv)
+claim_tty(struct cardserver *srv, struct cardclient *c)
+{
+	struct cardclient *owner;
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	if (c->tty_state != TTY_NONE) {
+		/* Already asked. */
+		pthread_mutex_unlock(&(srv->tty_lock));
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &(c->claimed_at));
+	if ((!(srv->tty_owner)) && (!tty_held(srv))) {
+		grant_tty(srv, c);
+		pthread_mutex_unlock(&(srv->tty_lock));
+		return;
+	}
+	c->tty_state = TTY_WAITING;
+	queue_for_tty(srv, c, being_typed_at(srv, c));
+	owner = srv->tty_owner;
+	if (owner) {
+		/* Let it know that somebody else wants the tty */
+		ioloop_kick(&(owner->watch));
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
+}
+
+/* Must hold tty_lock */
+static void
+pass_tty_on(struct cardserver *srv)
 {
-	srv->renderer->intf->claim_none(srv->renderer);
+	struct cardclient *next;
 
-	pthread_mutex_lock(&(srv->tty_owner_check_lock));
 	srv->tty_owner = NULL;
-	pthread_mutex_unlock(&(srv->tty_owner_check_lock));
+	if (tty_held(srv)) {
+		pthread_cond_broadcast(&(srv->tty_cv));
+		return;
+	}
+	next = srv->tty_waiters_head;
+	if (next) {
+		srv->tty_waiters_head = next->next_tty_waiter;
+		if (!(srv->tty_waiters_head)) {
+			srv->tty_waiters_tail = NULL;
+		}
+		atomic_store(&(srv->tty_yield), 0);
+		grant_tty(srv, next);
+		ioloop_kick(&(next->watch));
+	}
+}
+
+void
+take_tty(struct cardserver *srv, struct cardclient *c)
+{
+	unsigned long long waited;
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	c->tty_state = TTY_OWNED;
+	clock_gettime(CLOCK_MONOTONIC, &(c->took_tty_at));
+	waited = nsec_since(&(c->claimed_at));
+	count_turn(&(c->sched_stats), waited);
+	count_turn(&(srv->sched_stats), waited);
+	pthread_mutex_unlock(&(srv->tty_lock));
+	hist_add(&(card_loop_stats(srv, c)->tty_wait), waited);
+	c->deficit += tty_quantum * c->weight;
+	srv->renderer->intf->claim(srv->renderer, c->id, c->card_name);
+}
+
+int
+tty_quantum_spent(struct cardserver *srv, struct cardclient *c)
+{
+	pthread_mutex_lock(&(srv->tty_lock));
+	if ((!(srv->tty_waiters_head)) && (!tty_held(srv))) {
+		pthread_mutex_unlock(&(srv->tty_lock));
+		c->deficit += tty_quantum * c->weight;
+		return 0;
+	}
+	stat_add(&(c->sched_stats.preempted), 1);
+	stat_add(&(srv->sched_stats.preempted), 1);
+	pthread_mutex_unlock(&(srv->tty_lock));
+	give_up_tty(srv, c);
+	return 1;
+}
+
+int
+tty_give_way(struct cardserver *srv, struct cardclient *c)
+{
+	/* Checked on every pass of a busy card, so without the lock
+	   until there is something to do. */
+	if (!atomic_load(&(srv->tty_yield))) {
+		return 0;
+	}
+	pthread_mutex_lock(&(srv->tty_lock));
+	if ((!atomic_load(&(srv->tty_yield))) || (srv->tty_owner != c)) {
+		pthread_mutex_unlock(&(srv->tty_lock));
+		return 0;
+	}
+	stat_add(&(c->sched_stats.yielded), 1);
+	stat_add(&(srv->sched_stats.yielded), 1);
+	pthread_mutex_unlock(&(srv->tty_lock));
+	give_up_tty(srv, c);
+	return 1;
+}
+
+void
+give_up_tty(struct cardserver *srv, struct cardclient *c)
+{
+	if (c->tty_state == TTY_OWNED) {
+		srv->renderer->intf->claim_none(srv->renderer);
+	}
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	end_turn(srv, c);
+	c->tty_state = TTY_NONE;
+	pass_tty_on(srv);
+	pthread_mutex_unlock(&(srv->tty_lock));
+}
+
+void
+forget_tty(struct cardserver *srv, struct cardclient *c)
+{
+	switch (get_tty_state(srv, c)) {
+	case TTY_NONE:
+		return;
+	case TTY_GRANTED:
+	case TTY_OWNED:
+		give_up_tty(srv, c);
+		return;
+	case TTY_WAITING:
+		break;
+	}
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	if (c->tty_state == TTY_WAITING) {
+		unqueue_for_tty(srv, c);
+		c->tty_state = TTY_NONE;
+		pthread_mutex_unlock(&(srv->tty_lock));
+		return;
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
+	/* We were granted it in the meantime. */
+	give_up_tty(srv, c);
+}
+
+int
+tty_is_wanted(struct cardserver *srv)
+{
+	int wanted;
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	wanted = (srv->tty_waiters_head != NULL) || tty_held(srv);
+	pthread_mutex_unlock(&(srv->tty_lock));
+	return wanted;
+}
+
+enum tty_state
+get_tty_state(struct cardserver *srv, struct cardclient *c)
+{
+	enum tty_state state;
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	state = c->tty_state;
+	pthread_mutex_unlock(&(srv->tty_lock));
+	return state;
+}
 
-	pthread_mutex_unlock(&(srv->tty_owner_lock));
+void
+input_drained(struct cardserver *srv, struct cardclient *c)
+{
+	/* Pairs with the fence in input_callback(): either we see that
+	   it is waiting, or it sees the room we made. */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load(&(c->input_wanted))) {
+		return;
+	}
+	if (!atomic_exchange(&(c->input_wanted), 0)) {
+		return;
+	}
+	pthread_mutex_lock(&(srv->input_space_lock));
+	srv->input_space_gen++;
+	pthread_cond_broadcast(&(srv->input_space_cv));
+	pthread_mutex_unlock(&(srv->input_space_lock));
+}
+
+/* Stands in for the renderer while no tty is attached. */
+static void
+detached_set_input_callback(
+	struct renderer *i,
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg),
+	void *callback_arg
+)
+{
+}
+
+static void
+detached_destroy(struct renderer *i)
+{
+}
+
+static ssize_t
+detached_write(struct renderer *i, const void *buf, size_t count)
+{
+	return count;
+}
+
+static void
+detached_claim(struct renderer *i, uint32_t card_id, const char *card_name)
+{
+}
+
+static void
+detached_claim_none(struct renderer *i)
+{
+}
+
+static int
+detached_check_ready(struct renderer *i, struct pollfd *pfd)
+{
+	return 0;
+}
+
+static const struct renderer_interface detached_renderer_interface = {
+	.set_input_callback = detached_set_input_callback,
+	.destroy = detached_destroy,
+	.write = detached_write,
+	.claim = detached_claim,
+	.claim_none = detached_claim_none,
+	.check_ready_for_output = detached_check_ready,
+};
+
+static struct renderer detached_renderer = {
+	.intf = &detached_renderer_interface,
+};
+
+/* Wait until no card has the tty, and keep it that way until
+   resume_tty(). */
+static void
+pause_tty(struct cardserver *srv)
+{
+	pthread_mutex_lock(&(srv->tty_lock));
+	srv->tty_switching = 1;
+	while (srv->tty_owner) {
+		ioloop_kick(&(srv->tty_owner->watch));
+		pthread_cond_wait(&(srv->tty_cv), &(srv->tty_lock));
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
+}
+
+/* Carry on with r as the renderer. */
+static void
+resume_tty(struct cardserver *srv, struct renderer *r)
+{
+	pthread_mutex_lock(&(srv->tty_lock));
+	srv->renderer = r;
+	srv->renderer_gen++;
+	srv->tty_switching = 0;
+	if (!(srv->tty_owner)) {
+		pass_tty_on(srv);
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
+}
+
+/* Must hold attach_lock */
+static void
+release_attached(struct cardserver *srv)
+{
+	if (srv->attached_fd >= 0) {
+		close(srv->attached_fd);
+		srv->attached_fd = -1;
+	}
+	if (srv->attach_sock >= 0) {
+		close(srv->attach_sock);
+		srv->attach_sock = -1;
+	}
+}
+
+/* The renderer's input has ended, which means its tty has gone. Called
+   on the renderer's input thread. */
+static void
+detach(struct cardserver *srv)
+{
+	struct renderer *old;
+
+	pthread_mutex_lock(&(srv->attach_lock));
+	old = srv->renderer;
+	if ((old == &detached_renderer) || srv->tty_closed) {
+		pthread_mutex_unlock(&(srv->attach_lock));
+		return;
+	}
+	pause_tty(srv);
+	resume_tty(srv, &detached_renderer);
+	old->intf->destroy(old);
+	release_attached(srv);
+	pthread_mutex_unlock(&(srv->attach_lock));
 }
 
 void
 cardserver_quit(struct cardserver *srv)
 {
-	/* Force anything that already has the tty to give it up */
-	claim_tty(srv, NULL);
+	control_stop(srv);
+	stop_listener(srv);
+
+	/* Force anything that already has the tty to give it up, and
+	   make sure nothing gets it after that. */
+	pthread_mutex_lock(&(srv->attach_lock));
+	pthread_mutex_lock(&(srv->tty_lock));
+	srv->tty_closed = 1;
+	while (srv->tty_owner) {
+		ioloop_kick(&(srv->tty_owner->watch));
+		pthread_cond_wait(&(srv->tty_cv), &(srv->tty_lock));
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
 	srv->renderer->intf->destroy(srv->renderer);
+	release_attached(srv);
+	pthread_mutex_unlock(&(srv->attach_lock));
+	if (srv->record) {
+		record_close(srv->record);
+	}
+
+	if (getenv(CARDDECK_IOSTATS_VAR_NAME)) {
+		struct card_sched_stats *s = &(srv->sched_stats);
+		unsigned long long turns = stat_get(&(s->turns));
+		fprintf(stderr, "deck: %llu bytes to the tty in %llu turns, "
+			"%llu cut short; waited %.3fms on average, %.3fms at most\n",
+			stat_get(&(s->bytes)), turns, stat_get(&(s->preempted)),
+			turns ? (stat_get(&(s->wait_nsec)) / 1e6 / turns) : 0.0,
+			stat_get(&(s->max_wait_nsec)) / 1e6);
+	}
+}
+
+/* In a registry read section. c was just typed at: give its output
+   priority for a while. */
+static void
+note_keystroke(struct cardserver *srv, struct cardclient *c)
+{
+	atomic_store(&(srv->typed_card), c->id);
+	atomic_store(&(srv->typed_nsec), monotonic_nsec());
+}
+
+/* Not in a read section, since it takes tty_lock. If the card typed at
+   is waiting for the tty, move it to the front. Cards in the queue are
+   still around while tty_lock is held, so it is looked for there. */
+static void
+hurry_typed_card(struct cardserver *srv, uint32_t id)
+{
+	struct cardclient *c, *owner = NULL;
+
+	pthread_mutex_lock(&(srv->tty_lock));
+	for (c = srv->tty_waiters_head; c; c = c->next_tty_waiter) {
+		if (c->id == id) break;
+	}
+	if (c && (srv->tty_waiters_head != c)) {
+		unqueue_for_tty(srv, c);
+		queue_for_tty(srv, c, 1);
+		owner = srv->tty_owner;
+	}
+	if (owner) {
+		ioloop_kick(&(owner->watch));
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
 }
 
 static void
-input_callback(void *data, size_t count, const char *card_name, void *arg)
+input_callback(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg)
 {
 	struct cardserver *srv = (struct cardserver *)arg;
 	struct cardclient *card;
+	uint32_t typed;
+	unsigned int gen = 0;
+	unsigned int section;
+	size_t n = 0;
 
-	pthread_mutex_lock(&(srv->clients_lock));
-	for (card = srv->clients_head; card; card = card->next) {
-		if (0 == strcmp(card_name, card->card_name)) break;
+	if (!data) {
+		detach(srv);
+		return;
 	}
-	if (card) {
-		card_input(card, data, count);
+	for (;;) {
+		typed = CARD_ID_NONE;
+		section = registry_read_lock(srv->registry);
+		if (card_id != CARD_ID_NONE) {
+			card = registry_lookup(srv->registry, card_id);
+		} else {
+			card = registry_lookup_name(srv->registry, card_name);
+		}
+		if (card) {
+			if (count <= keystroke_max) {
+				note_keystroke(srv, card);
+				typed = card->id;
+			}
+			n = card_input(card, data, count);
+			if (n < count) {
+				/* The card is not keeping up. Ask to be told when
+				   it has caught up, then check once more in case it
+				   did so just now. */
+				atomic_store(&(card->input_wanted), 1);
+				atomic_thread_fence(memory_order_seq_cst);
+				pthread_mutex_lock(&(srv->input_space_lock));
+				gen = srv->input_space_gen;
+				pthread_mutex_unlock(&(srv->input_space_lock));
+				n += card_input(card, (char *)data + n, count - n);
+			}
+			if (srv->record && n) {
+				record_add(srv->record, RECORD_INPUT, card->id, data, n);
+			}
+		}
+		registry_read_unlock(srv->registry, section);
+
+		if (typed != CARD_ID_NONE) {
+			hurry_typed_card(srv, typed);
+		}
+		if (!card) {
+			break;
+		}
+		if (n == count) {
+			return;
+		}
+		/* Push back on the renderer: take no more input from it until
+		   the card drains its queue or goes away. Not inside the read
+		   section because that would hold up card removal. */
+		data = (char *)data + n;
+		count -= n;
+		pthread_mutex_lock(&(srv->input_space_lock));
+		while (srv->input_space_gen == gen) {
+			pthread_cond_wait(&(srv->input_space_cv), &(srv->input_space_lock));
+		}
+		pthread_mutex_unlock(&(srv->input_space_lock));
 	}
-	pthread_mutex_unlock(&(srv->clients_lock));
 
-	if (!card) {
+	if (card_id != CARD_ID_NONE) {
+		fprintf(stderr, "Input for unknown card %u\n", (unsigned)card_id);
+	} else {
 		fprintf(stderr, "Input for unknown card \"%s\"\n", card_name);
 	}
 }
 
+/* In a registry read section */
+static void
+resync_card(struct cardclient *c, void *arg)
+{
+	atomic_store(&(c->resync), 1);
+	ioloop_kick(&(c->watch));
+}
+
+int
+cardserver_attach(struct cardserver *srv, int fd, int sock)
+{
+	struct renderer *r;
+	unsigned int section;
+
+	pthread_mutex_lock(&(srv->attach_lock));
+	if ((srv->renderer != &detached_renderer) || srv->tty_closed) {
+		pthread_mutex_unlock(&(srv->attach_lock));
+		errno = EBUSY;
+		return -1;
+	}
+	r = new_renderer(srv->renderer_name, fd);
+	if (!r) {
+		pthread_mutex_unlock(&(srv->attach_lock));
+		return -1;
+	}
+	r->intf->set_input_callback(r, input_callback, srv);
+	srv->attached_fd = fd;
+	srv->attach_sock = sock;
+	/* The cards must not get the tty until they have seen that they
+	   need to resync. */
+	pause_tty(srv);
+	section = registry_read_lock(srv->registry);
+	registry_foreach(srv->registry, resync_card, NULL);
+	registry_read_unlock(srv->registry, section);
+	resume_tty(srv, r);
+	pthread_mutex_unlock(&(srv->attach_lock));
+	return 0;
+}
+
+/* Every card started anywhere under the deck connects here directly,
+   however deeply it is nested. The name is in the abstract namespace so
+   there is nothing to clean up afterwards. */
+static int
+listen_for_cards(struct cardserver *srv)
+{
+	struct sockaddr_un sa;
+	socklen_t salen;
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "@carddeck.%d.%016llx",
+		(int)getpid(), (unsigned long long)random_u64());
+	salen = unix_socket_address(name, &sa);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("card socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sa, salen) < 0) {
+		perror("bind card socket");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, 64) < 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	srv->master_sock = fd;
+	setenv(CARDDECK_SOCKET_VAR_NAME, name, 1);
+	new_listener(srv, fd);
+	return 0;
+}
+
 struct cardserver *
-cardserver(struct renderer *renderer, int initial_client)
+cardserver(struct renderer *renderer, const char *renderer_name,
+	struct record_log *record, int initial_client)
 {
 	struct cardserver *srv;
+	int i, nloops;
 
 	srv = malloc(sizeof(*srv));
 	if (!srv) {
@@ -90,14 +697,66 @@ cardserver(struct renderer *renderer, int initial_client)
 		return NULL;
 	}
 	memset(srv, 0, sizeof(*srv));
-	pthread_mutex_init(&(srv->clients_lock), NULL);
+	srv->registry = registry_new();
+	srv->input_pool = ring_pool_new();
+	srv->scrollback = scrollback_store_new(scrollback_memory_budget, scrollback_disk_budget);
+	if ((!(srv->registry)) || (!(srv->input_pool)) || (!(srv->scrollback))) {
+		perror("cardserver startup: malloc failed");
+		free(srv);
+		return NULL;
+	}
 	srv->renderer = renderer;
+	srv->renderer_name = renderer_name;
+	srv->record = record;
+	srv->attached_fd = -1;
+	srv->attach_sock = -1;
+	atomic_init(&(srv->typed_card), CARD_ID_NONE);
+	atomic_init(&(srv->typed_nsec), 0);
+	atomic_init(&(srv->tty_yield), 0);
+	pthread_mutex_init(&(srv->attach_lock), NULL);
 	renderer->intf->set_input_callback(renderer, input_callback, srv);
-	pthread_mutex_init(&(srv->tty_owner_check_lock), NULL);
-	pthread_mutex_init(&(srv->tty_owner_lock), NULL);
-	pthread_mutex_init(&(srv->tty_next_owner_lock), NULL);
+	pthread_mutex_init(&(srv->tty_lock), NULL);
+	pthread_cond_init(&(srv->tty_cv), NULL);
+	pthread_mutex_init(&(srv->input_space_lock), NULL);
+	pthread_cond_init(&(srv->input_space_cv), NULL);
+
+	nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops < 1) nloops = 1;
+	if (nloops > max_io_threads) nloops = max_io_threads;
+	srv->loops = malloc(sizeof(struct ioloop *) * nloops);
+	srv->loop_stats = calloc(nloops, sizeof(struct loop_stats));
+	if ((!(srv->loops)) || (!(srv->loop_stats))) {
+		perror("cardserver startup: malloc failed");
+		free(srv->loops);
+		free(srv);
+		return NULL;
+	}
+	for (i = 0; i < nloops; i++) {
+		srv->loops[i] = ioloop_new();
+		if (!(srv->loops[i])) {
+			break;
+		}
+	}
+	srv->nloops = i;
+	if (srv->nloops == 0) {
+		free(srv->loops);
+		free(srv->loop_stats);
+		free(srv);
+		return NULL;
+	}
+
+	/* Topped up on the last loop, away from the one making cards
+	   where there is more than one. */
+	pty_pool_init(&(srv->ptys), srv->loops[srv->nloops-1]);
 
-	new_stub(srv, initial_client);
+	new_stub(srv, initial_client, getpid());
+	if (listen_for_cards(srv) < 0) {
+		/* Cards run inside will just run their command. */
+		srv->master_sock = -1;
+		setenv(CARDDECK_SOCKET_VAR_NAME, "(error)", 1);
+	}
+	/* Not fatal: the deck works fine without it. */
+	control_start(srv);
 
 	return srv;
 }
@@ -2,16 +2,23 @@
 #define _DECK_CARDSERVER_H
 
 /* A cardserver listens on a socket (master_sock) for connections from
-   cardclients. It will allocate a new card to each newly connected client.
+   cardclients, including ones nested inside other cards, which connect
+   to it directly. Its name is put in $CARDDECK_SOCKET. It will allocate
+   a new card to each newly connected client.
    It will multiplex the io from each card onto a single tty (ttyfd).
    initial_client is an already-accepted socket on which an initial client
-   (which gets card #0) will be started.
+   (which gets card #0) will be started. renderer_name is what renderer
+   was made by, and what will be made for a tty attached later.
+   If record is given, the cards' output and input is recorded there
+   and it is closed on quitting.
 */
 
 struct cardserver;
 struct renderer;
+struct record_log;
 
-struct cardserver *cardserver(struct renderer *, int initial_client);
+struct cardserver *cardserver(struct renderer *, const char *renderer_name,
+	struct record_log *record, int initial_client);
 void cardserver_quit(struct cardserver *);
 
 #endif /* _DECK_CARDSERVER_H */
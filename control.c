@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "global.h"
+#include "control.h"
+#include "cardmux.h"
+#include "registry.h"
+#include "renderer.h"
+#include "util.h"
+
+/* What we could see of one card. */
+struct card_snapshot {
+	uint32_t id;
+	pid_t pid;
+	char name[64];
+	unsigned int weight;
+	unsigned long long from_client;
+	unsigned long long to_client;
+	unsigned long long elided;
+	size_t input_queued;
+	unsigned long long bytes;
+	unsigned long long turns;
+	unsigned long long preempted;
+	unsigned long long yielded;
+	unsigned long long wait_nsec;
+	unsigned long long max_wait_nsec;
+	unsigned long long hold_nsec;
+	unsigned long long max_hold_nsec;
+};
+
+struct snapshot {
+	struct card_snapshot *cards;
+	size_t ncards;
+	size_t size;
+};
+
+static void
+copy_sched_stats(struct card_snapshot *s, const struct card_sched_stats *st)
+{
+	s->bytes = stat_get(&(st->bytes));
+	s->turns = stat_get(&(st->turns));
+	s->preempted = stat_get(&(st->preempted));
+	s->yielded = stat_get(&(st->yielded));
+	s->wait_nsec = stat_get(&(st->wait_nsec));
+	s->max_wait_nsec = stat_get(&(st->max_wait_nsec));
+	s->hold_nsec = stat_get(&(st->hold_nsec));
+	s->max_hold_nsec = stat_get(&(st->max_hold_nsec));
+}
+
+/* In a registry read section, so just copy and go. */
+static void
+snapshot_card(struct cardclient *c, void *arg)
+{
+	struct snapshot *snap = (struct snapshot *)arg;
+	struct card_snapshot *s, *cards;
+	size_t size;
+
+	if (snap->ncards == snap->size) {
+		size = snap->size ? (snap->size * 2) : 16;
+		cards = realloc(snap->cards, size * sizeof(*cards));
+		if (!cards) return;
+		snap->cards = cards;
+		snap->size = size;
+	}
+	s = &(snap->cards[snap->ncards++]);
+	s->id = c->id;
+	s->pid = c->pid;
+	strncpy(s->name, c->card_name, sizeof(s->name)-1);
+	s->name[sizeof(s->name)-1] = 0;
+	s->weight = c->weight;
+	s->from_client = stat_get(&(c->bytes_from_client));
+	s->to_client = stat_get(&(c->bytes_to_client));
+	s->elided = stat_get(&(c->bytes_elided));
+	s->input_queued = ring_fill(&(c->input));
+	copy_sched_stats(s, &(c->sched_stats));
+}
+
+static void
+print_card(FILE *out, const struct card_snapshot *s, const char *id, const char *pid)
+{
+	fprintf(out, "%6s %7s %6u %12llu %12llu %10llu %6zu %8llu %8llu %8llu %9.3f %9.3f %9.3f %9.3f  %s\n",
+		id, pid, s->weight, s->from_client, s->elided, s->to_client, s->input_queued,
+		s->turns, s->preempted, s->yielded,
+		s->turns ? (s->wait_nsec / 1e6 / s->turns) : 0.0, s->max_wait_nsec / 1e6,
+		s->turns ? (s->hold_nsec / 1e6 / s->turns) : 0.0, s->max_hold_nsec / 1e6,
+		s->name);
+}
+
+static void
+print_hist(FILE *out, struct cardserver *srv, const char *title, size_t offset)
+{
+	unsigned long long count[STATS_HIST_BUCKETS];
+	struct stats_hist *h;
+	int i, j;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < srv->nloops; i++) {
+		h = (struct stats_hist *)((char *)(&(srv->loop_stats[i])) + offset);
+		for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+			count[j] += stat_get(&(h->count[j]));
+		}
+	}
+	fprintf(out, "\n%s\n", title);
+	for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+		if (!count[j]) continue;
+		if (j == STATS_HIST_BUCKETS-1) {
+			fprintf(out, "  >= %10lluus %12llu\n", 1ULL << j, count[j]);
+		} else {
+			fprintf(out, "  < %11lluus %12llu\n", 2ULL << j, count[j]);
+		}
+	}
+}
+
+static void
+print_stats(FILE *out, struct cardserver *srv)
+{
+	struct snapshot snap;
+	struct card_snapshot total;
+	struct cardclient *c;
+	uint32_t owner = CARD_ID_NONE;
+	struct pty_pool_stats ptys;
+	struct scrollback_stats sb;
+	double held = 0.0;
+	unsigned int section;
+	int nwaiting = 0, nready, target;
+	size_t i;
+
+	memset(&snap, 0, sizeof(snap));
+	section = registry_read_lock(srv->registry);
+	registry_foreach(srv->registry, snapshot_card, &snap);
+	registry_read_unlock(srv->registry, section);
+
+	fprintf(out, "tty owner:");
+	pthread_mutex_lock(&(srv->tty_lock));
+	if (srv->tty_owner) {
+		owner = srv->tty_owner->id;
+		if (srv->tty_owner->tty_state == TTY_OWNED) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			held = (now.tv_sec - srv->tty_owner->took_tty_at.tv_sec) * 1e3 +
+				(now.tv_nsec - srv->tty_owner->took_tty_at.tv_nsec) / 1e6;
+		}
+	}
+	if (owner != CARD_ID_NONE) {
+		fprintf(out, " %u for %.3fms", (unsigned)owner, held);
+	} else {
+		fprintf(out, " none");
+	}
+	fprintf(out, "\ntty waiting:");
+	for (c = srv->tty_waiters_head; c; c = c->next_tty_waiter) {
+		fprintf(out, " %u", (unsigned)(c->id));
+		nwaiting++;
+	}
+	pthread_mutex_unlock(&(srv->tty_lock));
+	fprintf(out, "%s\n", nwaiting ? "" : " none");
+	pty_pool_get_stats(&(srv->ptys), &ptys, &nready, &target);
+	fprintf(out, "pty pool: %d ready of %d wanted, %llu handed out, "
+		"%llu asked for when empty, %llu made, %llu dropped\n",
+		nready, target, ptys.handed_out, ptys.missed, ptys.made, ptys.dropped);
+	scrollback_store_get_stats(srv->scrollback, &sb);
+	fprintf(out, "scrollback: %zuKB in memory, %zuKB on disk, %lluKB dropped\n\n",
+		sb.memory_used / 1024, sb.disk_used / 1024, sb.dropped / 1024);
+
+	fprintf(out, "%6s %7s %6s %12s %12s %10s %6s %8s %8s %8s %9s %9s %9s %9s  %s\n",
+		"id", "pid", "weight", "out", "skipped", "in", "inq", "turns", "forced", "yielded",
+		"wait_ms", "maxwait", "hold_ms", "maxhold", "name");
+	for (i = 0; i < snap.ncards; i++) {
+		char id[16], pid[16];
+		snprintf(id, sizeof(id), "%u", (unsigned)(snap.cards[i].id));
+		snprintf(pid, sizeof(pid), "%d", (int)(snap.cards[i].pid));
+		print_card(out, &(snap.cards[i]), id, pid);
+	}
+	memset(&total, 0, sizeof(total));
+	copy_sched_stats(&total, &(srv->sched_stats));
+	for (i = 0; i < snap.ncards; i++) {
+		total.from_client += snap.cards[i].from_client;
+		total.to_client += snap.cards[i].to_client;
+		total.elided += snap.cards[i].elided;
+		total.input_queued += snap.cards[i].input_queued;
+	}
+	strcpy(total.name, "(all cards so far)");
+	print_card(out, &total, "total", "");
+	free(snap.cards);
+
+	print_hist(out, srv, "tty wait (claim to take)", offsetof(struct loop_stats, tty_wait));
+	print_hist(out, srv, "tty hold (take to give up)", offsetof(struct loop_stats, tty_hold));
+}
+
+/* Write out what the card named by args ("card [offset]") has output,
+   as far as its end when we started. A chunk at a time, each inside a
+   read section of its own, since the card can go away meanwhile. */
+static void
+print_scrollback(FILE *out, struct cardserver *srv, const char *args)
+{
+	char name[64], buf[4096];
+	struct cardclient *c;
+	unsigned long long from = 0, start, end = 0;
+	uint32_t id = CARD_ID_NONE;
+	unsigned int section;
+	size_t n = 0;
+
+	if (sscanf(args, "%63s %llu", name, &from) < 1) {
+		fprintf(out, "Usage: scrollback card [offset]\n");
+		return;
+	}
+	section = registry_read_lock(srv->registry);
+	/* Card names start with a '.', except the first card's which is
+	   empty, so anything else is an id. */
+	if (name[0] == '.') {
+		c = registry_lookup_name(srv->registry, name);
+	} else {
+		c = registry_lookup(srv->registry, (uint32_t)strtoul(name, NULL, 10));
+	}
+	if (c) {
+		id = c->id;
+		scrollback_range(&(c->scrollback), &start, &end);
+		if (from < start) from = start;
+	}
+	registry_read_unlock(srv->registry, section);
+	if (id == CARD_ID_NONE) {
+		fprintf(out, "No card \"%s\"\n", name);
+		return;
+	}
+	while (from < end) {
+		section = registry_read_lock(srv->registry);
+		c = registry_lookup(srv->registry, id);
+		if (c) {
+			n = scrollback_read(&(c->scrollback), from, buf,
+				(end - from < sizeof(buf)) ? (end - from) : sizeof(buf));
+		}
+		registry_read_unlock(srv->registry, section);
+		if ((!c) || (n == 0)) break;
+		if (fwrite(buf, 1, n, out) != n) break;
+		from += n;
+	}
+}
+
+static void
+serve(struct cardserver *srv, int fd)
+{
+	struct timeval timeout = { 1, 0 };
+	char cmd[64];
+	size_t len = 0;
+	ssize_t n;
+	FILE *out;
+	int tty = -1;
+	int sock, nfds;
+
+	/* Nobody gets to hold the control thread up for long. */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	while (len < sizeof(cmd)-1) {
+		/* "attach" comes with the tty to attach to. */
+		nfds = (tty < 0) ? 1 : 0;
+		n = recv_fds(fd, cmd + len, sizeof(cmd) - len, (tty < 0) ? &tty : NULL, &nfds);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (n == 0) break;
+		len += n;
+		if (memchr(cmd, '\n', len)) break;
+	}
+	cmd[len] = 0;
+	cmd[strcspn(cmd, "\r\n")] = 0;
+
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		if (tty >= 0) close(tty);
+		return;
+	}
+	if ((!(*cmd)) || (0 == strcmp(cmd, "stats"))) {
+		print_stats(out, srv);
+	} else if (0 == strncmp(cmd, "scrollback", 10) && ((cmd[10] == ' ') || (cmd[10] == 0))) {
+		print_scrollback(out, srv, cmd + 10);
+	} else if (0 == strcmp(cmd, "attach")) {
+		/* The deck keeps a copy of the connection, and closes it
+		   when it lets go of the tty, so the client can wait for
+		   that. */
+		sock = (tty >= 0) ? dup(fd) : -1;
+		if (tty < 0) {
+			fprintf(out, "attach needs a tty passed with it\n");
+		} else if ((sock < 0) || (cardserver_attach(srv, tty, sock) < 0)) {
+			fprintf(out, "Cannot attach: %s\n", (errno == EBUSY) ?
+				"the deck has a tty already" : strerror(errno));
+			if (sock >= 0) close(sock);
+			close(tty);
+		} else {
+			fprintf(out, "attached\n");
+		}
+		tty = -1;
+	} else {
+		fprintf(out, "Unknown command \"%s\". Try: stats, scrollback, attach\n", cmd);
+	}
+	if (tty >= 0) close(tty);
+	fclose(out);
+}
+
+static void *
+control_thread(void *arg)
+{
+	struct cardserver *srv = (struct cardserver *)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(srv->control_sock, NULL, NULL);
+		if (fd < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+			/* control_stop() shut the socket down. */
+			break;
+		}
+		serve(srv, fd);
+	}
+	return NULL;
+}
+
+int
+control_start(struct cardserver *srv)
+{
+	char socket_dir[] = "/tmp/carddeck.XXXXXX";
+	struct sockaddr_un socket_name;
+	int fd;
+
+	srv->control_sock = -1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("control socket");
+		return -1;
+	}
+	if (!mkdtemp(socket_dir)) {
+		perror("mkdtemp");
+		close(fd);
+		return -1;
+	}
+	memset(&socket_name, 0, sizeof(socket_name));
+	socket_name.sun_family = AF_UNIX;
+	snprintf(socket_name.sun_path, sizeof(socket_name.sun_path), "%s/ctl", socket_dir);
+	srv->control_path = strdup(socket_name.sun_path);
+	if (!(srv->control_path)) {
+		perror("malloc");
+		goto giveup;
+	}
+	if (bind(fd, (struct sockaddr*)&socket_name, sizeof(socket_name)) < 0) {
+		perror("bind control socket");
+		goto giveup;
+	}
+	if (listen(fd, 5) < 0) {
+		perror("listen");
+		goto giveup;
+	}
+	srv->control_sock = fd;
+	if (pthread_create(&(srv->control_thread), NULL, control_thread, srv) != 0) {
+		perror("pthread_create");
+		srv->control_sock = -1;
+		goto giveup;
+	}
+	/* Inherited by the first card and everything under it. */
+	setenv(CARDDECK_CONTROL_VAR_NAME, srv->control_path, 1);
+	return 0;
+
+giveup:
+	close(fd);
+	unlink(socket_name.sun_path);
+	rmdir(socket_dir);
+	free(srv->control_path);
+	srv->control_path = NULL;
+	return -1;
+}
+
+void
+control_stop(struct cardserver *srv)
+{
+	char *slash;
+
+	if (srv->control_sock < 0) {
+		return;
+	}
+	shutdown(srv->control_sock, SHUT_RDWR);
+	pthread_join(srv->control_thread, NULL);
+	close(srv->control_sock);
+	srv->control_sock = -1;
+	unlink(srv->control_path);
+	slash = strrchr(srv->control_path, '/');
+	*slash = 0;
+	rmdir(srv->control_path);
+	free(srv->control_path);
+	srv->control_path = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef _DECK_CONTROL_H
+#define _DECK_CONTROL_H
+
+/* The control socket lets tools outside the deck look inside it while
+   it runs. It is a unix socket in a private /tmp/carddeck.XXXXXX
+   directory, and its path is put in $CARDDECK_CONTROL for everything
+   started in the deck.
+
+   A client connects, sends one command line and reads the answer
+   until EOF. The commands are:
+     stats    per-card counters and the tty wait/hold histograms
+              (also what an empty command does)
+     scrollback card [offset]
+              the card's output (card is its id or name, as stats
+              shows them), from offset bytes into it, or from the
+              oldest the deck still has, up to where it was when asked
+     attach   comes with a tty fd (SCM_RIGHTS), which the deck takes
+              up if it has lost its own. The connection is then
+              held open until the deck lets go of that tty.
+
+   deckctl is the client. */
+
+struct cardserver;
+
+/* Returns 0, or -1 if the socket could not be set up, in which case
+   the deck just does without. */
+int control_start(struct cardserver *);
+void control_stop(struct cardserver *);
+
+#endif /* _DECK_CONTROL_H */
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "global.h"
+#include "credit.h"
+
+/* Bounds on the window. Below the minimum the round trips would start
+   to limit even a slow stream, and there is no point in more than the
+   kernel would buffer on the socket anyway. */
+const size_t credit_window_min = 8192;
+const size_t credit_window_max = 262144;
+
+/* Aim for this much output in flight at the rate it is being drained. */
+const long credit_target_nsec = 20*1000*1000;	/* 20ms */
+
+/* Measure the rate over at least this long. */
+const long credit_sample_nsec = 10*1000*1000;	/* 10ms */
+
+void
+credit_init(struct credit *cr)
+{
+	memset(cr, 0, sizeof(*cr));
+	cr->granted = CARD_CREDIT_INITIAL;
+	cr->window = CARD_CREDIT_INITIAL;
+	clock_gettime(CLOCK_MONOTONIC, &(cr->sample_at));
+}
+
+static void
+adapt_window(struct credit *cr, unsigned long long consumed, int backlogged)
+{
+	struct timespec now;
+	long long elapsed;
+	unsigned long long want;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - cr->sample_at.tv_sec) * 1000000000LL +
+		(now.tv_nsec - cr->sample_at.tv_nsec);
+	if (elapsed < credit_sample_nsec) {
+		return;
+	}
+	/* Only a stream with a backlog shows how fast it can be drained.
+	   Otherwise it is just quiet, which says nothing. */
+	if (backlogged) {
+		want = (consumed - cr->sample_consumed) * credit_target_nsec / elapsed;
+		if (want < credit_window_min) want = credit_window_min;
+		if (want > credit_window_max) want = credit_window_max;
+		/* Move a quarter of the way, so one odd sample does not
+		   throw it right off. */
+		cr->window = (3 * cr->window + want) / 4;
+	}
+	cr->sample_at = now;
+	cr->sample_consumed = consumed;
+}
+
+unsigned long long
+credit_due(struct credit *cr, unsigned long long consumed, int backlogged)
+{
+	unsigned long long limit;
+
+	adapt_window(cr, consumed, backlogged);
+	limit = consumed + cr->window;
+	/* Credit once given cannot be taken back, so a window that shrank
+	   just means waiting until consumption catches up. Otherwise top
+	   up only once a quarter of the window is used, to keep the
+	   messages down. */
+	if (limit < cr->granted + cr->window / 4) {
+		return 0;
+	}
+	return limit;
+}
+
+int
+credit_send(struct credit *cr, int fd, unsigned long long limit)
+{
+	uint64_t msg = limit;
+
+	if (send(fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(msg)) {
+		return -1;
+	}
+	cr->granted = limit;
+	return 0;
+}
+
+int
+credit_receive(int fd, unsigned long long *limit)
+{
+	uint64_t msg;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return 0;
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		if ((n == sizeof(msg)) && (msg > *limit)) {
+			*limit = msg;
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef _DECK_CREDIT_H
+#define _DECK_CREDIT_H
+
+/* The receiving side of credit-based flow control on a card's socket
+   (see global.h). The receiver keeps granting the sender a window of
+   credit ahead of what it has consumed. The window follows how fast
+   the receiver has consumed while it had a backlog, so that a stream
+   which is not being drained is only given a little room and its
+   producer soon has to wait, while a fast one gets enough not to be
+   held up by the round trips. */
+
+#include <stddef.h>
+#include <time.h>
+
+struct credit {
+	/* The limit last sent */
+	unsigned long long granted;
+	size_t window;
+	struct timespec sample_at;
+	unsigned long long sample_consumed;
+};
+
+void credit_init(struct credit *cr);
+
+/* consumed is how much of the stream has been taken in all, and
+   backlogged says whether more is waiting to be consumed than can be
+   right now. Returns the limit to send, or 0 if the one already sent
+   will do for now. */
+unsigned long long credit_due(struct credit *cr, unsigned long long consumed, int backlogged);
+
+/* Send limit on fd and remember it as granted. Returns -1 and leaves
+   it to be tried again if fd cannot take it right now. */
+int credit_send(struct credit *cr, int fd, unsigned long long limit);
+
+/* Read any grants from the other end of fd and raise *limit to
+   the highest. Returns 0, or -1 once the other end has closed. */
+int credit_receive(int fd, unsigned long long *limit);
+
+#endif /* _DECK_CREDIT_H */
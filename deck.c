@@ -1,12 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include "global.h"
 #include "cardclient.h"
 #include "cardserver.h"
 #include "renderer.h"
 #include "util.h"
+#include "record.h"
+
+static void
+ignore_signal(int sig)
+{
+}
 
 int
 main(int argc, char **argv)
@@ -14,15 +23,39 @@ main(int argc, char **argv)
 	int stdio_is_tty[3];
 	int ttyfd;
 	struct tty_settings ts;
+	const char *renderer_name = NULL;
+	const char *record_path = NULL;
+	struct record_log *record = NULL;
+	struct sigaction sa;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+r:R:")) != -1) {
+		switch (opt) {
+		case 'r':
+			renderer_name = optarg;
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s command [args...]\n"
+usage:
+		fprintf(stderr, "Usage: %s [-r renderer] [-R file] command [args...]\n"
 			"Starts the given command under a subordinate pty and\n"
 			"with a cardserver socket so that commands in the\n"
 			"current session can move themselves to sub-terminals\n"
 			"or sub-cards of the main one. The I/O on this\n"
 			"command's original tty becomes a multiplexed stream\n"
-			"of the IO on the main card and all its sub-cards.\n",
+			"of the IO on the main card and all its sub-cards.\n"
+			"The renderer decides what that stream looks like.\n"
+			"-R records all the cards' output and input in file,\n"
+			"which deckreplay can play back.\n",
 			argv[0]);
 		return 3;
 	}
@@ -36,14 +69,25 @@ fallback:
 		return 1;
 	}
 	collect_tty_settings(ttyfd, &ts);
+	if (record_path) {
+		/* Asked for, so not having it is not something to carry
+		   on without. */
+		record = record_open(record_path);
+		if (!record) {
+			return 1;
+		}
+	}
 
 	int sv[2];
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, &(sv[0])) < 0) {
+	/* Close-on-exec rather than closed in card #0's child: the
+	   cardserver closes its end once card #0 is set up, and the
+	   number could be something else by the time the child runs. */
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, &(sv[0])) < 0) {
 		perror("socketpair");
 		goto fallback;
 	}
 
-	struct renderer *renderer = new_renderer(ttyfd);
+	struct renderer *renderer = new_renderer(renderer_name, ttyfd);
 	if (!renderer) {
 		perror("no renderer");
 fallback2:
@@ -52,14 +96,27 @@ fallback2:
 		goto fallback;
 	}
 
-	struct cardserver *srv = cardserver(renderer, sv[0]);
+	struct cardserver *srv = cardserver(renderer, renderer_name, record, sv[0]);
 	if (!srv) {
 		goto fallback2;
 	}
 
-	/* The main thread becomes card #0 */
-	int status = cardclient(sv[1], &(stdio_is_tty[0]),
-		&ts, sv[0], argv+1);
+	/* Losing the tty detaches the deck from it, and "deckctl attach"
+	   can bring it back on another one, so a hangup must not kill it.
+	   A handler rather than SIG_IGN so that the cards' commands get
+	   the default back when they exec. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ignore_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &sa, NULL);
+
+	/* The main thread becomes card #0. It is at the top even if this
+	   deck is itself running in a card of another deck. Whatever its
+	   command leaves running is left to init, so that card #0 never
+	   collects children which other parts of the deck may have. */
+	unsetenv(CARDDECK_PARENT_VAR_NAME);
+	int status = cardclient(sv[1], NULL, &(stdio_is_tty[0]),
+		&ts, -1, 0, argv+1);
 
 	cardserver_quit(srv);
 	exit(status);
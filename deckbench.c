@@ -0,0 +1,768 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pty.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include "global.h"
+
+/* Runs a deck on a pty of its own with several cards writing to it at
+   the same time, reads everything that comes out of the pty as fast
+   as it can, and reports how the cards fared as JSON.
+
+   Each card runs this same program in producer mode, which writes
+   fixed-size lines "BENCH <card> <seq> <nsec> xxx...\n" where nsec is
+   CLOCK_MONOTONIC just before the line was written. The tty renderer
+   brackets each card's output with markers when it changes hands, so
+   lines that are split across turns can be put back together.
+
+   With -s it instead times starting cards. The deck's first card runs
+   this program in spawner mode, which starts cards one after another,
+   each running "echo SPAWN <n> <nsec>" with nsec taken just before it
+   was forked, and the time from then until the line comes out of the
+   pty is how long the card took to get going.
+
+   With -k it also types a KEYSTROKE at the deck every KEYSTROKE_NSEC
+   while the cards are busy, which goes to the deck's first card (the
+   shell running the others), and times how long the pty's echo of it
+   takes to come back through the deck. */
+
+#define MAX_CARDS 64
+#define MIN_MSG_SIZE 64
+#define MAX_MSG_SIZE 65536
+#define MAX_LINE (MAX_MSG_SIZE + 16)
+
+/* Nothing else the deck or the cards write has one of these. */
+#define KEYSTROKE '~'
+#define KEYSTROKE_NSEC 20000000ULL
+
+struct card_spec {
+	int weight;
+	/* Bytes per second, 0 for as fast as possible */
+	double rate;
+	size_t msg_size;
+};
+
+struct card_result {
+	unsigned long long bytes;
+	unsigned long long messages;
+	/* Bytes received before the first card finished, while every
+	   card was still competing. */
+	unsigned long long window_bytes;
+	unsigned long long *latencies;
+	size_t nlatencies;
+	size_t latencies_size;
+	int done;
+};
+
+/* Output is attributed to whichever card the renderer said it was
+   from. Each has its own partial line. */
+struct stream {
+	char name[64];
+	char line[MAX_LINE];
+	size_t len;
+};
+
+struct bench {
+	int ncards;
+	struct card_spec cards[MAX_CARDS];
+	struct card_result results[MAX_CARDS];
+
+	struct stream streams[MAX_CARDS + 2];
+	int nstreams;
+	struct stream *cur;
+
+	unsigned long long first_nsec;
+	unsigned long long last_nsec;
+	unsigned long long window_nsec;
+	unsigned long long handoffs;
+	int any_done;
+
+	/* From the deck's own report at exit, if it made one */
+	int have_deck_stats;
+	unsigned long long deck_bytes, deck_turns, deck_cut_short;
+	double deck_wait_avg_ms, deck_wait_max_ms;
+
+	/* With -k, when each keystroke was typed and how long each
+	   took to echo */
+	int keystrokes;
+	unsigned long long *typed;
+	size_t ntyped, typed_size;
+	struct card_result echoes;
+
+	/* With -s, from spawn to first byte for each card started */
+	struct card_result spawns;
+	unsigned long long spawn_nsec;
+};
+
+static unsigned long long
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+write_all(int fd, const char *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = write(fd, buf, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Producer mode: runs inside a card. */
+static int
+produce(int card, double rate, size_t msg_size, double seconds)
+{
+	char *msg = malloc(msg_size);
+	unsigned long long start, deadline, due, t, seq = 0;
+	struct timespec ts;
+	int n;
+
+	if (!msg) {
+		perror("malloc");
+		return 1;
+	}
+	memset(msg, 'x', msg_size);
+	msg[msg_size-1] = '\n';
+	start = now_nsec();
+	deadline = start + (unsigned long long)(seconds * 1e9);
+	for (;;) {
+		t = now_nsec();
+		if (rate > 0) {
+			due = start + (unsigned long long)(seq * msg_size * 1e9 / rate);
+			if (t < due) {
+				ts.tv_sec = due / 1000000000ULL;
+				ts.tv_nsec = due % 1000000000ULL;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				t = now_nsec();
+			}
+		}
+		if (t >= deadline) break;
+		n = snprintf(msg, msg_size, "BENCH %d %llu %llu ", card, seq, t);
+		msg[n] = 'x';
+		if (write_all(1, msg, msg_size) < 0) {
+			perror("write");
+			return 1;
+		}
+		seq++;
+	}
+	n = snprintf(msg, msg_size, "BENCH %d %llu %llu END\n", card, seq, now_nsec());
+	write_all(1, msg, n);
+	return 0;
+}
+
+/* Spawner mode: runs inside the deck's first card, and waits for each
+   card it starts to finish before starting the next, so that what is
+   measured is a card starting and not cards queueing. */
+static int
+spawn(const char *dir, int count)
+{
+	char card[PATH_MAX];
+	char arg[64];
+	unsigned long long start = now_nsec();
+	pid_t pid;
+	int i, status;
+
+	snprintf(card, sizeof(card), "%s/card", dir);
+	for (i = 0; i < count; i++) {
+		snprintf(arg, sizeof(arg), "SPAWN %d %llu", i, now_nsec());
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			execl(card, card, "echo", arg, (char *)NULL);
+			perror(card);
+			_exit(127);
+		}
+		while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR));
+	}
+	printf("SPAWN END %d %llu\n", count, now_nsec() - start);
+	return 0;
+}
+
+static struct stream *
+find_stream(struct bench *b, const char *name, size_t namelen)
+{
+	int i;
+
+	if (namelen >= sizeof(b->streams[0].name)) {
+		namelen = sizeof(b->streams[0].name) - 1;
+	}
+	for (i = 0; i < b->nstreams; i++) {
+		if ((strlen(b->streams[i].name) == namelen) &&
+				(0 == memcmp(b->streams[i].name, name, namelen))) {
+			return &(b->streams[i]);
+		}
+	}
+	if (b->nstreams == sizeof(b->streams)/sizeof(b->streams[0])) {
+		/* Lump any extras together. */
+		return &(b->streams[b->nstreams-1]);
+	}
+	i = b->nstreams++;
+	memcpy(b->streams[i].name, name, namelen);
+	b->streams[i].name[namelen] = 0;
+	b->streams[i].len = 0;
+	return &(b->streams[i]);
+}
+
+static void
+add_latency(struct card_result *r, unsigned long long nsec)
+{
+	unsigned long long *l;
+	size_t size;
+
+	if (r->nlatencies == r->latencies_size) {
+		size = r->latencies_size ? (r->latencies_size * 2) : 4096;
+		l = realloc(r->latencies, size * sizeof(*l));
+		if (!l) return;
+		r->latencies = l;
+		r->latencies_size = size;
+	}
+	r->latencies[r->nlatencies++] = nsec;
+}
+
+static void
+got_line(struct bench *b, char *line, size_t len, unsigned long long now)
+{
+	struct card_result *r;
+	unsigned long long seq, sent;
+	int card, n, i;
+
+	line[len] = 0;
+	if (5 == sscanf(line, "deck: %llu bytes to the tty in %llu turns, "
+			"%llu cut short; waited %lfms on average, %lfms at most",
+			&(b->deck_bytes), &(b->deck_turns), &(b->deck_cut_short),
+			&(b->deck_wait_avg_ms), &(b->deck_wait_max_ms))) {
+		b->have_deck_stats = 1;
+		return;
+	}
+	if (2 == sscanf(line, "SPAWN END %d %llu", &card, &(b->spawn_nsec))) {
+		b->spawns.done = 1;
+		return;
+	}
+	if (2 == sscanf(line, "SPAWN %d %llu", &card, &sent)) {
+		b->spawns.messages++;
+		add_latency(&(b->spawns), (now > sent) ? (now - sent) : 0);
+		return;
+	}
+	if (3 != sscanf(line, "BENCH %d %llu %llu %n", &card, &seq, &sent, &n)) {
+		return;
+	}
+	if ((card < 0) || (card >= b->ncards)) return;
+	r = &(b->results[card]);
+	if (0 == strncmp(line + n, "END", 3)) {
+		r->done = 1;
+		if (!(b->any_done)) {
+			b->any_done = 1;
+			b->window_nsec = now - b->first_nsec;
+			for (i = 0; i < b->ncards; i++) {
+				b->results[i].window_bytes = b->results[i].bytes;
+			}
+		}
+		return;
+	}
+	if (!(b->first_nsec)) b->first_nsec = now;
+	b->last_nsec = now;
+	r->bytes += len + 1;
+	r->messages++;
+	add_latency(r, (now > sent) ? (now - sent) : 0);
+}
+
+static void
+parse(struct bench *b, const char *buf, size_t count)
+{
+	unsigned long long now = now_nsec();
+	static const char from[] = "From card \"";
+	struct stream *s;
+	char *open;
+	size_t i;
+	char ch;
+
+	for (i = 0; i < count; i++) {
+		s = b->cur;
+		ch = buf[i];
+		if ((ch == KEYSTROKE) && (s == &(b->streams[0])) &&
+				(b->echoes.nlatencies < b->ntyped)) {
+			add_latency(&(b->echoes), now - b->typed[b->echoes.nlatencies]);
+			continue;
+		}
+		if (ch == '\r') continue;
+		if (ch == '\n') {
+			if ((s->len >= 3) && (0 == memcmp(s->line + s->len - 3, "}}}", 3))) {
+				/* End of a card's turn */
+				s->len -= 3;
+				b->cur = &(b->streams[0]);
+				continue;
+			}
+			got_line(b, s->line, s->len, now);
+			s->len = 0;
+			continue;
+		}
+		if (s->len < MAX_LINE-1) {
+			s->line[s->len++] = ch;
+		}
+		if ((ch == '{') && (s->len >= 3 + sizeof(from)) &&
+				(0 == memcmp(s->line + s->len - 3, "{{{", 3))) {
+			s->line[s->len] = 0;
+			open = memmem(s->line, s->len, from, sizeof(from)-1);
+			if (open) {
+				/* Start of a card's turn: the name is between
+				   the quotes. */
+				s->len = open - s->line;
+				open += sizeof(from)-1;
+				b->cur = find_stream(b, open, strlen(open) - 5);
+				b->handoffs++;
+			}
+		}
+	}
+}
+
+static int
+compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_usec(unsigned long long *l, size_t n, int p)
+{
+	size_t i;
+
+	if (n == 0) return 0.0;
+	i = n * p / 100;
+	if (i >= n) i = n - 1;
+	return l[i] / 1e3;
+}
+
+/* Type a keystroke at the deck. */
+static void
+type_keystroke(struct bench *b, int master)
+{
+	unsigned long long *t;
+	size_t size;
+	const char ch = KEYSTROKE;
+
+	if (b->ntyped == b->typed_size) {
+		size = b->typed_size ? (b->typed_size * 2) : 1024;
+		t = realloc(b->typed, size * sizeof(*t));
+		if (!t) return;
+		b->typed = t;
+		b->typed_size = size;
+	}
+	b->typed[b->ntyped] = now_nsec();
+	if (write(master, &ch, 1) == 1) {
+		b->ntyped++;
+	}
+}
+
+/* What each card should have got out of total bytes if the tty were
+   shared by weight: cards asking for less than their share get what
+   they ask for and the rest is divided among the others, again by
+   weight. */
+static void
+fair_shares(struct bench *b, double total, double seconds, double *fair)
+{
+	double left = total, demand, per_weight;
+	int i, weight, changed = 1;
+
+	for (i = 0; i < b->ncards; i++) {
+		fair[i] = -1;
+	}
+	while (changed) {
+		changed = 0;
+		weight = 0;
+		for (i = 0; i < b->ncards; i++) {
+			if (fair[i] < 0) weight += b->cards[i].weight;
+		}
+		if (weight == 0) break;
+		per_weight = left / weight;
+		for (i = 0; i < b->ncards; i++) {
+			if ((fair[i] >= 0) || (b->cards[i].rate == 0)) continue;
+			demand = b->cards[i].rate * seconds;
+			if (demand < per_weight * b->cards[i].weight) {
+				fair[i] = demand;
+				left -= demand;
+				changed = 1;
+			}
+		}
+	}
+	for (i = 0; i < b->ncards; i++) {
+		if (fair[i] < 0) fair[i] = per_weight * b->cards[i].weight;
+	}
+}
+
+static void
+report(struct bench *b, FILE *out, const char *renderer, double seconds)
+{
+	unsigned long long total = 0, window_total = 0, messages = 0;
+	unsigned long long *all;
+	size_t nall = 0;
+	double elapsed, sum = 0.0, sumsq = 0.0, x, fairness;
+	double fair[MAX_CARDS];
+	int i;
+
+	if (!(b->any_done)) {
+		/* No card got to the end, so the window is all there was. */
+		b->window_nsec = b->last_nsec - b->first_nsec;
+	}
+	for (i = 0; i < b->ncards; i++) {
+		total += b->results[i].bytes;
+		messages += b->results[i].messages;
+		nall += b->results[i].nlatencies;
+		if (!(b->any_done)) {
+			b->results[i].window_bytes = b->results[i].bytes;
+		}
+		window_total += b->results[i].window_bytes;
+	}
+	/* Jain's index over what each card got relative to its fair
+	   share, so that 1.0 means the tty was shared exactly by weight. */
+	fair_shares(b, window_total, b->window_nsec / 1e9, fair);
+	for (i = 0; i < b->ncards; i++) {
+		x = fair[i] ? (b->results[i].window_bytes / fair[i]) : 1.0;
+		sum += x;
+		sumsq += x * x;
+	}
+	fairness = (sumsq > 0) ? (sum * sum / (b->ncards * sumsq)) : 0.0;
+	elapsed = (b->last_nsec > b->first_nsec) ? ((b->last_nsec - b->first_nsec) / 1e9) : 0.0;
+
+	all = malloc((nall ? nall : 1) * sizeof(*all));
+	nall = 0;
+	for (i = 0; i < b->ncards; i++) {
+		qsort(b->results[i].latencies, b->results[i].nlatencies,
+			sizeof(unsigned long long), compare_ull);
+		if (all) {
+			memcpy(all + nall, b->results[i].latencies,
+				b->results[i].nlatencies * sizeof(*all));
+			nall += b->results[i].nlatencies;
+		}
+	}
+	if (all) qsort(all, nall, sizeof(*all), compare_ull);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"renderer\": \"%s\",\n", renderer);
+	fprintf(out, "  \"seconds\": %.3f,\n", seconds);
+	fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(out, "  \"window_s\": %.3f,\n", b->window_nsec / 1e9);
+	fprintf(out, "  \"bytes\": %llu,\n", total);
+	fprintf(out, "  \"messages\": %llu,\n", messages);
+	fprintf(out, "  \"aggregate_mb_s\": %.3f,\n", elapsed ? (total / elapsed / 1e6) : 0.0);
+	fprintf(out, "  \"fairness_index\": %.4f,\n", fairness);
+	fprintf(out, "  \"handoffs\": %llu,\n", b->handoffs);
+	fprintf(out, "  \"latency_us\": { \"p50\": %.1f, \"p99\": %.1f },\n",
+		percentile_usec(all, nall, 50), percentile_usec(all, nall, 99));
+	if (b->keystrokes) {
+		struct card_result *e = &(b->echoes);
+		qsort(e->latencies, e->nlatencies, sizeof(unsigned long long), compare_ull);
+		fprintf(out, "  \"echo_us\": { \"typed\": %zu, \"echoed\": %zu, "
+			"\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f },\n",
+			b->ntyped, e->nlatencies,
+			percentile_usec(e->latencies, e->nlatencies, 50),
+			percentile_usec(e->latencies, e->nlatencies, 99),
+			percentile_usec(e->latencies, e->nlatencies, 100));
+	}
+	if (b->have_deck_stats) {
+		fprintf(out, "  \"deck\": { \"bytes\": %llu, \"turns\": %llu, \"cut_short\": %llu, "
+			"\"wait_avg_ms\": %.3f, \"wait_max_ms\": %.3f },\n",
+			b->deck_bytes, b->deck_turns, b->deck_cut_short,
+			b->deck_wait_avg_ms, b->deck_wait_max_ms);
+	}
+	fprintf(out, "  \"cards\": [\n");
+	for (i = 0; i < b->ncards; i++) {
+		struct card_result *r = &(b->results[i]);
+		fprintf(out, "    { \"card\": %d, \"weight\": %d, \"rate_b_s\": %.0f, \"msg_size\": %zu, "
+			"\"bytes\": %llu, \"messages\": %llu, \"mb_s\": %.3f, "
+			"\"share\": %.4f, \"fair_share\": %.4f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f }%s\n",
+			i, b->cards[i].weight, b->cards[i].rate, b->cards[i].msg_size,
+			r->bytes, r->messages, elapsed ? (r->bytes / elapsed / 1e6) : 0.0,
+			window_total ? ((double)(r->window_bytes) / window_total) : 0.0,
+			window_total ? (fair[i] / window_total) : 0.0,
+			percentile_usec(r->latencies, r->nlatencies, 50),
+			percentile_usec(r->latencies, r->nlatencies, 99),
+			(i == b->ncards-1) ? "" : ",");
+	}
+	fprintf(out, "  ]\n}\n");
+	free(all);
+}
+
+static void
+report_spawns(struct bench *b, FILE *out, const char *renderer, int count)
+{
+	struct card_result *r = &(b->spawns);
+
+	qsort(r->latencies, r->nlatencies, sizeof(unsigned long long), compare_ull);
+	fprintf(out, "{\n");
+	fprintf(out, "  \"renderer\": \"%s\",\n", renderer);
+	fprintf(out, "  \"spawns\": %d,\n", count);
+	fprintf(out, "  \"seen\": %llu,\n", r->messages);
+	fprintf(out, "  \"elapsed_s\": %.3f,\n", b->spawn_nsec / 1e9);
+	fprintf(out, "  \"spawns_per_s\": %.1f,\n",
+		b->spawn_nsec ? (count / (b->spawn_nsec / 1e9)) : 0.0);
+	fprintf(out, "  \"first_byte_us\": { \"p50\": %.1f, \"p90\": %.1f, "
+		"\"p99\": %.1f, \"max\": %.1f }\n",
+		percentile_usec(r->latencies, r->nlatencies, 50),
+		percentile_usec(r->latencies, r->nlatencies, 90),
+		percentile_usec(r->latencies, r->nlatencies, 99),
+		percentile_usec(r->latencies, r->nlatencies, 100));
+	fprintf(out, "}\n");
+}
+
+static int
+parse_spec(const char *arg, struct card_spec *spec)
+{
+	char *end;
+
+	spec->weight = strtol(arg, &end, 10);
+	if ((*end != ':') || (spec->weight < 1)) return -1;
+	spec->rate = strtod(end+1, &end);
+	if ((*end != ':') || (spec->rate < 0)) return -1;
+	spec->msg_size = strtoul(end+1, &end, 10);
+	if ((*end) || (spec->msg_size < MIN_MSG_SIZE) || (spec->msg_size > MAX_MSG_SIZE)) return -1;
+	return 0;
+}
+
+static void
+print_usage(FILE *out, const char *name)
+{
+	fprintf(out, "Usage: %s [-d dir] [-t seconds] [-o file] [-k] [weight:rate:size ...]\n"
+		"       %s [-d dir] [-o file] -s count\n"
+		"Runs the deck and card found in dir (default .) on a new\n"
+		"pty, with one card per weight:rate:size writing lines of\n"
+		"size bytes at rate bytes per second (0 for flat out)\n"
+		"for the given time (default 5s), and writes results\n"
+		"as JSON to file or stdout. Up to %d cards, each of\n"
+		"weight 1 or more writing lines of %d to %d bytes.\n"
+		"With -k it also types at the deck while they run and\n"
+		"reports how long the echo took. With -s it instead starts\n"
+		"count cards one at a time and reports how long each\n"
+		"took from being started to its first output.\n",
+		name, name, MAX_CARDS, MIN_MSG_SIZE, MAX_MSG_SIZE);
+}
+
+static const char *default_specs[] = {
+	"4:0:128", "4:0:128", "1:0:4096", "16:0:80",
+};
+
+int
+main(int argc, char **argv)
+{
+	struct bench *b;
+	const char *dir = ".";
+	const char *renderer = "tty";
+	const char *outname = NULL;
+	double seconds = 5.0;
+	int spawns = 0;
+	int keystrokes = 0;
+	unsigned long long next_keystroke = 0, stop_typing = 0;
+	int timeout;
+	char self[PATH_MAX];
+	char count[16];
+	char *script, *p;
+	size_t script_size;
+	struct winsize win;
+	struct pollfd pfd;
+	char buf[65536];
+	FILE *out = stdout;
+	unsigned long long give_up;
+	pid_t pid;
+	int opt, i, master, status;
+	ssize_t n;
+
+	while ((opt = getopt(argc, argv, "+hd:t:o:ks:P:S:")) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(stdout, argv[0]);
+			return 0;
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			if (seconds <= 0) goto usage;
+			break;
+		case 'o':
+			outname = optarg;
+			break;
+		case 'k':
+			keystrokes = 1;
+			break;
+		case 's':
+			spawns = atoi(optarg);
+			if (spawns < 1) goto usage;
+			break;
+		case 'P':
+			{
+				struct card_spec spec;
+				char *colon = strchr(optarg, ':');
+				if ((!colon) || (parse_spec(colon+1, &spec) < 0)) goto usage;
+				return produce(atoi(optarg), spec.rate, spec.msg_size, seconds);
+			}
+		case 'S':
+			return spawn(dir, atoi(optarg));
+		default:
+			goto usage;
+		}
+	}
+
+	b = malloc(sizeof(*b));
+	if (!b) {
+		perror("malloc");
+		return 1;
+	}
+	memset(b, 0, sizeof(*b));
+	if (optind == argc) {
+		for (i = 0; i < sizeof(default_specs)/sizeof(default_specs[0]); i++) {
+			parse_spec(default_specs[i], &(b->cards[b->ncards++]));
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		if ((b->ncards == MAX_CARDS) || (parse_spec(argv[i], &(b->cards[b->ncards++])) < 0)) {
+usage:
+			print_usage(stderr, argv[0]);
+			return 3;
+		}
+	}
+
+	n = readlink("/proc/self/exe", self, sizeof(self)-1);
+	if (n < 0) {
+		perror("readlink /proc/self/exe");
+		return 1;
+	}
+	self[n] = 0;
+	script_size = 100 + b->ncards * (strlen(dir) + strlen(self) + 100);
+	script = malloc(script_size);
+	if (!script) {
+		perror("malloc");
+		return 1;
+	}
+	p = script;
+	for (i = 0; i < b->ncards; i++) {
+		p += sprintf(p, "'%s/card' -w %d '%s' -t %g -P %d:%d:%.0f:%zu & ",
+			dir, b->cards[i].weight, self, seconds, i,
+			b->cards[i].weight, b->cards[i].rate, b->cards[i].msg_size);
+	}
+	strcpy(p, "wait");
+
+	memset(&win, 0, sizeof(win));
+	win.ws_row = 24;
+	win.ws_col = 80;
+	pid = forkpty(&master, NULL, NULL, &win);
+	if (pid < 0) {
+		perror("forkpty");
+		return 1;
+	}
+	if (pid == 0) {
+		char deck[PATH_MAX];
+		snprintf(deck, sizeof(deck), "%s/deck", dir);
+		if (spawns) {
+			snprintf(count, sizeof(count), "%d", spawns);
+			execl(deck, deck, "-r", renderer, self, "-d", dir, "-S", count, (char *)NULL);
+		} else {
+			setenv(CARDDECK_IOSTATS_VAR_NAME, "1", 1);
+			execl(deck, deck, "-r", renderer, "sh", "-c", script, (char *)NULL);
+		}
+		perror(deck);
+		_exit(127);
+	}
+
+	/* Allow plenty for start up and for draining. */
+	if (spawns) seconds = spawns / 100.0;
+	give_up = now_nsec() + (unsigned long long)((seconds + 30) * 1e9);
+	b->nstreams = 1;
+	b->cur = &(b->streams[0]);
+	b->keystrokes = keystrokes && !spawns;
+	if (b->keystrokes) {
+		/* Give the cards a moment to get going first. */
+		next_keystroke = now_nsec() + 200000000ULL;
+		stop_typing = now_nsec() + (unsigned long long)(seconds * 1e9);
+	}
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (now_nsec() > give_up) {
+			fprintf(stderr, "deckbench: deck did not finish, killing it\n");
+			kill(pid, SIGKILL);
+			break;
+		}
+		timeout = 1000;
+		if (next_keystroke) {
+			if (now_nsec() >= next_keystroke) {
+				type_keystroke(b, master);
+				next_keystroke += KEYSTROKE_NSEC;
+				if (next_keystroke >= stop_typing) {
+					next_keystroke = 0;
+				}
+			}
+			if (next_keystroke) {
+				timeout = (next_keystroke > now_nsec()) ?
+					((next_keystroke - now_nsec()) / 1000000 + 1) : 0;
+			}
+		}
+		n = poll(&pfd, 1, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		if (n == 0) continue;
+		n = read(master, buf, sizeof(buf));
+		if (n < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+			/* EIO once the deck and everything else has
+			   closed the pty. */
+			break;
+		}
+		if (n == 0) break;
+		parse(b, buf, n);
+	}
+	waitpid(pid, &status, 0);
+
+	if (outname) {
+		out = fopen(outname, "w");
+		if (!out) {
+			perror(outname);
+			return 1;
+		}
+	}
+	if (spawns) {
+		report_spawns(b, out, renderer, spawns);
+		if (out != stdout) fclose(out);
+		if (!(b->spawns.done)) {
+			fprintf(stderr, "deckbench: the spawner did not finish\n");
+			return 1;
+		}
+		return 0;
+	}
+	report(b, out, renderer, seconds);
+	if (out != stdout) fclose(out);
+	for (i = 0; i < b->ncards; i++) {
+		if (!(b->results[i].done)) {
+			fprintf(stderr, "deckbench: card %d did not finish\n", i);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "global.h"
+
+static int
+connect_to_deck(const char *path)
+{
+	struct sockaddr_un control_socket_name;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&control_socket_name, 0, sizeof(control_socket_name));
+	control_socket_name.sun_family = AF_UNIX;
+	strncpy(control_socket_name.sun_path, path, sizeof(control_socket_name.sun_path)-1);
+	if (connect(sock,
+			(struct sockaddr*)&control_socket_name,
+			sizeof(control_socket_name)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Send the command with fd attached. */
+static int
+send_with_fd(int sock, const char *cmd, int fd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec io;
+	char c_buffer[CMSG_SPACE(sizeof(int))];
+
+	io.iov_base = (void *)cmd;
+	io.iov_len = strlen(cmd);
+	memset(&msg, 0, sizeof(msg));
+	memset(c_buffer, 0, sizeof(c_buffer));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	msg.msg_control = c_buffer;
+	msg.msg_controllen = sizeof(c_buffer);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memmove(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, 0);
+}
+
+/* Hand our tty to the deck at path. Returns 1 if it took it, which
+   is once it has let go of it again by the time this returns. */
+static int
+attach(const char *path, int tty)
+{
+	char buf[256];
+	size_t len = 0;
+	ssize_t n;
+	int sock;
+
+	sock = connect_to_deck(path);
+	if (sock < 0) {
+		perror(path);
+		return 0;
+	}
+	if (send_with_fd(sock, "attach\n", tty) < 0) {
+		perror("sendmsg");
+		close(sock);
+		return 0;
+	}
+	while ((len < sizeof(buf)-1) && (!memchr(buf, '\n', len))) {
+		n = read(sock, buf + len, sizeof(buf)-1 - len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (n == 0) break;
+		len += n;
+	}
+	buf[len] = 0;
+	if (strcmp(buf, "attached\n")) {
+		fprintf(stderr, "%s: %s", path, len ? buf : "no answer\n");
+		close(sock);
+		return 0;
+	}
+	/* The deck has the tty now. Stay out of its way until it closes
+	   the connection, which it does when it detaches or exits. */
+	while ((n = read(sock, buf, sizeof(buf))) != 0) {
+		if ((n < 0) && (errno != EINTR)) break;
+	}
+	close(sock);
+	return 1;
+}
+
+/* Without a socket named, try each of our decks in turn until one
+   takes the tty. */
+static int
+attach_any(int tty)
+{
+	struct stat st;
+	glob_t g;
+	size_t i;
+	int done = 0;
+
+	if (glob("/tmp/carddeck.*/ctl", 0, NULL, &g) != 0) {
+		fprintf(stderr, "No decks found\n");
+		return 1;
+	}
+	for (i = 0; (!done) && (i < g.gl_pathc); i++) {
+		if ((stat(g.gl_pathv[i], &st) < 0) || (st.st_uid != getuid())) {
+			continue;
+		}
+		done = attach(g.gl_pathv[i], tty);
+	}
+	globfree(&g);
+	if (!done) {
+		fprintf(stderr, "No deck took the tty\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int
+run_attach(const char *path)
+{
+	int tty = 0;
+
+	if (!isatty(tty)) {
+		tty = open("/dev/tty", O_RDWR);
+		if (tty < 0) {
+			perror("/dev/tty");
+			return 1;
+		}
+	}
+	if (path) {
+		if (!attach(path, tty)) {
+			return 1;
+		}
+		return 0;
+	}
+	return attach_any(tty);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *cmd = "stats";
+	char *var;
+	char buf[4096];
+	ssize_t n;
+	int sock;
+
+	if (argc > 4) {
+usage:
+		fprintf(stderr, "Usage: %s [stats]\n"
+			"       %s scrollback card [offset]\n"
+			"       %s attach [socket]\n"
+			"Asks the deck this is running in about what is\n"
+			"going on inside it. scrollback writes out what the\n"
+			"card (its id or name, as stats shows them) has\n"
+			"output, from offset bytes in if given, as far back\n"
+			"as the deck still has it. attach instead gives this\n"
+			"tty to a deck which has lost its own, until it\n"
+			"detaches again or exits.\n",
+			argv[0], argv[0], argv[0]);
+		return 3;
+	}
+	if (argc >= 2) {
+		cmd = argv[1];
+		if (cmd[0] == '-') goto usage;
+	}
+	if (0 == strcmp(cmd, "attach")) {
+		return run_attach((argc == 3) ? argv[2] : NULL);
+	}
+	if (0 == strcmp(cmd, "scrollback")) {
+		if (argc < 3) goto usage;
+	} else if (argc > 2) {
+		goto usage;
+	}
+	var = getenv(CARDDECK_CONTROL_VAR_NAME);
+	if ((!var) || (!(*var))) {
+		fprintf(stderr, "No $" CARDDECK_CONTROL_VAR_NAME ". "
+			"Not running in a deck?\n");
+		return 1;
+	}
+
+	sock = connect_to_deck(var);
+	if (sock < 0) {
+		perror("connect to deck");
+		return 1;
+	}
+	snprintf(buf, sizeof(buf), "%s%s%s%s%s\n", cmd,
+		(argc > 2) ? " " : "", (argc > 2) ? argv[2] : "",
+		(argc > 3) ? " " : "", (argc > 3) ? argv[3] : "");
+	if (write(sock, buf, strlen(buf)) < 0) {
+		perror("write");
+		return 1;
+	}
+	shutdown(sock, SHUT_WR);
+	while ((n = read(sock, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, n, stdout);
+	}
+	if (n < 0) {
+		perror("read");
+		return 1;
+	}
+	return 0;
+}
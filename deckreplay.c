@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "global.h"
+#include "record.h"
+#include "renderer.h"
+
+/* Plays a recording made with "deck -R" back through a renderer onto
+   stdout: each card's output, in the same pieces and at the same
+   moments it was read from the card, or as fast as the renderer takes
+   it with -f. That makes the same load as the session did, as many
+   times as wanted. Input is not played back, as there are no cards to
+   take it, only counted. */
+
+/* Like the deck, leave no card with the tty through a pause this long. */
+#define REPLAY_IDLE_NSEC 500000000ULL
+
+struct card {
+	struct card *next;
+	uint32_t id;
+	char name[0];
+};
+
+static struct card *cards;
+
+static const char *
+card_name(uint32_t id)
+{
+	struct card *card;
+
+	for (card = cards; card; card = card->next) {
+		if (card->id == id) return card->name;
+	}
+	return "";
+}
+
+static void
+add_card(uint32_t id, const void *name, size_t len)
+{
+	struct card *card = malloc(sizeof(*card) + len + 1);
+
+	if (!card) {
+		return;
+	}
+	card->id = id;
+	memcpy(card->name, name, len);
+	card->name[len] = 0;
+	/* Ids are not reused, so the newest is the one to find. */
+	card->next = cards;
+	cards = card;
+}
+
+static void
+ignore_input(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg)
+{
+}
+
+static unsigned long long
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_until(unsigned long long nsec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = nsec / 1000000000ULL;
+	ts.tv_nsec = nsec % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Returns -1 if the renderer will not take any more. */
+static int
+write_all(struct renderer *r, const void *data, size_t count)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (count > 0) {
+		n = r->intf->write(r, data, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) return -1;
+			if (r->intf->check_ready_for_output(r, &pfd)) {
+				poll(&pfd, 1, -1);
+			}
+			continue;
+		}
+		data = (const char *)data + n;
+		count -= n;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct record_reader rr;
+	const struct record_header *h;
+	const void *data;
+	struct renderer *r;
+	const char *renderer_name = NULL;
+	unsigned long long start, elapsed, last = 0, span = 0;
+	unsigned long long out_bytes = 0, in_bytes = 0, pieces = 0;
+	uint32_t owner = CARD_ID_NONE;
+	int flat_out = 0;
+	int ncards = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:f")) != -1) {
+		switch (opt) {
+		case 'r':
+			renderer_name = optarg;
+			break;
+		case 'f':
+			flat_out = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) {
+usage:
+		fprintf(stderr, "Usage: %s [-r renderer] [-f] file\n"
+			"Plays the cards' output recorded by \"deck -R file\"\n"
+			"through the renderer onto stdout, at the speed it\n"
+			"came, or with -f as fast as it goes, then says how\n"
+			"long that took.\n",
+			argv[0]);
+		return 3;
+	}
+	if (record_reader_open(&rr, argv[optind]) < 0) {
+		return 1;
+	}
+	r = new_renderer(renderer_name, 1);
+	if (!r) {
+		perror("no renderer");
+		return 1;
+	}
+	r->intf->set_input_callback(r, ignore_input, NULL);
+
+	start = now_nsec();
+	while (record_next(&rr, &h, &data)) {
+		span = h->nsec;
+		switch (h->type) {
+		case RECORD_CARD:
+			add_card(h->card_id, data, h->length);
+			ncards++;
+			break;
+		case RECORD_INPUT:
+			in_bytes += h->length;
+			break;
+		case RECORD_OUTPUT:
+			if (!flat_out) {
+				if ((owner != CARD_ID_NONE) && (h->nsec - last >= REPLAY_IDLE_NSEC)) {
+					r->intf->claim_none(r);
+					owner = CARD_ID_NONE;
+				}
+				sleep_until(start + h->nsec);
+			}
+			if (owner != h->card_id) {
+				if (owner != CARD_ID_NONE) {
+					r->intf->claim_none(r);
+				}
+				owner = h->card_id;
+				r->intf->claim(r, owner, card_name(owner));
+			}
+			if (write_all(r, data, h->length) < 0) {
+				perror("write");
+				goto done;
+			}
+			out_bytes += h->length;
+			pieces++;
+			last = h->nsec;
+			break;
+		}
+	}
+done:
+	if (owner != CARD_ID_NONE) {
+		r->intf->claim_none(r);
+	}
+	r->intf->destroy(r);
+	elapsed = now_nsec() - start;
+	if (elapsed == 0) elapsed = 1;
+	fprintf(stderr, "%d cards, %llu bytes of output in %llu pieces, %llu bytes of input; "
+		"%.3fs (recorded over %.3fs), %.1f MB/s\n",
+		ncards, out_bytes, pieces, in_bytes, elapsed / 1e9, span / 1e9,
+		out_bytes * 1e3 / elapsed);
+	record_reader_close(&rr);
+	return 0;
+}
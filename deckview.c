@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pty.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "farend.h"
+
+/* Runs a command which ends up running "deck -r mux" (on this machine
+   or, say, through ssh) on a pty, and shows what each card outputs.
+   On stdout, each run of output from one card comes under a line
+   naming the card, the way tail(1) shows several files. With -o, each
+   card's output goes to a file of its own instead. What is read from
+   stdin is sent to card 0, the command the deck was started with.
+
+   With -b it instead times the parser on a stream recorded with -r:
+   once with nothing done with the output, which is what the library
+   costs, and once writing it out the way the viewer does. */
+
+/* Keep going over the recording until this much time has gone by. */
+#define BENCH_NSEC 1000000000ULL
+
+struct card {
+	struct card *next;
+	uint32_t id;
+	int fd;
+	char name[0];
+};
+
+struct view {
+	struct card *cards;
+	int shown_any;
+	uint32_t shown;
+	FILE *out;
+	const char *dir;
+	int master;
+	const char *options;
+};
+
+static unsigned long long
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+write_all(int fd, const void *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = write(fd, buf, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		count -= n;
+	}
+	return 0;
+}
+
+static struct card *
+find_card(struct view *v, uint32_t id)
+{
+	struct card *card;
+
+	for (card = v->cards; card; card = card->next) {
+		if (card->id == id) return card;
+	}
+	return NULL;
+}
+
+static void
+view_hello(void *arg, uint32_t version)
+{
+	struct view *v = (struct view *)arg;
+	unsigned char frame[MUX_HEADER_SIZE + 64];
+
+	if ((version >= 2) && v->options && (v->master >= 0)) {
+		write_all(v->master, frame, farend_hello(frame, v->options));
+	}
+}
+
+static void
+view_card(void *arg, uint32_t id, const char *name)
+{
+	struct view *v = (struct view *)arg;
+	struct card *card;
+	char path[PATH_MAX];
+
+	if (find_card(v, id)) {
+		return;
+	}
+	card = malloc(sizeof(*card) + strlen(name) + 1);
+	if (!card) {
+		return;
+	}
+	card->id = id;
+	card->fd = -1;
+	strcpy(card->name, name);
+	if (v->dir) {
+		snprintf(path, sizeof(path), "%s/%u", v->dir, (unsigned)id);
+		card->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+		if (card->fd < 0) {
+			perror(path);
+		}
+	}
+	card->next = v->cards;
+	v->cards = card;
+}
+
+static void
+view_output(void *arg, uint32_t id, const void *data, size_t count)
+{
+	struct view *v = (struct view *)arg;
+	struct card *card = find_card(v, id);
+
+	if (v->dir) {
+		if (card && (card->fd >= 0)) {
+			write_all(card->fd, data, count);
+		}
+		return;
+	}
+	if ((!(v->shown_any)) || (id != v->shown)) {
+		fprintf(v->out, "%s==> %u %s <==\n", v->shown_any ? "\n" : "",
+			(unsigned)id, card ? card->name : "?");
+		v->shown_any = 1;
+		v->shown = id;
+	}
+	fwrite(data, 1, count, v->out);
+}
+
+static const struct farend_handler view_handler = {
+	.hello = view_hello,
+	.card = view_card,
+	.output = view_output,
+};
+
+static const struct farend_handler count_handler = {
+	.hello = NULL,
+	.card = NULL,
+	.output = NULL,
+};
+
+/* Parse the whole recording as many times as fit in BENCH_NSEC, in
+   reads of the size the viewer does, and return how many times a
+   second that was. */
+static double
+time_parser(const unsigned char *buf, size_t size, const struct farend_handler *handler,
+	void *arg, struct farend *fe)
+{
+	unsigned long long start, elapsed, passes = 0;
+	size_t off, n;
+
+	start = now_nsec();
+	do {
+		if (farend_init(fe, handler, arg) < 0) {
+			return 0.0;
+		}
+		for (off = 0; off < size; off += n) {
+			n = size - off;
+			if (n > 65536) n = 65536;
+			farend_feed(fe, buf + off, n);
+		}
+		passes++;
+		farend_end(fe);
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_NSEC);
+	return passes * 1e9 / elapsed;
+}
+
+static int
+bench(const char *filename)
+{
+	struct farend *fe;
+	struct view v;
+	struct stat st;
+	unsigned char *buf;
+	double library, viewer;
+	ssize_t n;
+	size_t fill = 0;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		perror(filename);
+		return 1;
+	}
+	buf = malloc(st.st_size ? st.st_size : 1);
+	fe = malloc(sizeof(*fe));
+	if ((!buf) || (!fe)) {
+		perror("malloc");
+		return 1;
+	}
+	while (fill < st.st_size) {
+		n = read(fd, buf + fill, st.st_size - fill);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR)) continue;
+			break;
+		}
+		fill += n;
+	}
+	close(fd);
+
+	library = time_parser(buf, fill, &count_handler, NULL, fe);
+	if (fe->bad) {
+		fprintf(stderr, "%s is not a recording of a deck mux stream\n", filename);
+		return 1;
+	}
+	memset(&v, 0, sizeof(v));
+	v.master = -1;
+	v.out = fopen("/dev/null", "w");
+	if (!(v.out)) {
+		perror("/dev/null");
+		return 1;
+	}
+	viewer = time_parser(buf, fill, &view_handler, &v, fe);
+
+	/* Per second both of what came over the tty and of the cards'
+	   output, which is more if the stream was deflated. */
+	printf("{\n"
+		"  \"stream\": \"%s\",\n"
+		"  \"bytes\": %zu,\n"
+		"  \"inflated_bytes\": %llu,\n"
+		"  \"output_bytes\": %llu,\n"
+		"  \"library_gb_per_sec\": %.3f,\n"
+		"  \"library_output_gb_per_sec\": %.3f,\n"
+		"  \"viewer_gb_per_sec\": %.3f,\n"
+		"  \"viewer_output_gb_per_sec\": %.3f\n"
+		"}\n",
+		filename, fill, fe->bytes_inflated, fe->bytes_output,
+		library * fill / 1e9, library * fe->bytes_output / 1e9,
+		viewer * fill / 1e9, viewer * fe->bytes_output / 1e9);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct farend *fe;
+	struct view v;
+	struct winsize win;
+	struct pollfd pfd[2];
+	unsigned char buf[65536];
+	unsigned char frame[MUX_HEADER_SIZE + 4096];
+	const char *record = NULL;
+	int record_fd = -1;
+	int opt, status;
+	pid_t pid;
+	ssize_t n;
+
+	memset(&v, 0, sizeof(v));
+	v.out = stdout;
+	while ((opt = getopt(argc, argv, "+zr:o:b:")) != -1) {
+		switch (opt) {
+		case 'z':
+			v.options = MUX_OPTION_DEFLATE;
+			break;
+		case 'r':
+			record = optarg;
+			break;
+		case 'o':
+			v.dir = optarg;
+			break;
+		case 'b':
+			return bench(optarg);
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc) {
+usage:
+		fprintf(stderr, "Usage: %s [-z] [-r file] [-o dir] command [args...]\n"
+			"       %s -b file\n"
+			"Runs command, which should run \"deck -r mux\", on a pty\n"
+			"and shows what each of the deck's cards outputs, or with\n"
+			"-o puts it in dir/ID for each card. -z asks the deck to\n"
+			"compress. -r records the stream from the deck in file,\n"
+			"which -b then uses to time the parser.\n",
+			argv[0], argv[0]);
+		return 3;
+	}
+
+	if (record) {
+		record_fd = open(record, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+		if (record_fd < 0) {
+			perror(record);
+			return 1;
+		}
+	}
+	fe = malloc(sizeof(*fe));
+	if ((!fe) || (farend_init(fe, &view_handler, &v) < 0)) {
+		fprintf(stderr, "Cannot set up the parser\n");
+		return 1;
+	}
+
+	if (ioctl(1, TIOCGWINSZ, &win) < 0) {
+		memset(&win, 0, sizeof(win));
+		win.ws_row = 24;
+		win.ws_col = 80;
+	}
+	pid = forkpty(&(v.master), NULL, NULL, &win);
+	if (pid < 0) {
+		perror("forkpty");
+		return 1;
+	}
+	if (pid == 0) {
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		_exit(127);
+	}
+
+	pfd[0].fd = v.master;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = 0;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		if (pfd[1].revents) {
+			n = read(0, frame + MUX_HEADER_SIZE, sizeof(frame) - MUX_HEADER_SIZE);
+			if (n > 0) {
+				/* Nothing can go to the deck before it is ready
+				   for frames, or its tty would echo them. */
+				if (fe->said_hello) {
+					write_all(v.master, frame, farend_input(frame, 0, frame + MUX_HEADER_SIZE, n));
+				}
+			} else if ((n == 0) || (errno != EINTR)) {
+				pfd[1].fd = -1;
+			}
+		}
+		if (!(pfd[0].revents)) {
+			continue;
+		}
+		n = read(v.master, buf, sizeof(buf));
+		if (n < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+			/* EIO once the command and all else has closed the pty. */
+			break;
+		}
+		if (n == 0) break;
+		if (record_fd >= 0) {
+			write_all(record_fd, buf, n);
+		}
+		if (farend_feed(fe, buf, n) < 0) {
+			/* Not a deck: show it as it is, it may say why. */
+			fwrite(buf, 1, n, stdout);
+		}
+		fflush(stdout);
+	}
+	fflush(stdout);
+	waitpid(pid, &status, 0);
+	farend_end(fe);
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	return 128 + WTERMSIG(status);
+}
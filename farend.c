@@ -0,0 +1,146 @@
+#include <string.h>
+#include "farend.h"
+
+int
+farend_init(struct farend *fe, const struct farend_handler *handler, void *arg)
+{
+	memset(fe, 0, sizeof(*fe));
+	fe->handler = handler;
+	fe->arg = arg;
+	mux_parser_init(&(fe->parser));
+	mux_parser_init(&(fe->inflated_parser));
+	/* Up front, so that nothing needs allocating later. */
+	if (inflateInit2(&(fe->inflate), -15) != Z_OK) {
+		return -1;
+	}
+	return 0;
+}
+
+void
+farend_end(struct farend *fe)
+{
+	inflateEnd(&(fe->inflate));
+}
+
+/* NAME and DATA frames, whether they came deflated or not. */
+static void
+got_card_frame(void *arg, const struct mux_frame *f, const void *data, size_t count, uint32_t offset)
+{
+	struct farend *fe = (struct farend *)arg;
+	size_t n;
+
+	switch (f->type) {
+	case MUX_FRAME_DATA:
+		if (count == 0) {
+			break;
+		}
+		fe->bytes_output += count;
+		if (fe->handler->output) {
+			fe->handler->output(fe->arg, f->id, data, count);
+		}
+		break;
+	case MUX_FRAME_NAME:
+		if (offset < FAREND_MAX_NAME) {
+			n = FAREND_MAX_NAME - offset;
+			if (n > count) n = count;
+			memcpy(&(fe->name[offset]), data, n);
+		}
+		if (offset + count == f->length) {
+			fe->name[(f->length < FAREND_MAX_NAME) ? f->length : FAREND_MAX_NAME] = 0;
+			if (fe->handler->card) {
+				fe->handler->card(fe->arg, f->id, fe->name);
+			}
+		}
+		break;
+	}
+}
+
+static void
+inflate_piece(struct farend *fe, const void *data, size_t count)
+{
+	z_stream *z = &(fe->inflate);
+	size_t n;
+	int ret;
+
+	z->next_in = (unsigned char *)data;
+	z->avail_in = count;
+	do {
+		z->next_out = fe->inflated;
+		z->avail_out = sizeof(fe->inflated);
+		ret = inflate(z, Z_SYNC_FLUSH);
+		if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) {
+			/* Lost until the deck starts a new stream. */
+			fe->inflate_ok = 0;
+			return;
+		}
+		n = sizeof(fe->inflated) - z->avail_out;
+		fe->bytes_inflated += n;
+		mux_parse(&(fe->inflated_parser), fe->inflated, n, got_card_frame, fe);
+	} while (z->avail_out == 0);
+}
+
+static void
+got_frame(void *arg, const struct mux_frame *f, const void *data, size_t count, uint32_t offset)
+{
+	struct farend *fe = (struct farend *)arg;
+	static const char magic[] = MUX_HELLO_MAGIC;
+
+	if (fe->bad) {
+		return;
+	}
+	if (!(fe->said_hello)) {
+		if ((f->type != MUX_FRAME_HELLO) || (f->length != sizeof(magic)-1) ||
+			memcmp(data, magic + offset, count)
+		) {
+			fe->bad = 1;
+			return;
+		}
+		if (offset + count == f->length) {
+			fe->said_hello = 1;
+			if (fe->handler->hello) {
+				fe->handler->hello(fe->arg, f->id);
+			}
+		}
+		return;
+	}
+	if (f->type != MUX_FRAME_DEFLATE) {
+		got_card_frame(arg, f, data, count, offset);
+		return;
+	}
+	if ((offset == 0) && (f->id == MUX_DEFLATE_RESET)) {
+		inflateReset(&(fe->inflate));
+		mux_parser_init(&(fe->inflated_parser));
+		fe->inflate_ok = 1;
+	}
+	if (fe->inflate_ok && count) {
+		inflate_piece(fe, data, count);
+	}
+}
+
+int
+farend_feed(struct farend *fe, const void *buf, size_t count)
+{
+	if (!(fe->bad)) {
+		fe->bytes_in += count;
+		mux_parse(&(fe->parser), buf, count, got_frame, fe);
+	}
+	return fe->bad ? -1 : 0;
+}
+
+size_t
+farend_hello(unsigned char *out, const char *options)
+{
+	size_t len = strlen(options);
+
+	mux_put_header(out, MUX_FRAME_HELLO, 0, len);
+	memcpy(out + MUX_HEADER_SIZE, options, len);
+	return MUX_HEADER_SIZE + len;
+}
+
+size_t
+farend_input(unsigned char *out, uint32_t id, const void *data, size_t count)
+{
+	mux_put_header(out, MUX_FRAME_INPUT, id, count);
+	memcpy(out + MUX_HEADER_SIZE, data, count);
+	return MUX_HEADER_SIZE + count;
+}
@@ -0,0 +1,72 @@
+#ifndef _DECK_FAREND_H
+#define _DECK_FAREND_H
+
+/* The far end of a "deck -r mux" stream, for programs which want to
+   show or log what each card does. It takes the bytes that come out
+   of the deck's tty, in whatever pieces they arrive, and hands each
+   card's output to a callback along with the card's id.
+
+   Output is not copied: it is delivered with pointers into the
+   caller's buffer, or into a buffer in struct farend if it came
+   deflated, so a card's output may come in more pieces than it was
+   written in. Nothing is allocated either, apart from zlib's window
+   when the first DEFLATE frame comes.
+
+   libdeckfar.a has this and the frame parser from muxproto.c, and
+   needs -lz. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "muxproto.h"
+
+#define FAREND_MAX_NAME 255
+#define FAREND_INFLATE_BUFFER 16384
+
+/* Any of these may be NULL. */
+struct farend_handler {
+	/* The deck has said hello. Once it has, farend_hello() can be
+	   sent to it. */
+	void (*hello)(void *arg, uint32_t version);
+	/* Card id is called name. Comes before any output from it. */
+	void (*card)(void *arg, uint32_t id, const char *name);
+	/* Output from card id. */
+	void (*output)(void *arg, uint32_t id, const void *data, size_t count);
+};
+
+struct farend {
+	const struct farend_handler *handler;
+	void *arg;
+	struct mux_parser parser;
+	/* For what comes out of DEFLATE frames */
+	struct mux_parser inflated_parser;
+	z_stream inflate;
+	int inflate_ok;
+	/* Set if the stream did not start with the deck's hello, in which
+	   case it is not looked at any further. */
+	int bad;
+	int said_hello;
+	char name[FAREND_MAX_NAME + 1];
+	unsigned char inflated[FAREND_INFLATE_BUFFER];
+
+	/* Counted as they go by */
+	unsigned long long bytes_in;
+	unsigned long long bytes_inflated;
+	unsigned long long bytes_output;
+};
+
+/* Returns 0, or -1 if zlib could not be set up. */
+int farend_init(struct farend *, const struct farend_handler *, void *arg);
+void farend_end(struct farend *);
+
+/* Interpret more of the stream. Returns -1 if it is not a deck mux
+   stream, 0 otherwise. */
+int farend_feed(struct farend *, const void *buf, size_t count);
+
+/* Frames to send the deck. Each puts a frame in out, which must have
+   room for MUX_HEADER_SIZE more bytes than the payload, and returns
+   its length. */
+size_t farend_hello(unsigned char *out, const char *options);
+size_t farend_input(unsigned char *out, uint32_t id, const void *data, size_t count);
+
+#endif /* _DECK_FAREND_H */
@@ -1,6 +1,43 @@
 #ifndef _DECK_GLOBAL_H
 #define _DECK_GLOBAL_H
 
+/* The deck's socket, which every card in it connects to. A name
+   starting with '@' is in the abstract namespace. */
 #define CARDDECK_SOCKET_VAR_NAME "CARDDECK_SOCKET"
 
+/* The token of the card a process is running in, so that cards it
+   starts are known to be nested in that one. */
+#define CARDDECK_PARENT_VAR_NAME "CARDDECK_PARENT"
+
+/* A card is handed to the cardserver as a fd along with a message
+   which starts with the card's name, ending in '.'. That may be
+   followed by options, each a '\n' and then key=value. */
+#define CARD_OPTION_WEIGHT "weight"	/* share of the tty, 1 to 64 */
+#define CARD_OPTION_TOKEN "token"	/* the card's own token, in hex */
+#define CARD_OPTION_PARENT "parent"	/* the parent card's token */
+#define CARD_OPTION_SCREEN "screen"	/* COLSxROWS: keep a screen model */
+#define CARD_OPTION_PTY "pty"		/* 1: answer with a pty, see below */
+#define CARD_OPTION_TAIL "tail"		/* 1: keep only the tail when behind */
+
+/* A card that asks for a pty is answered on the same connection with a
+   message carrying a pty master and slave, if the cardserver has one
+   ready, or with no fds if it does not, in which case the card makes
+   its own. Either way that ends the exchange: the cardserver takes no
+   more cards on that connection. */
+
+/* A second fd may come with the card, a SOCK_SEQPACKET socket on which
+   each end grants the other credit to send on the card's own socket.
+   Each message is a native uint64_t: how many bytes from the start of
+   the stream the other end may have sent in all. Until it hears
+   otherwise each end may send CARD_CREDIT_INITIAL bytes. A card that
+   comes without this fd is not limited. See credit.h. */
+#define CARD_CREDIT_INITIAL 65536
+
+/* If set, each card reports how much it relayed and how fast when
+   it finishes. */
+#define CARDDECK_IOSTATS_VAR_NAME "CARDDECK_IOSTATS"
+
+/* Where the deck's control socket is, see control.h */
+#define CARDDECK_CONTROL_VAR_NAME "CARDDECK_CONTROL"
+
 #endif /* _DECK_GLOBAL_H */
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "ioloop.h"
+
+#define EVENTS_PER_WAIT 64
+
+struct ioloop {
+	int epfd;
+	int wakefd;
+
+	pthread_mutex_t kick_lock;
+	struct iowatch *kicked_head;
+	struct iowatch *kicked_tail;
+
+	/* Only touched by the loop thread */
+	struct iowatch *timers;
+	struct iowatch *retired;
+	struct iowatch *retired_tail;
+};
+
+static int
+ms_until(const struct timespec *now, const struct timespec *then)
+{
+	long long ms = (long long)(then->tv_sec - now->tv_sec) * 1000 +
+		(then->tv_nsec - now->tv_nsec) / 1000000;
+	if (ms < 0) return 0;
+	if (ms > 60000) return 60000;
+	/* Round up so we do not wake up just before the deadline. */
+	return ms + 1;
+}
+
+static int
+expired(const struct timespec *now, const struct timespec *then)
+{
+	if (now->tv_sec != then->tv_sec) return now->tv_sec > then->tv_sec;
+	return now->tv_nsec >= then->tv_nsec;
+}
+
+static void
+run_timers(struct ioloop *loop)
+{
+	struct iowatch **wp, *w;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wp = &(loop->timers);
+	while ((w = *wp)) {
+		if (!expired(&now, &(w->deadline))) {
+			wp = &(w->next_timer);
+			continue;
+		}
+		*wp = w->next_timer;
+		w->timer_set = 0;
+		w->ready(w, 0);
+		/* The callback may have rearranged the list. */
+		wp = &(loop->timers);
+	}
+}
+
+static void
+run_kicks(struct ioloop *loop)
+{
+	struct iowatch *w;
+
+	for (;;) {
+		pthread_mutex_lock(&(loop->kick_lock));
+		w = loop->kicked_head;
+		if (w) {
+			loop->kicked_head = w->next_kicked;
+			if (!(loop->kicked_head)) {
+				loop->kicked_tail = NULL;
+			}
+			w->kicked = 0;
+		}
+		pthread_mutex_unlock(&(loop->kick_lock));
+		if (!w) break;
+		w->ready(w, 0);
+	}
+}
+
+static void
+run_retired(struct ioloop *loop)
+{
+	struct iowatch *w;
+
+	while ((w = loop->retired)) {
+		loop->retired = w->next_retired;
+		if (!(loop->retired)) {
+			loop->retired_tail = NULL;
+		}
+		if (w->destroy) {
+			w->destroy(w);
+		}
+	}
+}
+
+static void *
+run_ioloop(void *arg)
+{
+	struct ioloop *loop = (struct ioloop *)arg;
+	struct epoll_event events[EVENTS_PER_WAIT];
+	struct timespec now;
+	uint64_t scratch;
+	int i, n, timeout;
+
+	for (;;) {
+		timeout = -1;
+		if (loop->timers) {
+			struct iowatch *w;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			for (w = loop->timers; w; w = w->next_timer) {
+				int t = ms_until(&now, &(w->deadline));
+				if ((timeout < 0) || (t < timeout)) {
+					timeout = t;
+				}
+			}
+		}
+		n = epoll_wait(loop->epfd, &(events[0]), EVENTS_PER_WAIT, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			sleep(1);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			struct iowatch *w = (struct iowatch *)events[i].data.ptr;
+			if (w == NULL) {
+				/* wakefd */
+				read(loop->wakefd, &scratch, sizeof(scratch));
+				continue;
+			}
+			if (w->retired) continue;
+			w->ready(w, events[i].events);
+		}
+		run_kicks(loop);
+		if (loop->timers) {
+			run_timers(loop);
+		}
+		run_retired(loop);
+	}
+	return NULL;
+}
+
+struct ioloop *
+ioloop_new(void)
+{
+	pthread_t thread_id;
+	pthread_attr_t thread_attr;
+	struct epoll_event ev;
+	struct ioloop *loop = malloc(sizeof(*loop));
+
+	if (!loop) {
+		perror("ioloop: malloc");
+		return NULL;
+	}
+	memset(loop, 0, sizeof(*loop));
+	pthread_mutex_init(&(loop->kick_lock), NULL);
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		free(loop);
+		return NULL;
+	}
+	loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakefd < 0) {
+		perror("eventfd");
+		close(loop->epfd);
+		free(loop);
+		return NULL;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	/* The loops do not need big stacks. */
+	pthread_attr_setstacksize(&thread_attr, 256*1024);
+	pthread_create(&thread_id, &thread_attr, run_ioloop, loop);
+	return loop;
+}
+
+void
+ioloop_watch_init(struct iowatch *w, struct ioloop *loop,
+	void (*ready)(struct iowatch *, uint32_t events))
+{
+	memset(w, 0, sizeof(*w));
+	w->loop = loop;
+	w->ready = ready;
+}
+
+static int
+watch_ctl(struct iowatch *w, int op, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	return epoll_ctl(w->loop->epfd, op, fd, &ev);
+}
+
+int
+ioloop_add(struct iowatch *w, int fd, uint32_t events)
+{
+	return watch_ctl(w, EPOLL_CTL_ADD, fd, events);
+}
+
+int
+ioloop_mod(struct iowatch *w, int fd, uint32_t events)
+{
+	return watch_ctl(w, EPOLL_CTL_MOD, fd, events);
+}
+
+int
+ioloop_del(struct iowatch *w, int fd)
+{
+	return watch_ctl(w, EPOLL_CTL_DEL, fd, 0);
+}
+
+void
+ioloop_kick(struct iowatch *w)
+{
+	struct ioloop *loop = w->loop;
+	uint64_t one = 1;
+	int need_wake = 0;
+
+	pthread_mutex_lock(&(loop->kick_lock));
+	if (!(w->kicked)) {
+		w->kicked = 1;
+		w->next_kicked = NULL;
+		if (loop->kicked_tail) {
+			loop->kicked_tail->next_kicked = w;
+		} else {
+			loop->kicked_head = w;
+			need_wake = 1;
+		}
+		loop->kicked_tail = w;
+	}
+	pthread_mutex_unlock(&(loop->kick_lock));
+
+	/* If the list was not empty, a wakeup is already on its way. */
+	if (need_wake) {
+		write(loop->wakefd, &one, sizeof(one));
+	}
+}
+
+void
+ioloop_set_timer(struct iowatch *w, const struct timespec *deadline)
+{
+	struct iowatch **wp;
+
+	if (w->timer_set) {
+		for (wp = &(w->loop->timers); *wp; wp = &((*wp)->next_timer)) {
+			if (*wp == w) {
+				*wp = w->next_timer;
+				break;
+			}
+		}
+		w->timer_set = 0;
+	}
+	if (deadline && !(w->retired)) {
+		w->deadline = *deadline;
+		w->next_timer = w->loop->timers;
+		w->loop->timers = w;
+		w->timer_set = 1;
+	}
+}
+
+void
+ioloop_retire(struct iowatch *w, void (*destroy)(struct iowatch *))
+{
+	struct ioloop *loop = w->loop;
+	struct iowatch **wp, *prev;
+
+	ioloop_set_timer(w, NULL);
+
+	pthread_mutex_lock(&(loop->kick_lock));
+	if (w->kicked) {
+		prev = NULL;
+		for (wp = &(loop->kicked_head); *wp; wp = &((*wp)->next_kicked)) {
+			if (*wp == w) {
+				*wp = w->next_kicked;
+				if (loop->kicked_tail == w) {
+					loop->kicked_tail = prev;
+				}
+				break;
+			}
+			prev = *wp;
+		}
+		w->kicked = 0;
+	}
+	pthread_mutex_unlock(&(loop->kick_lock));
+
+	w->retired = 1;
+	w->destroy = destroy;
+	w->next_retired = NULL;
+	if (loop->retired_tail) {
+		loop->retired_tail->next_retired = w;
+	} else {
+		loop->retired = w;
+	}
+	loop->retired_tail = w;
+}
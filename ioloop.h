@@ -0,0 +1,63 @@
+#ifndef _DECK_IOLOOP_H
+#define _DECK_IOLOOP_H
+
+/* A small fixed set of threads, each running an epoll loop. Anything
+   that waits on fds (mostly cards) is given an iowatch on one of the
+   loops, and from then on its callback is only ever run on that loop's
+   thread, so the state behind a watch needs no locking against itself. */
+
+#include <stdint.h>
+#include <time.h>
+
+struct ioloop;
+
+struct iowatch {
+	/* Called on the loop thread. events are the epoll events that
+	   fired on one of the watch's fds, or 0 if the watch was kicked
+	   or its timer expired. Either way the callback should just look
+	   at its state and make whatever progress it can. */
+	void (*ready)(struct iowatch *, uint32_t events);
+	struct ioloop *loop;
+
+	/* private */
+	struct iowatch *next_kicked;
+	struct iowatch *next_timer;
+	struct iowatch *next_retired;
+	void (*destroy)(struct iowatch *);
+	struct timespec deadline;
+	int kicked;
+	int timer_set;
+	int retired;
+};
+
+/* Starts a new loop and its thread. */
+struct ioloop *ioloop_new(void);
+
+/* Attach w to loop. Must be called before anything else is done with w. */
+void ioloop_watch_init(struct iowatch *w, struct ioloop *loop,
+	void (*ready)(struct iowatch *, uint32_t events));
+
+/* Start, change or stop watching fd on behalf of w. These just wrap
+   epoll_ctl and return the same thing. */
+int ioloop_add(struct iowatch *w, int fd, uint32_t events);
+int ioloop_mod(struct iowatch *w, int fd, uint32_t events);
+int ioloop_del(struct iowatch *w, int fd);
+
+/* Arrange for w's callback to be run soon on its loop's thread.
+   May be called from any thread. */
+void ioloop_kick(struct iowatch *w);
+
+/* Run w's callback once the CLOCK_MONOTONIC time deadline has passed.
+   NULL cancels. A watch has at most one timer. Loop thread only. */
+void ioloop_set_timer(struct iowatch *w, const struct timespec *deadline);
+
+/* w will not be called again. Once the loop is done with the batch of
+   events it is working on, destroy (if not NULL) is called on it, which
+   makes it safe to free memory holding w from there even if other
+   events for it were already collected. Its fds must have been removed
+   with ioloop_del or closed already. Watches are destroyed in the order
+   they were retired, so if destroy frees memory holding other watches
+   too, retire those first. Loop thread only. */
+void ioloop_retire(struct iowatch *w, void (*destroy)(struct iowatch *));
+
+#endif /* _DECK_IOLOOP_H */
@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "renderer.h"
+#include "muxproto.h"
+#include "util.h"
+
+/* A renderer for a program rather than a human at the far end.
+   All output is sent as binary frames (see muxproto.h) tagged with the
+   card's id in the cardserver, and input is expected in the same format. Output is
+   collected in a buffer and written out whenever the tty takes it,
+   so when the tty is slow, chunks from many cards go out in a single
+   write. claim() and claim_none() never write anything themselves.
+
+   If the far end asks for it in its hello, everything going out
+   between flushes is deflated into one DEFLATE frame, and DEFLATE
+   frames coming in are inflated. That costs the far end no waiting,
+   because every DEFLATE frame ends at a sync flush. Output that does
+   not get smaller goes out as plain frames for a while instead.
+*/
+
+/* Stop accepting output when this much is waiting for the tty. */
+#define MUX_OUT_BUFFER 65536
+/* Room kept on top of that for NAME frames. */
+#define MUX_OUT_SLACK 1024
+/* Speed matters more than the last few percent: this is on the way
+   to the tty. */
+#define MUX_DEFLATE_LEVEL Z_BEST_SPEED
+/* How compression is doing is looked at every so many bytes. If it
+   did not save an eighth, it is left off for MUX_DEFLATE_RETRY bytes. */
+#define MUX_DEFLATE_SAMPLE (256*1024)
+#define MUX_DEFLATE_RETRY (4*1024*1024)
+
+struct mux_card {
+	struct mux_card *next;
+	uint32_t id;
+	int announced;
+	char name[0];
+};
+
+struct mux_renderer {
+	struct renderer base;
+	int fd;
+	int wake_pipe[2];
+
+	pthread_mutex_t lock;
+	struct mux_card *cards;
+	struct mux_card *active_card;
+	/* Output waiting for the tty is out[out_start..out_end) */
+	unsigned char out[MUX_OUT_BUFFER + MUX_OUT_SLACK];
+	size_t out_start;
+	size_t out_end;
+	/* Where the header of the last DATA frame is in out, if it has
+	   not been written yet, so more data for the same card can be
+	   added to it. -1 if none. */
+	long last_data_frame;
+	/* The io thread is waiting for the tty to be writable. */
+	int flush_pending;
+	/* Writing to the tty failed, most likely because it was hung up.
+	   Output is thrown away from then on, see flush(). */
+	int gone;
+
+	/* Output compression, set up once the far end asks for it.
+	   zout[zout_start..zout_end) is ready for the tty and goes before
+	   anything in out: a DEFLATE frame, or plain frames which were
+	   already in out when compressing started. */
+	int deflate_on;
+	int compressing;
+	int deflate_reset;
+	z_stream deflate;
+	unsigned char *zout;
+	size_t zout_size;
+	size_t zout_start;
+	size_t zout_end;
+	/* Bytes in and out of deflate since compression was last judged,
+	   or while it is off, how many plain bytes to go before retrying. */
+	unsigned long long sample_in;
+	unsigned long long sample_out;
+	unsigned long long plain_left;
+
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg);
+	void *callback_arg;
+	/* The io thread has been started, and has finished. */
+	int input_started;
+	int input_done;
+	/* destroy() has been called. The last of it and the io thread to
+	   finish frees the renderer. */
+	int destroyed;
+	struct mux_parser parser;
+	/* Only the io thread touches these. */
+	char hello[64];
+	int inflate_on;
+	int inflate_ok;
+	z_stream inflate;
+	struct mux_parser inflated_parser;
+
+	int can_restore_termios;
+	struct termios termios_for_restore;
+};
+
+/* Must hold lock */
+static struct mux_card *
+find_card(struct mux_renderer *mux, uint32_t card_id, const char *card_name)
+{
+	struct mux_card *card, **cp;
+
+	for (cp = &(mux->cards); (card = *cp); cp = &(card->next)) {
+		if (card->id == card_id) {
+			/* Move to front, the same few cards tend to talk. */
+			*cp = card->next;
+			card->next = mux->cards;
+			mux->cards = card;
+			return card;
+		}
+	}
+	card = malloc(sizeof(*card) + strlen(card_name) + 1);
+	if (!card) {
+		return NULL;
+	}
+	card->id = card_id;
+	card->announced = 0;
+	strcpy(card->name, card_name);
+	card->next = mux->cards;
+	mux->cards = card;
+	return card;
+}
+
+/* Must hold lock. Make room at the end of out for count bytes if
+   that is possible without going over limit. */
+static int
+out_reserve(struct mux_renderer *mux, size_t count, size_t limit)
+{
+	if (mux->out_end - mux->out_start + count > limit) {
+		return 0;
+	}
+	if (mux->out_end + count > sizeof(mux->out)) {
+		memmove(&(mux->out[0]), &(mux->out[mux->out_start]),
+			mux->out_end - mux->out_start);
+		if (mux->last_data_frame >= 0) {
+			mux->last_data_frame -= mux->out_start;
+		}
+		mux->out_end -= mux->out_start;
+		mux->out_start = 0;
+	}
+	return 1;
+}
+
+/* Must hold lock */
+static void
+out_frame(struct mux_renderer *mux, int type, uint32_t id, const void *data, size_t count)
+{
+	mux_put_header(&(mux->out[mux->out_end]), type, id, count);
+	memcpy(&(mux->out[mux->out_end + MUX_HEADER_SIZE]), data, count);
+	mux->out_end += MUX_HEADER_SIZE + count;
+}
+
+/* Must hold lock, and zout must be empty. Start compressing (again)
+   from the next frame on. Whatever is in out may already be partly
+   written, so it goes out as it is. */
+static void
+resume_deflate(struct mux_renderer *mux)
+{
+	size_t fill = mux->out_end - mux->out_start;
+
+	memcpy(mux->zout, &(mux->out[mux->out_start]), fill);
+	mux->zout_start = 0;
+	mux->zout_end = fill;
+	mux->out_start = mux->out_end = 0;
+	mux->last_data_frame = -1;
+	deflateReset(&(mux->deflate));
+	mux->deflate_reset = 1;
+	mux->compressing = 1;
+	mux->sample_in = mux->sample_out = 0;
+}
+
+/* Must hold lock. Called when the far end asks for compression. */
+static void
+start_deflate(struct mux_renderer *mux)
+{
+	if (mux->deflate_on || mux->destroyed) {
+		return;
+	}
+	if (deflateInit2(&(mux->deflate), MUX_DEFLATE_LEVEL, Z_DEFLATED,
+			-15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return;
+	}
+	/* Room for all of out, even if it does not compress at all, with
+	   the sync flush marker. */
+	mux->zout_size = MUX_HEADER_SIZE + deflateBound(&(mux->deflate), sizeof(mux->out)) + 64;
+	mux->zout = malloc(mux->zout_size);
+	if (!(mux->zout)) {
+		deflateEnd(&(mux->deflate));
+		return;
+	}
+	mux->deflate_on = 1;
+	resume_deflate(mux);
+}
+
+/* Must hold lock, and zout must be empty. Deflate everything in out
+   into a DEFLATE frame in zout. */
+static void
+deflate_out(struct mux_renderer *mux)
+{
+	z_stream *z = &(mux->deflate);
+	size_t count = mux->out_end - mux->out_start;
+	size_t len;
+
+	z->next_in = &(mux->out[mux->out_start]);
+	z->avail_in = count;
+	z->next_out = mux->zout + MUX_HEADER_SIZE;
+	z->avail_out = mux->zout_size - MUX_HEADER_SIZE;
+	deflate(z, Z_SYNC_FLUSH);
+	len = mux->zout_size - MUX_HEADER_SIZE - z->avail_out;
+	mux_put_header(mux->zout, MUX_FRAME_DEFLATE,
+		mux->deflate_reset ? MUX_DEFLATE_RESET : 0, len);
+	mux->deflate_reset = 0;
+	mux->zout_start = 0;
+	mux->zout_end = MUX_HEADER_SIZE + len;
+	mux->out_start = mux->out_end = 0;
+	mux->last_data_frame = -1;
+
+	mux->sample_in += count;
+	mux->sample_out += MUX_HEADER_SIZE + len;
+	if (mux->sample_in >= MUX_DEFLATE_SAMPLE) {
+		if (mux->sample_out * 8 > mux->sample_in * 7) {
+			mux->compressing = 0;
+			mux->plain_left = MUX_DEFLATE_RETRY;
+		}
+		mux->sample_in = mux->sample_out = 0;
+	}
+}
+
+/* Must hold lock. Write out as much as the tty takes right now. If
+   something is left, get the io thread to wait for the tty. */
+static void
+flush(struct mux_renderer *mux)
+{
+	const char dummy = 0;
+	ssize_t n;
+
+	while (!(mux->gone)) {
+		if (mux->zout_start < mux->zout_end) {
+			n = write(mux->fd, mux->zout + mux->zout_start, mux->zout_end - mux->zout_start);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno != EAGAIN) mux->gone = 1;
+				break;
+			}
+			mux->zout_start += n;
+			continue;
+		}
+		if (mux->out_start == mux->out_end) {
+			break;
+		}
+		if (mux->compressing) {
+			deflate_out(mux);
+			continue;
+		}
+		n = write(mux->fd, &(mux->out[mux->out_start]), mux->out_end - mux->out_start);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) {
+				/* Nobody will see any of it. Take it all so
+				   that cards are not held up, until the io
+				   thread notices and the deck detaches from
+				   this tty. */
+				mux->gone = 1;
+			}
+			break;
+		}
+		mux->out_start += n;
+		if ((mux->last_data_frame >= 0) && (mux->last_data_frame < mux->out_start)) {
+			/* Too late to add to that one. */
+			mux->last_data_frame = -1;
+		}
+		if (mux->deflate_on) {
+			if (n >= mux->plain_left) {
+				resume_deflate(mux);
+			} else {
+				mux->plain_left -= n;
+			}
+		}
+	}
+	if (mux->gone || ((mux->zout_start == mux->zout_end) && (mux->out_start == mux->out_end))) {
+		mux->zout_start = mux->zout_end = 0;
+		mux->out_start = mux->out_end = 0;
+		mux->last_data_frame = -1;
+		return;
+	}
+	if (!(mux->flush_pending)) {
+		mux->flush_pending = 1;
+		write(mux->wake_pipe[1], &dummy, 1);
+	}
+}
+
+static void
+mux_renderer_claim(struct renderer *i, uint32_t card_id, const char *card_name)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+
+	pthread_mutex_lock(&(mux->lock));
+	mux->active_card = find_card(mux, card_id, card_name);
+	pthread_mutex_unlock(&(mux->lock));
+}
+
+static void
+mux_renderer_claim_none(struct renderer *i)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+
+	pthread_mutex_lock(&(mux->lock));
+	mux->active_card = NULL;
+	pthread_mutex_unlock(&(mux->lock));
+}
+
+static ssize_t
+mux_renderer_write(struct renderer *i, const void *buf, size_t count)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+	struct mux_card *card;
+	size_t space, fill;
+
+	pthread_mutex_lock(&(mux->lock));
+	card = mux->active_card;
+	if ((!card) || mux->gone) {
+		/* Out of memory when claiming, or the tty has gone.
+		   Nowhere to send this. */
+		pthread_mutex_unlock(&(mux->lock));
+		return count;
+	}
+	if (!(card->announced)) {
+		size_t namelen = strlen(card->name);
+		if (!out_reserve(mux, MUX_HEADER_SIZE + namelen, sizeof(mux->out))) {
+			goto full;
+		}
+		out_frame(mux, MUX_FRAME_NAME, card->id, card->name, namelen);
+		card->announced = 1;
+	}
+
+	fill = mux->out_end - mux->out_start;
+	if (fill + MUX_HEADER_SIZE >= MUX_OUT_BUFFER) {
+		goto full;
+	}
+	if (
+		(mux->last_data_frame >= 0) &&
+		(mux->out[mux->last_data_frame] == MUX_FRAME_DATA)
+	) {
+		struct mux_frame f;
+		mux_get_header(&(mux->out[mux->last_data_frame]), &f);
+		if ((f.id == card->id) && (mux->last_data_frame + MUX_HEADER_SIZE + f.length == mux->out_end)) {
+			/* Just make the previous frame longer. */
+			space = MUX_OUT_BUFFER - fill;
+			if (space > MUX_MAX_PAYLOAD - f.length) {
+				space = MUX_MAX_PAYLOAD - f.length;
+			}
+			if (count < space) space = count;
+			if (space > 0) {
+				out_reserve(mux, space, MUX_OUT_BUFFER);
+				memcpy(&(mux->out[mux->out_end]), buf, space);
+				mux->out_end += space;
+				mux_put_header(&(mux->out[mux->last_data_frame]),
+					MUX_FRAME_DATA, card->id, f.length + space);
+				goto done;
+			}
+			/* That frame is as long as it gets. */
+		}
+	}
+
+	space = MUX_OUT_BUFFER - fill - MUX_HEADER_SIZE;
+	if (count < space) space = count;
+	if (space > MUX_MAX_PAYLOAD) space = MUX_MAX_PAYLOAD;
+	out_reserve(mux, MUX_HEADER_SIZE + space, MUX_OUT_BUFFER);
+	mux->last_data_frame = mux->out_end;
+	out_frame(mux, MUX_FRAME_DATA, card->id, buf, space);
+
+done:
+	if (!(mux->flush_pending)) {
+		flush(mux);
+	}
+	pthread_mutex_unlock(&(mux->lock));
+	return space;
+
+full:
+	/* Even if the io thread is meant to be doing it: it may be held up
+	   delivering input, and we may only be here because the tty has
+	   become writable. */
+	flush(mux);
+	pthread_mutex_unlock(&(mux->lock));
+	errno = EAGAIN;
+	return -1;
+}
+
+static int
+mux_renderer_check_ready(struct renderer *i, struct pollfd *pfd)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+	int full;
+
+	pthread_mutex_lock(&(mux->lock));
+	full = (mux->out_end - mux->out_start + MUX_HEADER_SIZE >= MUX_OUT_BUFFER);
+	pthread_mutex_unlock(&(mux->lock));
+	if (!full) {
+		return 0;
+	}
+	pfd->fd = mux->fd;
+	pfd->events = POLLOUT;
+	return 1;
+}
+
+static void
+got_input_frame(void *arg, const struct mux_frame *f, const void *data, size_t count, uint32_t offset)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)arg;
+
+	if ((f->type != MUX_FRAME_INPUT) || (count == 0)) {
+		return;
+	}
+	/* The ids are the cardserver's own, so there is nothing to look up. */
+	mux->input_callback((void *)data, count, f->id, "", mux->callback_arg);
+}
+
+static void
+got_hello(struct mux_renderer *mux)
+{
+	char *option, *save;
+
+	for (option = strtok_r(mux->hello, " ", &save); option; option = strtok_r(NULL, " ", &save)) {
+		if (0 == strcmp(option, MUX_OPTION_DEFLATE)) {
+			if ((!(mux->inflate_on)) &&
+				(inflateInit2(&(mux->inflate), -15) == Z_OK)
+			) {
+				mux_parser_init(&(mux->inflated_parser));
+				mux->inflate_on = 1;
+			}
+			pthread_mutex_lock(&(mux->lock));
+			start_deflate(mux);
+			pthread_mutex_unlock(&(mux->lock));
+		}
+	}
+}
+
+static void
+inflate_input(struct mux_renderer *mux, const void *data, size_t count)
+{
+	z_stream *z = &(mux->inflate);
+	unsigned char buf[4096];
+	int ret;
+
+	z->next_in = (unsigned char *)data;
+	z->avail_in = count;
+	do {
+		z->next_out = buf;
+		z->avail_out = sizeof(buf);
+		ret = inflate(z, Z_SYNC_FLUSH);
+		if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) {
+			/* Nothing more can be made of this stream. */
+			mux->inflate_ok = 0;
+			return;
+		}
+		mux_parse(&(mux->inflated_parser), buf, sizeof(buf) - z->avail_out,
+			got_input_frame, mux);
+	} while (z->avail_out == 0);
+}
+
+static void
+got_frame(void *arg, const struct mux_frame *f, const void *data, size_t count, uint32_t offset)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)arg;
+	size_t n;
+
+	switch (f->type) {
+	case MUX_FRAME_HELLO:
+		if (offset < sizeof(mux->hello)-1) {
+			n = sizeof(mux->hello)-1 - offset;
+			if (n > count) n = count;
+			memcpy(&(mux->hello[offset]), data, n);
+		}
+		if (offset + count == f->length) {
+			mux->hello[(f->length < sizeof(mux->hello)) ? f->length : (sizeof(mux->hello)-1)] = 0;
+			got_hello(mux);
+		}
+		break;
+	case MUX_FRAME_DEFLATE:
+		if (!(mux->inflate_on)) {
+			break;
+		}
+		if ((offset == 0) && (f->id == MUX_DEFLATE_RESET)) {
+			inflateReset(&(mux->inflate));
+			mux_parser_init(&(mux->inflated_parser));
+			mux->inflate_ok = 1;
+		}
+		if (mux->inflate_ok && count) {
+			inflate_input(mux, data, count);
+		}
+		break;
+	default:
+		got_input_frame(arg, f, data, count, offset);
+	}
+}
+
+static void
+mux_renderer_free(struct mux_renderer *mux)
+{
+	struct mux_card *card;
+
+	close(mux->wake_pipe[0]);
+	close(mux->wake_pipe[1]);
+	if (mux->inflate_on) {
+		inflateEnd(&(mux->inflate));
+	}
+	while ((card = mux->cards)) {
+		mux->cards = card->next;
+		free(card);
+	}
+	free(mux->zout);
+	pthread_mutex_destroy(&(mux->lock));
+	free(mux);
+}
+
+static void *
+mux_io(void *arg)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)arg;
+	struct pollfd pollfd[2];
+	char buf[4096];
+	ssize_t nread;
+	int n, done;
+
+	pollfd[0].fd = mux->wake_pipe[0];
+	pollfd[0].events = POLLIN;
+	pollfd[1].fd = mux->fd;
+
+	for (;;) {
+		pthread_mutex_lock(&(mux->lock));
+		if (mux->destroyed) {
+			pthread_mutex_unlock(&(mux->lock));
+			break;
+		}
+		pollfd[1].events = POLLIN | (mux->flush_pending ? POLLOUT : 0);
+		pthread_mutex_unlock(&(mux->lock));
+
+		n = poll(&(pollfd[0]), 2, -1);
+		if (n <= 0) {
+			if (n == 0) continue;
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) continue;
+			sleep(1);
+			continue;
+		}
+		if (pollfd[0].revents) {
+			read(mux->wake_pipe[0], buf, sizeof(buf));
+		}
+		if (pollfd[1].revents & POLLOUT) {
+			pthread_mutex_lock(&(mux->lock));
+			mux->flush_pending = 0;
+			flush(mux);
+			pthread_mutex_unlock(&(mux->lock));
+		}
+		if (pollfd[1].revents & POLLHUP) {
+			break;
+		}
+		if (!(pollfd[1].revents & POLLIN)) {
+			continue;
+		}
+		nread = read(mux->fd, &(buf[0]), sizeof(buf));
+		if (nread <= 0) {
+			if ((nread < 0) && (errno == EAGAIN)) continue;
+			if ((nread < 0) && (errno == EINTR)) continue;
+			break;
+		}
+		mux_parse(&(mux->parser), buf, nread, got_frame, mux);
+	}
+	pthread_mutex_lock(&(mux->lock));
+	done = mux->destroyed;
+	pthread_mutex_unlock(&(mux->lock));
+	if (!done) {
+		/* Which may well destroy the renderer, on this thread. */
+		mux->input_callback(NULL, 0, CARD_ID_NONE, "", mux->callback_arg);
+	}
+	pthread_mutex_lock(&(mux->lock));
+	mux->input_done = 1;
+	done = mux->destroyed;
+	pthread_mutex_unlock(&(mux->lock));
+	if (done) {
+		mux_renderer_free(mux);
+	}
+	return NULL;
+}
+
+static void
+mux_renderer_destroy(struct renderer *i)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+	const char dummy = 0;
+	struct pollfd pollfd;
+	int tries = 0;
+	int done;
+
+	/* Give what is still buffered a chance to get out. */
+	pthread_mutex_lock(&(mux->lock));
+	pollfd.fd = mux->fd;
+	pollfd.events = POLLOUT;
+	while (((mux->zout_start < mux->zout_end) || (mux->out_start < mux->out_end)) &&
+		(tries++ < 100)
+	) {
+		pthread_mutex_unlock(&(mux->lock));
+		poll(&pollfd, 1, 10);
+		pthread_mutex_lock(&(mux->lock));
+		flush(mux);
+	}
+	if (mux->deflate_on) {
+		deflateEnd(&(mux->deflate));
+		mux->deflate_on = 0;
+		mux->compressing = 0;
+	}
+	pthread_mutex_unlock(&(mux->lock));
+
+	if (mux->can_restore_termios) {
+		tcsetattr(mux->fd, TCSANOW, &(mux->termios_for_restore));
+	}
+
+	pthread_mutex_lock(&(mux->lock));
+	mux->destroyed = 1;
+	done = (!(mux->input_started)) || mux->input_done;
+	if (!done) {
+		/* Get the io thread to stop and free it. */
+		write(mux->wake_pipe[1], &dummy, 1);
+	}
+	pthread_mutex_unlock(&(mux->lock));
+	if (done) {
+		mux_renderer_free(mux);
+	}
+}
+
+static void
+mux_set_input_callback(
+	struct renderer *i,
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg),
+	void *callback_arg
+)
+{
+	struct mux_renderer *mux = (struct mux_renderer *)i;
+	pthread_t thread_id;
+	pthread_attr_t thread_attr;
+
+	mux->input_callback = input_callback;
+	mux->callback_arg = callback_arg;
+	/* Nothing is read until there is somewhere for it to go. */
+	if (!(mux->input_started)) {
+		mux->input_started = 1;
+		pthread_attr_init(&thread_attr);
+		pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+		pthread_create(&thread_id, &thread_attr, mux_io, mux);
+	}
+}
+
+const struct renderer_interface mux_renderer_interface = {
+	.set_input_callback = mux_set_input_callback,
+	.destroy = mux_renderer_destroy,
+	.write = mux_renderer_write,
+	.claim = mux_renderer_claim,
+	.claim_none = mux_renderer_claim_none,
+	.check_ready_for_output = mux_renderer_check_ready,
+};
+
+struct renderer *
+new_mux_renderer(int fd)
+{
+	struct termios tio;
+
+	struct mux_renderer *mux = malloc(sizeof(struct mux_renderer));
+	if (!mux) return NULL;
+	memset(mux, 0, sizeof(*mux));
+	mux->base.intf = &mux_renderer_interface;
+	mux->fd = fd;
+	mux->last_data_frame = -1;
+	pthread_mutex_init(&(mux->lock), NULL);
+	mux_parser_init(&(mux->parser));
+	if (pipe(&(mux->wake_pipe[0])) < 0) {
+		free(mux);
+		return NULL;
+	}
+	setnonblock(mux->wake_pipe[0]);
+	setnonblock(fd);
+
+	if (tcgetattr(fd, &tio) == 0) {
+		memcpy(&(mux->termios_for_restore), &(tio), sizeof(tio));
+		mux->can_restore_termios = 1;
+		cfmakeraw(&tio);
+		tio.c_lflag &= ~ECHO;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	out_frame(mux, MUX_FRAME_HELLO, MUX_VERSION,
+		MUX_HELLO_MAGIC, sizeof(MUX_HELLO_MAGIC)-1);
+
+	pthread_mutex_lock(&(mux->lock));
+	flush(mux);
+	pthread_mutex_unlock(&(mux->lock));
+
+	return (struct renderer *)mux;
+}
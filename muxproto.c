@@ -0,0 +1,52 @@
+#include <string.h>
+#include "muxproto.h"
+
+void
+mux_parser_init(struct mux_parser *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+void
+mux_parse(struct mux_parser *p, const void *buf, size_t count,
+	mux_frame_callback cb, void *arg)
+{
+	const unsigned char *s = (const unsigned char *)buf;
+	const unsigned char *end = s + count;
+
+	while (s < end) {
+		if (p->header_fill < MUX_HEADER_SIZE) {
+			if ((p->header_fill == 0) && (end - s >= MUX_HEADER_SIZE)) {
+				/* Common case: the whole header is here. */
+				mux_get_header(s, &(p->frame));
+				s += MUX_HEADER_SIZE;
+			} else {
+				size_t n = MUX_HEADER_SIZE - p->header_fill;
+				if (n > end - s) n = end - s;
+				memcpy(&(p->header[p->header_fill]), s, n);
+				p->header_fill += n;
+				s += n;
+				if (p->header_fill < MUX_HEADER_SIZE) {
+					break;
+				}
+				mux_get_header(p->header, &(p->frame));
+			}
+			p->header_fill = MUX_HEADER_SIZE;
+			p->payload_done = 0;
+			if (p->frame.length == 0) {
+				cb(arg, &(p->frame), s, 0, 0);
+				p->header_fill = 0;
+				continue;
+			}
+		}
+
+		size_t n = p->frame.length - p->payload_done;
+		if (n > end - s) n = end - s;
+		cb(arg, &(p->frame), s, n, p->payload_done);
+		p->payload_done += n;
+		s += n;
+		if (p->payload_done == p->frame.length) {
+			p->header_fill = 0;
+		}
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef _DECK_MUXPROTO_H
+#define _DECK_MUXPROTO_H
+
+/* The binary framing used by the "mux" renderer on the original tty.
+
+   Everything in both directions is a frame: an 8 byte header followed
+   by the payload.
+
+     byte 0     frame type, one of MUX_FRAME_*
+     bytes 1-3  payload length, little-endian
+     bytes 4-7  card id, little-endian
+
+   The far end never needs to look inside a payload to find where the
+   next frame starts, so card output can contain anything at all. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MUX_HEADER_SIZE 8
+#define MUX_MAX_PAYLOAD 0xffffff
+
+#define MUX_VERSION 2
+#define MUX_HELLO_MAGIC "deckmux"
+
+/* deck -> far end: first frame on the stream. The id is MUX_VERSION,
+   the payload is MUX_HELLO_MAGIC.
+   far end -> deck (version 2 on): the payload is a space separated
+   list of the options the far end wants, from MUX_OPTION_*. Options
+   it does not ask for stay off, so a far end which never says hello
+   gets plain frames. */
+#define MUX_FRAME_HELLO 'H'
+/* deck -> far end: the payload is the name of card id. Always comes
+   before the first data for that id. */
+#define MUX_FRAME_NAME 'N'
+/* deck -> far end: output from card id. */
+#define MUX_FRAME_DATA 'D'
+/* far end -> deck: input for card id. */
+#define MUX_FRAME_INPUT 'I'
+/* Either way (version 2 on), once MUX_OPTION_DEFLATE is asked for:
+   the payload is a piece of a raw deflate stream (RFC 1951) and
+   inflates to more frames of the types above. Each piece ends at a
+   sync flush point, so everything in it can be inflated and acted on
+   straight away. Consecutive pieces continue the same stream, unless
+   the id is MUX_DEFLATE_RESET, which means a new stream starts with
+   this piece. Plain frames may come between pieces: the deck sends
+   its output that way while it is not compressing well. */
+#define MUX_FRAME_DEFLATE 'Z'
+#define MUX_DEFLATE_RESET 1
+
+#define MUX_OPTION_DEFLATE "deflate"
+
+struct mux_frame {
+	int type;
+	uint32_t id;
+	uint32_t length;
+};
+
+static inline void
+mux_put_header(unsigned char *p, int type, uint32_t id, uint32_t length)
+{
+	p[0] = type;
+	p[1] = length & 0xff;
+	p[2] = (length >> 8) & 0xff;
+	p[3] = (length >> 16) & 0xff;
+	p[4] = id & 0xff;
+	p[5] = (id >> 8) & 0xff;
+	p[6] = (id >> 16) & 0xff;
+	p[7] = (id >> 24) & 0xff;
+}
+
+static inline void
+mux_get_header(const unsigned char *p, struct mux_frame *f)
+{
+	f->type = p[0];
+	f->length = p[1] | (p[2] << 8) | ((uint32_t)p[3] << 16);
+	f->id = p[4] | (p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+}
+
+/* Incremental frame parser. It does not allocate or copy payloads:
+   the callback gets pointers into the caller's buffer, so a payload
+   which is split across reads is delivered in several pieces. offset
+   is where the piece starts within the payload, so the frame is
+   complete once offset+count == frame->length. A frame with no
+   payload is delivered once with count 0. */
+struct mux_parser {
+	unsigned char header[MUX_HEADER_SIZE];
+	size_t header_fill;
+	struct mux_frame frame;
+	uint32_t payload_done;
+};
+
+typedef void (*mux_frame_callback)(void *arg, const struct mux_frame *frame,
+	const void *data, size_t count, uint32_t offset);
+
+void mux_parser_init(struct mux_parser *);
+void mux_parse(struct mux_parser *, const void *buf, size_t count,
+	mux_frame_callback cb, void *arg);
+
+#endif /* _DECK_MUXPROTO_H */
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include "ptypool.h"
+
+/* Look again this often while the pool is bigger than the minimum, so
+   that it shrinks once cards stop starting. */
+#define PTY_POOL_RECHECK_NSEC 1000000000ULL
+
+static unsigned long long
+nsec_between(const struct timespec *from, const struct timespec *to)
+{
+	long long d = (to->tv_sec - from->tv_sec) * 1000000000LL +
+		(to->tv_nsec - from->tv_nsec);
+	return (d > 0) ? d : 0;
+}
+
+/* Returns -1 if no pty could be had. Both fds are close-on-exec, and
+   the slave will not become anybody's controlling tty until asked. */
+static int
+make_pty(int *master, int *slave)
+{
+	char name[64];
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*master < 0) {
+		return -1;
+	}
+	if ((grantpt(*master) < 0) || (unlockpt(*master) < 0) ||
+			(ptsname_r(*master, name, sizeof(name)) != 0)) {
+		close(*master);
+		return -1;
+	}
+	*slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*slave < 0) {
+		close(*master);
+		return -1;
+	}
+	return 0;
+}
+
+/* How many to keep, going by how often they have been taken lately.
+   Called with the lock held. */
+static int
+pool_target(struct pty_pool *pool, const struct timespec *now)
+{
+	unsigned long long interval = pool->interval_nsec;
+	unsigned long long since = nsec_between(&(pool->last_taken), now);
+	unsigned long long want;
+
+	/* A pool nobody is taking from is worth less and less. */
+	if (since > interval) {
+		interval = since;
+	}
+	if (interval == 0) {
+		return PTY_POOL_MAX;
+	}
+	want = PTY_POOL_HORIZON_NSEC / interval + 1;
+	if (want < PTY_POOL_MIN) return PTY_POOL_MIN;
+	if (want > PTY_POOL_MAX) return PTY_POOL_MAX;
+	return want;
+}
+
+static void
+refill(struct iowatch *w, uint32_t events)
+{
+	struct pty_pool *pool = (struct pty_pool *)((char *)w - offsetof(struct pty_pool, watch));
+	struct timespec now, recheck;
+	int master, slave, missing;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&(pool->lock));
+	pool->target = pool_target(pool, &now);
+	while (pool->count > pool->target) {
+		pool->count--;
+		close(pool->master[pool->count]);
+		close(pool->slave[pool->count]);
+		pool->stats.dropped++;
+	}
+	missing = pool->target - pool->count;
+	pthread_mutex_unlock(&(pool->lock));
+
+	while (missing-- > 0) {
+		if (make_pty(&master, &slave) < 0) {
+			perror("pty pool");
+			break;
+		}
+		pthread_mutex_lock(&(pool->lock));
+		if (pool->count < PTY_POOL_MAX) {
+			pool->master[pool->count] = master;
+			pool->slave[pool->count] = slave;
+			pool->count++;
+			master = slave = -1;
+		}
+		pool->stats.made++;
+		pthread_mutex_unlock(&(pool->lock));
+		if (master >= 0) {
+			close(master);
+			close(slave);
+		}
+	}
+
+	if (pool->target > PTY_POOL_MIN) {
+		recheck = now;
+		recheck.tv_sec += PTY_POOL_RECHECK_NSEC / 1000000000ULL;
+		ioloop_set_timer(&(pool->watch), &recheck);
+	} else {
+		ioloop_set_timer(&(pool->watch), NULL);
+	}
+}
+
+void
+pty_pool_init(struct pty_pool *pool, struct ioloop *loop)
+{
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&(pool->lock), NULL);
+	/* Until cards start, as if one had started each horizon. */
+	pool->interval_nsec = PTY_POOL_HORIZON_NSEC;
+	clock_gettime(CLOCK_MONOTONIC, &(pool->last_taken));
+	ioloop_watch_init(&(pool->watch), loop, refill);
+	ioloop_kick(&(pool->watch));
+}
+
+int
+pty_pool_take(struct pty_pool *pool, int *master, int *slave)
+{
+	struct timespec now;
+	unsigned long long since;
+	int ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&(pool->lock));
+	since = nsec_between(&(pool->last_taken), &now);
+	if (since > PTY_POOL_RECHECK_NSEC) {
+		since = PTY_POOL_RECHECK_NSEC;
+	}
+	pool->interval_nsec = (pool->interval_nsec * 7 + since) / 8;
+	pool->last_taken = now;
+	if (pool->count > 0) {
+		pool->count--;
+		*master = pool->master[pool->count];
+		*slave = pool->slave[pool->count];
+		pool->stats.handed_out++;
+		ret = 0;
+	} else {
+		pool->stats.missed++;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+	ioloop_kick(&(pool->watch));
+	return ret;
+}
+
+void
+pty_pool_get_stats(struct pty_pool *pool, struct pty_pool_stats *stats,
+	int *count, int *target)
+{
+	pthread_mutex_lock(&(pool->lock));
+	*stats = pool->stats;
+	*count = pool->count;
+	*target = pool->target;
+	pthread_mutex_unlock(&(pool->lock));
+}
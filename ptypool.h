@@ -0,0 +1,57 @@
+#ifndef _DECK_PTYPOOL_H
+#define _DECK_PTYPOOL_H
+
+/* Pty pairs made ahead of time, so that a card starting up can be
+   handed one over its connection instead of making its own on the way
+   to running its command. Cards take them on the loop that creates
+   cards, and the pool is topped up again afterwards on a loop of its
+   own, never while anybody waits.
+
+   How many are kept ready follows how fast cards have been starting
+   lately: enough for those expected over the next PTY_POOL_HORIZON_NSEC,
+   between PTY_POOL_MIN and PTY_POOL_MAX. A pool that has not been used
+   for a while goes back down to PTY_POOL_MIN. */
+
+#include <time.h>
+#include <pthread.h>
+#include "ioloop.h"
+
+#define PTY_POOL_MIN 1
+#define PTY_POOL_MAX 16
+#define PTY_POOL_HORIZON_NSEC 50000000ULL
+
+struct pty_pool_stats {
+	unsigned long long handed_out;
+	/* Asked for while the pool was empty */
+	unsigned long long missed;
+	unsigned long long made;
+	/* Closed again because fewer were wanted */
+	unsigned long long dropped;
+};
+
+struct pty_pool {
+	struct iowatch watch;
+	/* Protects everything below. Never held while a pty is made. */
+	pthread_mutex_t lock;
+	int master[PTY_POOL_MAX];
+	int slave[PTY_POOL_MAX];
+	int count;
+	int target;
+	/* Moving average of the time between ptys being taken */
+	unsigned long long interval_nsec;
+	struct timespec last_taken;
+	struct pty_pool_stats stats;
+};
+
+/* Starts filling the pool from loop. */
+void pty_pool_init(struct pty_pool *pool, struct ioloop *loop);
+
+/* Take a pty pair, whose fds are then the caller's, and return 0, or
+   return -1 if the pool is empty. Either way the pool is topped up in
+   the background. Any thread. */
+int pty_pool_take(struct pty_pool *pool, int *master, int *slave);
+
+void pty_pool_get_stats(struct pty_pool *pool, struct pty_pool_stats *stats,
+	int *count, int *target);
+
+#endif /* _DECK_PTYPOOL_H */
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "record.h"
+
+/* Returns -1 if the file cannot be written. */
+static int
+write_all(int fd, const unsigned char *data, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = write(fd, data, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static void *
+writer(void *arg)
+{
+	struct record_log *log = (struct record_log *)arg;
+	const unsigned char *data;
+	size_t count;
+	int failed;
+
+	pthread_mutex_lock(&(log->lock));
+	for (;;) {
+		while ((log->out_fill == 0) && (!(log->closing))) {
+			pthread_cond_wait(&(log->cv), &(log->lock));
+		}
+		if (log->out_fill == 0) {
+			break;
+		}
+		data = log->buf[!(log->cur)];
+		count = log->out_fill;
+		pthread_mutex_unlock(&(log->lock));
+
+		failed = (write_all(log->fd, data, count) < 0);
+		if (failed) {
+			/* Better to lose the recording than the session. */
+			perror("recording");
+		}
+
+		pthread_mutex_lock(&(log->lock));
+		log->out_fill = 0;
+		if (failed) {
+			log->stopped = 1;
+		}
+		pthread_cond_broadcast(&(log->cv));
+	}
+	pthread_mutex_unlock(&(log->lock));
+	return NULL;
+}
+
+struct record_log *
+record_open(const char *path)
+{
+	struct record_file_header fh;
+	struct record_log *log;
+	struct timespec now;
+
+	log = malloc(sizeof(*log));
+	if (!log) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(log, 0, sizeof(*log));
+	log->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0666);
+	if (log->fd < 0) {
+		perror(path);
+		free(log);
+		return NULL;
+	}
+	pthread_mutex_init(&(log->lock), NULL);
+	pthread_cond_init(&(log->cv), NULL);
+	clock_gettime(CLOCK_MONOTONIC, &(log->start));
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, RECORD_MAGIC, sizeof(fh.magic));
+	fh.start_nsec = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	memcpy(log->buf[0], &fh, sizeof(fh));
+	log->fill = sizeof(fh);
+	if (pthread_create(&(log->writer), NULL, writer, log) != 0) {
+		perror("recording: pthread_create");
+		close(log->fd);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+/* Must hold lock. Hand buf[cur] to the writer and start on the other
+   one, or return -1 if the writer is not done with that yet. */
+static int
+swap(struct record_log *log)
+{
+	if (log->out_fill) {
+		return -1;
+	}
+	log->out_fill = log->fill;
+	log->cur = !(log->cur);
+	log->fill = 0;
+	pthread_cond_broadcast(&(log->cv));
+	return 0;
+}
+
+void
+record_add(struct record_log *log, enum record_type type, uint32_t card_id,
+	const void *data, size_t count)
+{
+	struct record_header h;
+	struct timespec now;
+	unsigned char *p;
+	size_t n, size;
+
+	memset(&h, 0, sizeof(h));
+	h.type = type;
+	h.card_id = card_id;
+	pthread_mutex_lock(&(log->lock));
+	/* Stamped under the lock so that times in the file only go
+	   forwards. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	h.nsec = (now.tv_sec - log->start.tv_sec) * 1000000000ULL +
+		now.tv_nsec - log->start.tv_nsec;
+	for (;;) {
+		if (log->stopped) {
+			break;
+		}
+		/* Anything too big for the buffer is split up. */
+		n = RECORD_BUFFER - sizeof(h);
+		if (n > count) n = count;
+		size = sizeof(h) + RECORD_ALIGN(n);
+		if (log->fill + size > RECORD_BUFFER) {
+			if (swap(log) < 0) {
+				log->dropped += count;
+				break;
+			}
+			continue;
+		}
+		h.length = n;
+		p = log->buf[log->cur] + log->fill;
+		memcpy(p, &h, sizeof(h));
+		memcpy(p + sizeof(h), data, n);
+		memset(p + sizeof(h) + n, 0, size - sizeof(h) - n);
+		log->fill += size;
+		data = (const char *)data + n;
+		count -= n;
+		if (count == 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(log->lock));
+}
+
+void
+record_close(struct record_log *log)
+{
+	pthread_mutex_lock(&(log->lock));
+	if (log->closing) {
+		pthread_mutex_unlock(&(log->lock));
+		return;
+	}
+	while (log->out_fill) {
+		pthread_cond_wait(&(log->cv), &(log->lock));
+	}
+	if ((!(log->stopped)) && log->fill) {
+		swap(log);
+	}
+	log->stopped = 1;
+	log->closing = 1;
+	pthread_cond_broadcast(&(log->cv));
+	pthread_mutex_unlock(&(log->lock));
+
+	pthread_join(log->writer, NULL);
+	close(log->fd);
+	if (log->dropped) {
+		fprintf(stderr, "recording: %llu bytes were not recorded, "
+			"the disk could not keep up\n", log->dropped);
+	}
+}
+
+int
+record_reader_open(struct record_reader *r, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(struct record_file_header)) {
+		fprintf(stderr, "%s is not a deck recording\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	r->map = map;
+	r->size = st.st_size;
+	r->file = (const struct record_file_header *)map;
+	if (memcmp(r->file->magic, RECORD_MAGIC, sizeof(r->file->magic))) {
+		fprintf(stderr, "%s is not a deck recording\n", path);
+		record_reader_close(r);
+		return -1;
+	}
+	r->off = sizeof(struct record_file_header);
+	return 0;
+}
+
+void
+record_reader_close(struct record_reader *r)
+{
+	if (r->map) {
+		munmap((void *)(r->map), r->size);
+		r->map = NULL;
+	}
+}
+
+int
+record_next(struct record_reader *r, const struct record_header **h, const void **data)
+{
+	const struct record_header *next;
+
+	if (r->size - r->off < sizeof(*next)) {
+		return 0;
+	}
+	next = (const struct record_header *)(r->map + r->off);
+	if (r->size - r->off - sizeof(*next) < next->length) {
+		return 0;
+	}
+	*h = next;
+	*data = next + 1;
+	r->off += sizeof(*next) + RECORD_ALIGN(next->length);
+	if (r->off > r->size) {
+		/* The padding of the last record was cut off. */
+		r->off = r->size;
+	}
+	return 1;
+}
@@ -0,0 +1,106 @@
+#ifndef _DECK_RECORD_H
+#define _DECK_RECORD_H
+
+/* A recording of a deck session: every card's output as it was read
+   from the card and every piece of input as it was given to a card,
+   each stamped with when it happened. "deck -R file" makes one and
+   deckreplay plays it back through a renderer.
+
+   The file is a struct record_file_header and then records, each a
+   struct record_header followed by its payload, padded so that the
+   next header is 8-byte aligned. It is only ever appended to, and is
+   in the byte order of the machine that wrote it, so it can be mapped
+   and walked in place. A recording cut short (the deck was killed)
+   just ends at the last whole record. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#define RECORD_MAGIC "DECKREC1"
+
+struct record_file_header {
+	char magic[8];
+	/* CLOCK_REALTIME when the recording started */
+	uint64_t start_nsec;
+};
+
+enum record_type {
+	/* A card has started. The payload is its name. */
+	RECORD_CARD = 1,
+	RECORD_OUTPUT = 2,
+	RECORD_INPUT = 3,
+	/* The card has gone. No payload. */
+	RECORD_GONE = 4,
+};
+
+struct record_header {
+	/* CLOCK_MONOTONIC since the recording started */
+	uint64_t nsec;
+	uint32_t type;
+	uint32_t card_id;
+	uint32_t length;
+	uint32_t reserved;
+};
+
+#define RECORD_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* Writing. Records are collected in memory and appended in large
+   writes. Any thread may add records. The writes are done by a thread
+   of the log's own from the other of two buffers, so adding a record
+   never waits for the disk. If the disk falls so far behind that both
+   buffers are full, records are dropped and counted instead. */
+
+#define RECORD_BUFFER (1024*1024)
+
+struct record_log {
+	/* Protects everything below but fd, which is the writer's. */
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_t writer;
+	int fd;
+	struct timespec start;
+	/* Records are added to buf[cur], and buf[!cur] is being written
+	   out while out_fill is not 0. */
+	int cur;
+	size_t fill;
+	size_t out_fill;
+	/* The file cannot be written to or record_close() has been
+	   called, so records are no longer kept. */
+	int stopped;
+	/* Told to finish once what is in buf[!cur] is out */
+	int closing;
+	unsigned long long dropped;
+	unsigned char buf[2][RECORD_BUFFER];
+};
+
+/* Returns NULL, having said why, if the file could not be made. */
+struct record_log *record_open(const char *path);
+
+void record_add(struct record_log *log, enum record_type type, uint32_t card_id,
+	const void *data, size_t count);
+
+/* Write out what is left and close the file. Records added after this
+   are dropped, so threads which may still be adding some need not be
+   stopped first; the log is not freed for the same reason. */
+void record_close(struct record_log *log);
+
+/* Reading */
+
+struct record_reader {
+	const unsigned char *map;
+	size_t size;
+	size_t off;
+	const struct record_file_header *file;
+};
+
+/* Returns -1, having said why, if path is not a readable recording. */
+int record_reader_open(struct record_reader *r, const char *path);
+void record_reader_close(struct record_reader *r);
+
+/* Point *h and *data at the next record and return 1, or return 0 at
+   the end. */
+int record_next(struct record_reader *r, const struct record_header **h, const void **data);
+
+#endif /* _DECK_RECORD_H */
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "cardmux.h"
+#include "registry.h"
+
+/* Open addressing with linear probing, one index each by id, by name
+   and by token, all holding pointers to the cards themselves. Cards
+   without a token are left out of the token index. Removed entries become
+   tombstones so that probe chains stay intact for concurrent readers.
+   When the table fills up with entries and tombstones, a new one is
+   built and swapped in, and the old one is freed once no reader can
+   be looking at it any more.
+
+   Readers are counted by the parity of the epoch they started in. A
+   writer done with a change moves the epoch on and then waits only for
+   the count of the epoch before, which nobody joins any more, so steady
+   read traffic cannot hold it up for longer than the slowest reader
+   that was already there. */
+
+#define TOMBSTONE ((struct cardclient *)1)
+#define MIN_TABLE_SIZE 16
+
+typedef _Atomic(struct cardclient *) slot_t;
+
+struct registry_table {
+	size_t mask;
+	slot_t *by_id;
+	slot_t *by_name;
+	slot_t *by_token;
+	slot_t slots[];
+};
+
+struct card_registry {
+	_Atomic(struct registry_table *) table;
+	atomic_uint epoch;
+	atomic_uint readers[2];
+	atomic_uint next_id;
+
+	/* Writers only */
+	pthread_mutex_t lock;
+	/* One grace period at a time */
+	pthread_mutex_t sync_lock;
+	size_t live;
+	size_t used;
+};
+
+static size_t
+hash_id(uint32_t id)
+{
+	return id * 2654435761u;
+}
+
+static size_t
+hash_name(const char *name)
+{
+	/* FNV-1a */
+	size_t h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)(*name++);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t
+hash_token(uint64_t token)
+{
+	/* Tokens are random already; just fold the halves together. */
+	return (size_t)(token ^ (token >> 32));
+}
+
+static struct registry_table *
+new_table(size_t size)
+{
+	struct registry_table *t;
+	size_t i;
+
+	t = malloc(sizeof(*t) + 3 * size * sizeof(slot_t));
+	if (!t) {
+		return NULL;
+	}
+	t->mask = size - 1;
+	t->by_id = &(t->slots[0]);
+	t->by_name = &(t->slots[size]);
+	t->by_token = &(t->slots[2 * size]);
+	for (i = 0; i < 3 * size; i++) {
+		atomic_init(&(t->slots[i]), NULL);
+	}
+	return t;
+}
+
+/* Put c in the first free slot of its chain in index. */
+static void
+insert(slot_t *index, size_t mask, size_t h, struct cardclient *c)
+{
+	struct cardclient *e;
+
+	for (;; h++) {
+		e = atomic_load_explicit(&(index[h & mask]), memory_order_relaxed);
+		if ((e == NULL) || (e == TOMBSTONE)) {
+			atomic_store(&(index[h & mask]), c);
+			return;
+		}
+	}
+}
+
+static void
+delete(slot_t *index, size_t mask, size_t h, struct cardclient *c)
+{
+	struct cardclient *e;
+
+	for (;; h++) {
+		e = atomic_load_explicit(&(index[h & mask]), memory_order_relaxed);
+		if (e == NULL) {
+			return;
+		}
+		if (e == c) {
+			atomic_store(&(index[h & mask]), TOMBSTONE);
+			return;
+		}
+	}
+}
+
+/* Wait until no reader is in a read section that started before now. */
+static void
+synchronize(struct card_registry *reg)
+{
+	unsigned int old;
+
+	pthread_mutex_lock(&(reg->sync_lock));
+	old = atomic_fetch_add(&(reg->epoch), 1);
+	while (atomic_load(&(reg->readers[old & 1])) != 0) {
+		sched_yield();
+	}
+	pthread_mutex_unlock(&(reg->sync_lock));
+}
+
+struct card_registry *
+registry_new(void)
+{
+	struct card_registry *reg = malloc(sizeof(*reg));
+	struct registry_table *t = new_table(MIN_TABLE_SIZE);
+
+	if ((!reg) || (!t)) {
+		free(reg);
+		free(t);
+		return NULL;
+	}
+	atomic_init(&(reg->table), t);
+	atomic_init(&(reg->epoch), 0);
+	atomic_init(&(reg->readers[0]), 0);
+	atomic_init(&(reg->readers[1]), 0);
+	atomic_init(&(reg->next_id), 0);
+	pthread_mutex_init(&(reg->lock), NULL);
+	pthread_mutex_init(&(reg->sync_lock), NULL);
+	reg->live = 0;
+	reg->used = 0;
+	return reg;
+}
+
+/* Must hold lock. Rebuild the table with room to spare for the live cards. */
+static int
+rebuild(struct card_registry *reg)
+{
+	struct registry_table *old = atomic_load(&(reg->table));
+	struct registry_table *t;
+	struct cardclient *c;
+	size_t size = MIN_TABLE_SIZE;
+	size_t i;
+
+	while (size < (reg->live + 1) * 4) {
+		size *= 2;
+	}
+	t = new_table(size);
+	if (!t) {
+		return -1;
+	}
+	for (i = 0; i <= old->mask; i++) {
+		c = atomic_load_explicit(&(old->by_id[i]), memory_order_relaxed);
+		if ((c == NULL) || (c == TOMBSTONE)) continue;
+		insert(t->by_id, t->mask, hash_id(c->id), c);
+		insert(t->by_name, t->mask, hash_name(c->card_name), c);
+		if (c->token) {
+			insert(t->by_token, t->mask, hash_token(c->token), c);
+		}
+	}
+	atomic_store(&(reg->table), t);
+	reg->used = reg->live;
+	synchronize(reg);
+	free(old);
+	return 0;
+}
+
+uint32_t
+registry_new_id(struct card_registry *reg)
+{
+	return atomic_fetch_add(&(reg->next_id), 1);
+}
+
+int
+registry_add(struct card_registry *reg, struct cardclient *c)
+{
+	struct registry_table *t;
+
+	pthread_mutex_lock(&(reg->lock));
+	t = atomic_load(&(reg->table));
+	if ((reg->used + 1) * 2 > t->mask + 1) {
+		if (rebuild(reg) < 0) {
+			pthread_mutex_unlock(&(reg->lock));
+			return -1;
+		}
+		t = atomic_load(&(reg->table));
+	}
+	insert(t->by_id, t->mask, hash_id(c->id), c);
+	insert(t->by_name, t->mask, hash_name(c->card_name), c);
+	if (c->token) {
+		insert(t->by_token, t->mask, hash_token(c->token), c);
+	}
+	reg->live++;
+	reg->used++;
+	pthread_mutex_unlock(&(reg->lock));
+	return 0;
+}
+
+void
+registry_remove(struct card_registry *reg, struct cardclient *c)
+{
+	struct registry_table *t;
+
+	pthread_mutex_lock(&(reg->lock));
+	t = atomic_load(&(reg->table));
+	delete(t->by_id, t->mask, hash_id(c->id), c);
+	delete(t->by_name, t->mask, hash_name(c->card_name), c);
+	if (c->token) {
+		delete(t->by_token, t->mask, hash_token(c->token), c);
+	}
+	reg->live--;
+	pthread_mutex_unlock(&(reg->lock));
+	synchronize(reg);
+}
+
+unsigned int
+registry_read_lock(struct card_registry *reg)
+{
+	unsigned int epoch;
+
+	for (;;) {
+		epoch = atomic_load(&(reg->epoch));
+		atomic_fetch_add(&(reg->readers[epoch & 1]), 1);
+		/* If a writer moved the epoch on meanwhile, it may not be
+		   waiting for this count any more. */
+		if (atomic_load(&(reg->epoch)) == epoch) {
+			return epoch & 1;
+		}
+		atomic_fetch_sub(&(reg->readers[epoch & 1]), 1);
+	}
+}
+
+void
+registry_read_unlock(struct card_registry *reg, unsigned int section)
+{
+	atomic_fetch_sub(&(reg->readers[section]), 1);
+}
+
+struct cardclient *
+registry_lookup(struct card_registry *reg, uint32_t id)
+{
+	struct registry_table *t = atomic_load(&(reg->table));
+	struct cardclient *c;
+	size_t h;
+
+	for (h = hash_id(id);; h++) {
+		c = atomic_load(&(t->by_id[h & t->mask]));
+		if (c == NULL) return NULL;
+		if ((c != TOMBSTONE) && (c->id == id)) return c;
+	}
+}
+
+struct cardclient *
+registry_lookup_name(struct card_registry *reg, const char *name)
+{
+	struct registry_table *t = atomic_load(&(reg->table));
+	struct cardclient *c;
+	size_t h;
+
+	for (h = hash_name(name);; h++) {
+		c = atomic_load(&(t->by_name[h & t->mask]));
+		if (c == NULL) return NULL;
+		if ((c != TOMBSTONE) && (0 == strcmp(c->card_name, name))) return c;
+	}
+}
+
+struct cardclient *
+registry_lookup_token(struct card_registry *reg, uint64_t token)
+{
+	struct registry_table *t = atomic_load(&(reg->table));
+	struct cardclient *c;
+	size_t h;
+
+	if (!token) return NULL;
+	for (h = hash_token(token);; h++) {
+		c = atomic_load(&(t->by_token[h & t->mask]));
+		if (c == NULL) return NULL;
+		if ((c != TOMBSTONE) && (c->token == token)) return c;
+	}
+}
+
+void
+registry_foreach(struct card_registry *reg,
+	void (*fn)(struct cardclient *, void *arg), void *arg)
+{
+	struct registry_table *t = atomic_load(&(reg->table));
+	struct cardclient *c;
+	size_t i;
+
+	for (i = 0; i <= t->mask; i++) {
+		c = atomic_load(&(t->by_id[i]));
+		if ((c != NULL) && (c != TOMBSTONE)) {
+			fn(c, arg);
+		}
+	}
+}
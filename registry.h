@@ -0,0 +1,48 @@
+#ifndef _DECK_REGISTRY_H
+#define _DECK_REGISTRY_H
+
+/* The table of live cards in a cardserver, indexed by the numeric id
+   each card is given when it is created, by name and by token.
+
+   It is read-mostly: lookups take no lock at all. They must be done
+   between registry_read_lock() and registry_read_unlock(), and the card
+   found may only be used until registry_read_unlock(). Changes to the
+   table are serialized by a mutex, and registry_remove() does not
+   return until every reader that might still see the card has left
+   its read section, after which the card can be freed. It does not
+   wait for read sections that start after the card was removed. Read
+   sections must still be short and never block or take a lock that
+   might be held for long. */
+
+#include <stdint.h>
+
+struct cardclient;
+struct card_registry;
+
+struct card_registry *registry_new(void);
+
+/* Hands out a new card id. Ids are never reused. */
+uint32_t registry_new_id(struct card_registry *);
+
+/* Makes c, which must already have its id, name and token, findable.
+   Returns 0 on success, -1 if out of memory. */
+int registry_add(struct card_registry *, struct cardclient *c);
+
+/* Makes c unfindable and waits for readers which might have found it. */
+void registry_remove(struct card_registry *, struct cardclient *c);
+
+/* Returns what registry_read_unlock() must be given to end the section. */
+unsigned int registry_read_lock(struct card_registry *);
+void registry_read_unlock(struct card_registry *, unsigned int section);
+
+/* Return NULL if there is no such card. Inside a read section only. */
+struct cardclient *registry_lookup(struct card_registry *, uint32_t id);
+struct cardclient *registry_lookup_name(struct card_registry *, const char *name);
+/* A token of 0 never matches. */
+struct cardclient *registry_lookup_token(struct card_registry *, uint64_t token);
+
+/* Call fn on every card. Inside a read section only. */
+void registry_foreach(struct card_registry *,
+	void (*fn)(struct cardclient *, void *arg), void *arg);
+
+#endif /* _DECK_REGISTRY_H */
@@ -4,8 +4,14 @@
 /* This defines the details of how multiple bytestreams for multiple cards
    are muxed. */
 
+#include <stdint.h>
+
 struct pollfd;
 
+/* Every card has a numeric id, assigned by the cardserver when the card
+   is created and never reused. */
+#define CARD_ID_NONE ((uint32_t)-1)
+
 struct renderer {
 	const struct renderer_interface *intf;
 	/* opaque */
@@ -15,21 +21,25 @@ struct renderer_interface {
 	void (*set_input_callback)(
 		/* This function is called each time input is received.
 		   The renderer will interpret its raw input and
-		   demux the identify if the card which the input is for. If
+		   demux the identify if the card which the input is for,
+		   by id if it knows it, or else by name with card_id set
+		   to CARD_ID_NONE. If
 		   the data argument is NULL, it means there is something wrong
 		   with the renderer and you should expect no more
-		   input. */
+		   input. No input is read before this is set. */
 		struct renderer *,
 		void (*input_callback)(void *data, size_t count,
-			const char *card_name, void *arg),
+			uint32_t card_id, const char *card_name, void *arg),
 		void *callback_arg
 	);
 	/* Further output will be for this card. */
 	void (*claim)(
 		struct renderer *,
-		/* The renderer may hang on to card_name without copying it
-		   and compare the pointer by identity. The caller is not
-		   to free it or change it until the claim is relinquished. */
+		/* Compare ids, not names, to tell cards apart. */
+		uint32_t card_id,
+		/* The renderer may hang on to card_name without copying it.
+		   The caller is not to free it or change it until the claim
+		   is relinquished. */
 		const char *card_name
 	);
 	/* Further output will be for no card. */
@@ -48,6 +58,13 @@ struct renderer_interface {
 	void (*destroy)(struct renderer *);
 };
 
-struct renderer *new_renderer(int fd);
+/* Creates the renderer called name, or the default one if name is NULL,
+   for the tty fd. Returns NULL if there is no renderer by that name or
+   it could not be created. */
+struct renderer *new_renderer(const char *name, int fd);
+
+/* The renderers that can be chosen from in deck. */
+struct renderer *new_tty_renderer(int fd);
+struct renderer *new_mux_renderer(int fd);
 
 #endif /* _DECK_RENDERER_H */
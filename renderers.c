@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <string.h>
+#include "renderer.h"
+
+/* The renderers that deck can be started with. The first one is the
+   default. */
+static const struct {
+	const char *name;
+	struct renderer *(*create)(int fd);
+} renderers[] = {
+	{ "tty", new_tty_renderer },
+	{ "mux", new_mux_renderer },
+};
+
+struct renderer *
+new_renderer(const char *name, int fd)
+{
+	int i;
+
+	if (!name) {
+		return renderers[0].create(fd);
+	}
+	for (i = 0; i < sizeof(renderers)/sizeof(renderers[0]); i++) {
+		if (0 == strcmp(name, renderers[i].name)) {
+			return renderers[i].create(fd);
+		}
+	}
+	fprintf(stderr, "Unknown renderer \"%s\". Choose from:", name);
+	for (i = 0; i < sizeof(renderers)/sizeof(renderers[0]); i++) {
+		fprintf(stderr, " %s", renderers[i].name);
+	}
+	fprintf(stderr, "\n");
+	return NULL;
+}
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ring.h"
+
+/* Keep at most this many unused buffers around. */
+#define RING_POOL_MAX_FREE 64
+
+struct ring_pool {
+	pthread_mutex_t lock;
+	/* Unused buffers, linked through their first bytes */
+	void *free;
+	int nfree;
+};
+
+struct ring_pool *
+ring_pool_new(void)
+{
+	struct ring_pool *pool = malloc(sizeof(*pool));
+
+	if (!pool) {
+		return NULL;
+	}
+	pthread_mutex_init(&(pool->lock), NULL);
+	pool->free = NULL;
+	pool->nfree = 0;
+	return pool;
+}
+
+static unsigned char *
+pool_get(struct ring_pool *pool)
+{
+	void *buf;
+
+	pthread_mutex_lock(&(pool->lock));
+	buf = pool->free;
+	if (buf) {
+		pool->free = *((void **)buf);
+		pool->nfree--;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+	if (!buf) {
+		buf = malloc(RING_SIZE);
+	}
+	return buf;
+}
+
+static void
+pool_put(struct ring_pool *pool, unsigned char *buf)
+{
+	pthread_mutex_lock(&(pool->lock));
+	if (pool->nfree < RING_POOL_MAX_FREE) {
+		*((void **)buf) = pool->free;
+		pool->free = buf;
+		pool->nfree++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+	free(buf);
+}
+
+void
+ring_init(struct ring *r)
+{
+	r->buf = NULL;
+	atomic_init(&(r->head), 0);
+	atomic_init(&(r->tail), 0);
+}
+
+void
+ring_release(struct ring *r, struct ring_pool *pool)
+{
+	if (r->buf) {
+		pool_put(pool, r->buf);
+		r->buf = NULL;
+	}
+}
+
+size_t
+ring_put(struct ring *r, struct ring_pool *pool, const void *data, size_t count)
+{
+	size_t head = atomic_load_explicit(&(r->head), memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&(r->tail), memory_order_acquire);
+	size_t space = RING_SIZE - (head - tail);
+	size_t off, n;
+
+	if (count > space) count = space;
+	if (count == 0) {
+		return 0;
+	}
+	if (!(r->buf)) {
+		/* The consumer does not look at buf until it sees head move. */
+		r->buf = pool_get(pool);
+		if (!(r->buf)) {
+			return 0;
+		}
+	}
+	off = head & (RING_SIZE - 1);
+	n = RING_SIZE - off;
+	if (n > count) n = count;
+	memcpy(&(r->buf[off]), data, n);
+	memcpy(&(r->buf[0]), (const unsigned char *)data + n, count - n);
+	atomic_store_explicit(&(r->head), head + count, memory_order_release);
+	return count;
+}
+
+size_t
+ring_peek(struct ring *r, const void **data)
+{
+	size_t head = atomic_load_explicit(&(r->head), memory_order_acquire);
+	size_t tail = atomic_load_explicit(&(r->tail), memory_order_relaxed);
+	size_t off = tail & (RING_SIZE - 1);
+	size_t n = head - tail;
+
+	if (n == 0) {
+		return 0;
+	}
+	if (n > RING_SIZE - off) n = RING_SIZE - off;
+	*data = &(r->buf[off]);
+	return n;
+}
+
+void
+ring_consume(struct ring *r, size_t count)
+{
+	size_t tail = atomic_load_explicit(&(r->tail), memory_order_relaxed);
+
+	atomic_store_explicit(&(r->tail), tail + count, memory_order_release);
+}
+
+size_t
+ring_fill(struct ring *r)
+{
+	size_t tail = atomic_load(&(r->tail));
+	size_t head = atomic_load(&(r->head));
+
+	return head - tail;
+}
@@ -0,0 +1,46 @@
+#ifndef _DECK_RING_H
+#define _DECK_RING_H
+
+/* A fixed-size byte ring with one producer thread and one consumer
+   thread, which need no lock between them. The buffer is only taken
+   from a ring_pool when something is first put in the ring, because
+   most rings never see any data, and goes back to the pool with
+   ring_release(). */
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define RING_SIZE 16384	/* must be a power of 2 */
+
+struct ring_pool;
+
+struct ring {
+	unsigned char *buf;
+	/* Free-running counts of bytes put and taken */
+	atomic_size_t head;
+	atomic_size_t tail;
+};
+
+struct ring_pool *ring_pool_new(void);
+
+void ring_init(struct ring *r);
+
+/* Neither side may use r any more. */
+void ring_release(struct ring *r, struct ring_pool *pool);
+
+/* Producer. Copy in as much of data as fits and return how much that was. */
+size_t ring_put(struct ring *r, struct ring_pool *pool, const void *data, size_t count);
+
+/* Consumer. Point *data at the oldest bytes in the ring and return how
+   many of them are contiguous there, or 0 if the ring is empty. */
+size_t ring_peek(struct ring *r, const void **data);
+
+/* Consumer. Drop count bytes that ring_peek() returned. */
+void ring_consume(struct ring *r, size_t count);
+
+/* Either side. The answer may be out of date as soon as it is returned,
+   except that the producer knows the ring cannot get fuller behind its
+   back and the consumer knows it cannot get emptier. */
+size_t ring_fill(struct ring *r);
+
+#endif /* _DECK_RING_H */
@@ -0,0 +1,869 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "screen.h"
+
+#define ATTR_BOLD	0x01
+#define ATTR_DIM	0x02
+#define ATTR_ITALIC	0x04
+#define ATTR_UNDERLINE	0x08
+#define ATTR_BLINK	0x10
+#define ATTR_REVERSE	0x20
+#define ATTR_HIDDEN	0x40
+#define ATTR_STRIKE	0x80
+
+#define MAX_PARAMS 16
+
+/* Also serves as the pen, with ch unused. Colours are 0 for the
+   default or 1 + the palette index. */
+struct cell {
+	uint32_t ch;
+	uint16_t fg;
+	uint16_t bg;
+	uint8_t attrs;
+};
+
+enum parse_state {
+	GROUND,
+	ESCAPE,
+	ESCAPE_INTERMEDIATE,
+	CSI,
+	STRING,		/* OSC, DCS and the like, all skipped */
+	STRING_ESCAPE,
+};
+
+struct screen {
+	int cols;
+	int rows;
+	struct cell *grid;
+	/* The main screen while the alternate one is shown, and the other
+	   way round. */
+	struct cell *other;
+	int alternate;
+
+	int x, y;
+	/* Something was written in the last column, and the next character
+	   goes on the next line. */
+	int wrap_pending;
+	struct cell pen;
+	int top, bottom;	/* scrolling region, inclusive */
+	int autowrap;
+	int cursor_hidden;
+	int saved_x, saved_y;
+	struct cell saved_pen;
+
+	enum parse_state state;
+	int params[MAX_PARAMS];
+	int nparams;
+	char private;
+	uint32_t utf8_ch;
+	int utf8_left;
+
+	/* For each row, the first and last columns changed since the last
+	   rendering, first > last if none. */
+	int *dirty_first;
+	int *dirty_last;
+	int damaged;
+	/* The next rendering must start from scratch. */
+	int full;
+	/* Modes as last rendered, which the terminal might not have seen
+	   if output was skipped since. */
+	int sent_alternate;
+	int sent_top, sent_bottom;
+	int sent_autowrap;
+	int sent_cursor_hidden;
+
+	char *out;
+	size_t out_len;
+	size_t out_size;
+};
+
+struct screen *
+screen_new(int cols, int rows)
+{
+	struct screen *s;
+	size_t ncells, i;
+	int y;
+
+	if ((cols < 1) || (rows < 1) || (cols > 1024) || (rows > 1024)) {
+		return NULL;
+	}
+	s = malloc(sizeof(*s));
+	if (!s) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	ncells = (size_t)cols * rows;
+	s->cols = cols;
+	s->rows = rows;
+	s->grid = malloc(ncells * sizeof(struct cell));
+	s->other = malloc(ncells * sizeof(struct cell));
+	s->dirty_first = malloc(rows * sizeof(int));
+	s->dirty_last = malloc(rows * sizeof(int));
+	if ((!(s->grid)) || (!(s->other)) || (!(s->dirty_first)) || (!(s->dirty_last))) {
+		screen_free(s);
+		return NULL;
+	}
+	s->bottom = rows - 1;
+	s->autowrap = 1;
+	s->sent_bottom = rows - 1;
+	s->sent_autowrap = 1;
+	s->pen.ch = ' ';
+	for (i = 0; i < ncells; i++) {
+		s->grid[i] = s->pen;
+		s->other[i] = s->pen;
+	}
+	for (y = 0; y < rows; y++) {
+		s->dirty_first[y] = cols;
+		s->dirty_last[y] = -1;
+	}
+	return s;
+}
+
+void
+screen_free(struct screen *s)
+{
+	free(s->grid);
+	free(s->other);
+	free(s->dirty_first);
+	free(s->dirty_last);
+	free(s->out);
+	free(s);
+}
+
+static void
+damage(struct screen *s, int y, int first, int last)
+{
+	if (first < s->dirty_first[y]) s->dirty_first[y] = first;
+	if (last > s->dirty_last[y]) s->dirty_last[y] = last;
+	s->damaged = 1;
+}
+
+static void
+damage_rows(struct screen *s, int first, int last)
+{
+	int y;
+
+	for (y = first; y <= last; y++) {
+		damage(s, y, 0, s->cols - 1);
+	}
+}
+
+void
+screen_damage_all(struct screen *s)
+{
+	damage_rows(s, 0, s->rows - 1);
+	s->full = 1;
+}
+
+int
+screen_damaged(struct screen *s)
+{
+	return s->damaged;
+}
+
+/* What erased cells look like: blank, in the current background. */
+static struct cell
+blank(struct screen *s)
+{
+	struct cell c;
+
+	memset(&c, 0, sizeof(c));
+	c.ch = ' ';
+	c.bg = s->pen.bg;
+	return c;
+}
+
+static struct cell *
+row(struct screen *s, int y)
+{
+	return &(s->grid[(size_t)y * s->cols]);
+}
+
+static void
+erase(struct screen *s, int y, int first, int last)
+{
+	struct cell b = blank(s);
+	struct cell *r = row(s, y);
+	int x;
+
+	if (first < 0) first = 0;
+	if (last >= s->cols) last = s->cols - 1;
+	for (x = first; x <= last; x++) {
+		r[x] = b;
+	}
+	if (first <= last) {
+		damage(s, y, first, last);
+	}
+}
+
+static void
+move_to(struct screen *s, int x, int y)
+{
+	if (x < 0) x = 0;
+	if (x >= s->cols) x = s->cols - 1;
+	if (y < 0) y = 0;
+	if (y >= s->rows) y = s->rows - 1;
+	s->x = x;
+	s->y = y;
+	s->wrap_pending = 0;
+	s->damaged = 1;
+}
+
+/* Move rows first..last up by n, leaving blank ones at the bottom. */
+static void
+scroll_up(struct screen *s, int first, int last, int n)
+{
+	int y;
+
+	if (n > last - first + 1) n = last - first + 1;
+	if (n <= 0) return;
+	memmove(row(s, first), row(s, first + n),
+		(size_t)(last - first + 1 - n) * s->cols * sizeof(struct cell));
+	for (y = last - n + 1; y <= last; y++) {
+		erase(s, y, 0, s->cols - 1);
+	}
+	damage_rows(s, first, last);
+}
+
+static void
+scroll_down(struct screen *s, int first, int last, int n)
+{
+	int y;
+
+	if (n > last - first + 1) n = last - first + 1;
+	if (n <= 0) return;
+	memmove(row(s, first + n), row(s, first),
+		(size_t)(last - first + 1 - n) * s->cols * sizeof(struct cell));
+	for (y = first; y < first + n; y++) {
+		erase(s, y, 0, s->cols - 1);
+	}
+	damage_rows(s, first, last);
+}
+
+static void
+line_feed(struct screen *s)
+{
+	if (s->y == s->bottom) {
+		scroll_up(s, s->top, s->bottom, 1);
+	} else if (s->y < s->rows - 1) {
+		s->y++;
+	}
+	s->wrap_pending = 0;
+	s->damaged = 1;
+}
+
+static void
+reverse_index(struct screen *s)
+{
+	if (s->y == s->top) {
+		scroll_down(s, s->top, s->bottom, 1);
+	} else if (s->y > 0) {
+		s->y--;
+	}
+	s->wrap_pending = 0;
+	s->damaged = 1;
+}
+
+static void
+put_char(struct screen *s, uint32_t ch)
+{
+	struct cell c = s->pen;
+
+	if (s->wrap_pending) {
+		s->x = 0;
+		line_feed(s);
+	}
+	c.ch = ch;
+	row(s, s->y)[s->x] = c;
+	damage(s, s->y, s->x, s->x);
+	if (s->x == s->cols - 1) {
+		s->wrap_pending = s->autowrap;
+	} else {
+		s->x++;
+	}
+}
+
+static void
+clear_grid(struct screen *s)
+{
+	int y;
+
+	for (y = 0; y < s->rows; y++) {
+		erase(s, y, 0, s->cols - 1);
+	}
+}
+
+static void
+set_alternate(struct screen *s, int on, int mode)
+{
+	struct cell *t;
+
+	if (on == s->alternate) {
+		return;
+	}
+	if (on && (mode == 1049)) {
+		s->saved_x = s->x;
+		s->saved_y = s->y;
+		s->saved_pen = s->pen;
+	}
+	t = s->grid;
+	s->grid = s->other;
+	s->other = t;
+	s->alternate = on;
+	if (on && (mode != 47)) {
+		clear_grid(s);
+	}
+	if ((!on) && (mode == 1049)) {
+		s->pen = s->saved_pen;
+		move_to(s, s->saved_x, s->saved_y);
+	}
+	damage_rows(s, 0, s->rows - 1);
+}
+
+static void
+reset(struct screen *s)
+{
+	set_alternate(s, 0, 47);
+	memset(&(s->pen), 0, sizeof(s->pen));
+	s->pen.ch = ' ';
+	s->top = 0;
+	s->bottom = s->rows - 1;
+	s->autowrap = 1;
+	s->cursor_hidden = 0;
+	clear_grid(s);
+	move_to(s, 0, 0);
+}
+
+static int
+param(struct screen *s, int i, int dflt)
+{
+	if ((i >= s->nparams) || (s->params[i] == 0)) {
+		return dflt;
+	}
+	return s->params[i];
+}
+
+/* A colour given as 5;n after 38 or 48, at params[*i]. */
+static uint16_t
+extended_colour(struct screen *s, int *i, uint16_t old)
+{
+	if ((*i + 1 < s->nparams) && (s->params[*i + 1] == 5)) {
+		*i += 2;
+		if ((*i < s->nparams) && (s->params[*i] < 256)) {
+			return s->params[*i] + 1;
+		}
+		return old;
+	}
+	if ((*i + 1 < s->nparams) && (s->params[*i + 1] == 2)) {
+		/* Direct colour is not kept. Skip r;g;b. */
+		*i += 4;
+		return 0;
+	}
+	return old;
+}
+
+static void
+set_graphics(struct screen *s)
+{
+	struct cell *p = &(s->pen);
+	int i, n;
+
+	if (s->nparams == 0) {
+		s->nparams = 1;
+		s->params[0] = 0;
+	}
+	for (i = 0; i < s->nparams; i++) {
+		n = s->params[i];
+		switch (n) {
+		case 0:
+			p->attrs = 0;
+			p->fg = 0;
+			p->bg = 0;
+			break;
+		case 1: p->attrs |= ATTR_BOLD; break;
+		case 2: p->attrs |= ATTR_DIM; break;
+		case 3: p->attrs |= ATTR_ITALIC; break;
+		case 4: p->attrs |= ATTR_UNDERLINE; break;
+		case 5: p->attrs |= ATTR_BLINK; break;
+		case 7: p->attrs |= ATTR_REVERSE; break;
+		case 8: p->attrs |= ATTR_HIDDEN; break;
+		case 9: p->attrs |= ATTR_STRIKE; break;
+		case 22: p->attrs &= ~(ATTR_BOLD | ATTR_DIM); break;
+		case 23: p->attrs &= ~ATTR_ITALIC; break;
+		case 24: p->attrs &= ~ATTR_UNDERLINE; break;
+		case 25: p->attrs &= ~ATTR_BLINK; break;
+		case 27: p->attrs &= ~ATTR_REVERSE; break;
+		case 28: p->attrs &= ~ATTR_HIDDEN; break;
+		case 29: p->attrs &= ~ATTR_STRIKE; break;
+		case 38: p->fg = extended_colour(s, &i, p->fg); break;
+		case 39: p->fg = 0; break;
+		case 48: p->bg = extended_colour(s, &i, p->bg); break;
+		case 49: p->bg = 0; break;
+		default:
+			if ((n >= 30) && (n <= 37)) p->fg = n - 30 + 1;
+			else if ((n >= 40) && (n <= 47)) p->bg = n - 40 + 1;
+			else if ((n >= 90) && (n <= 97)) p->fg = n - 90 + 8 + 1;
+			else if ((n >= 100) && (n <= 107)) p->bg = n - 100 + 8 + 1;
+			break;
+		}
+	}
+}
+
+static void
+set_mode(struct screen *s, int on)
+{
+	int i;
+
+	if (s->private != '?') {
+		return;
+	}
+	for (i = 0; i < s->nparams; i++) {
+		switch (s->params[i]) {
+		case 7:
+			s->autowrap = on;
+			break;
+		case 25:
+			s->cursor_hidden = !on;
+			s->damaged = 1;
+			break;
+		case 47:
+		case 1047:
+		case 1049:
+			set_alternate(s, on, s->params[i]);
+			break;
+		}
+	}
+}
+
+static void
+csi_dispatch(struct screen *s, unsigned char final)
+{
+	struct cell *r = row(s, s->y);
+	int n = param(s, 0, 1);
+	int i;
+
+	if (s->private && (final != 'h') && (final != 'l')) {
+		return;
+	}
+	switch (final) {
+	case '@':	/* ICH */
+		if (n > s->cols - s->x) n = s->cols - s->x;
+		memmove(&(r[s->x + n]), &(r[s->x]), (s->cols - s->x - n) * sizeof(struct cell));
+		erase(s, s->y, s->x, s->x + n - 1);
+		damage(s, s->y, s->x, s->cols - 1);
+		break;
+	case 'A': move_to(s, s->x, s->y - n); break;
+	case 'B': move_to(s, s->x, s->y + n); break;
+	case 'C': move_to(s, s->x + n, s->y); break;
+	case 'D': move_to(s, s->x - n, s->y); break;
+	case 'E': move_to(s, 0, s->y + n); break;
+	case 'F': move_to(s, 0, s->y - n); break;
+	case 'G': move_to(s, n - 1, s->y); break;
+	case 'd': move_to(s, s->x, n - 1); break;
+	case 'H':
+	case 'f':
+		move_to(s, param(s, 1, 1) - 1, n - 1);
+		break;
+	case 'J':
+		switch (param(s, 0, 0)) {
+		case 0:
+			erase(s, s->y, s->x, s->cols - 1);
+			for (i = s->y + 1; i < s->rows; i++) erase(s, i, 0, s->cols - 1);
+			break;
+		case 1:
+			for (i = 0; i < s->y; i++) erase(s, i, 0, s->cols - 1);
+			erase(s, s->y, 0, s->x);
+			break;
+		default:
+			clear_grid(s);
+			break;
+		}
+		break;
+	case 'K':
+		switch (param(s, 0, 0)) {
+		case 0: erase(s, s->y, s->x, s->cols - 1); break;
+		case 1: erase(s, s->y, 0, s->x); break;
+		default: erase(s, s->y, 0, s->cols - 1); break;
+		}
+		break;
+	case 'L':
+		if ((s->y >= s->top) && (s->y <= s->bottom)) {
+			scroll_down(s, s->y, s->bottom, n);
+		}
+		break;
+	case 'M':
+		if ((s->y >= s->top) && (s->y <= s->bottom)) {
+			scroll_up(s, s->y, s->bottom, n);
+		}
+		break;
+	case 'P':	/* DCH */
+		if (n > s->cols - s->x) n = s->cols - s->x;
+		memmove(&(r[s->x]), &(r[s->x + n]), (s->cols - s->x - n) * sizeof(struct cell));
+		erase(s, s->y, s->cols - n, s->cols - 1);
+		damage(s, s->y, s->x, s->cols - 1);
+		break;
+	case 'S': scroll_up(s, s->top, s->bottom, n); break;
+	case 'T': scroll_down(s, s->top, s->bottom, n); break;
+	case 'X': erase(s, s->y, s->x, s->x + n - 1); break;
+	case 'm': set_graphics(s); break;
+	case 'h': set_mode(s, 1); break;
+	case 'l': set_mode(s, 0); break;
+	case 'r':
+		i = param(s, 1, s->rows);
+		if (i > s->rows) i = s->rows;
+		if (param(s, 0, 1) < i) {
+			s->top = param(s, 0, 1) - 1;
+			s->bottom = i - 1;
+			move_to(s, 0, 0);
+		}
+		break;
+	case 's':
+		s->saved_x = s->x;
+		s->saved_y = s->y;
+		s->saved_pen = s->pen;
+		break;
+	case 'u':
+		s->pen = s->saved_pen;
+		move_to(s, s->saved_x, s->saved_y);
+		break;
+	}
+}
+
+static void
+esc_dispatch(struct screen *s, unsigned char final)
+{
+	switch (final) {
+	case '7':
+		s->saved_x = s->x;
+		s->saved_y = s->y;
+		s->saved_pen = s->pen;
+		break;
+	case '8':
+		s->pen = s->saved_pen;
+		move_to(s, s->saved_x, s->saved_y);
+		break;
+	case 'D': line_feed(s); break;
+	case 'E': s->x = 0; line_feed(s); break;
+	case 'M': reverse_index(s); break;
+	case 'c': reset(s); break;
+	}
+}
+
+/* C0 controls, which take effect even in the middle of a sequence. */
+static void
+execute(struct screen *s, unsigned char b)
+{
+	switch (b) {
+	case '\b':
+		move_to(s, s->x - 1, s->y);
+		break;
+	case '\t':
+		move_to(s, (s->x | 7) + 1, s->y);
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		line_feed(s);
+		break;
+	case '\r':
+		move_to(s, 0, s->y);
+		break;
+	}
+}
+
+static void
+feed_byte(struct screen *s, unsigned char b)
+{
+	if ((s->state == STRING) || (s->state == STRING_ESCAPE)) {
+		if (b == 0x07) {
+			s->state = GROUND;
+		} else if ((b == 0x18) || (b == 0x1a)) {
+			s->state = GROUND;
+		} else if (b == 0x1b) {
+			s->state = STRING_ESCAPE;
+		} else if (s->state == STRING_ESCAPE) {
+			/* ESC \ ends it, and anything else starts a new
+			   sequence, which also ends it. */
+			s->state = GROUND;
+			if (b != '\\') {
+				s->state = ESCAPE;
+				feed_byte(s, b);
+			}
+		}
+		return;
+	}
+	if (b == 0x1b) {
+		s->state = ESCAPE;
+		s->utf8_left = 0;
+		return;
+	}
+	if ((b == 0x18) || (b == 0x1a)) {
+		s->state = GROUND;
+		return;
+	}
+	if (b < 0x20) {
+		execute(s, b);
+		return;
+	}
+
+	switch (s->state) {
+	case GROUND:
+		if (s->utf8_left) {
+			if ((b & 0xc0) == 0x80) {
+				s->utf8_ch = (s->utf8_ch << 6) | (b & 0x3f);
+				if (--(s->utf8_left) == 0) {
+					put_char(s, s->utf8_ch);
+				}
+				return;
+			}
+			s->utf8_left = 0;
+			put_char(s, 0xfffd);
+		}
+		if (b < 0x7f) {
+			put_char(s, b);
+		} else if ((b >= 0xc2) && (b <= 0xdf)) {
+			s->utf8_ch = b & 0x1f;
+			s->utf8_left = 1;
+		} else if ((b >= 0xe0) && (b <= 0xef)) {
+			s->utf8_ch = b & 0x0f;
+			s->utf8_left = 2;
+		} else if ((b >= 0xf0) && (b <= 0xf4)) {
+			s->utf8_ch = b & 0x07;
+			s->utf8_left = 3;
+		} else if (b > 0x7f) {
+			put_char(s, 0xfffd);
+		}
+		break;
+	case ESCAPE:
+		if (b == '[') {
+			s->state = CSI;
+			s->nparams = 0;
+			s->private = 0;
+			memset(s->params, 0, sizeof(s->params));
+		} else if ((b == ']') || (b == 'P') || (b == '_') || (b == '^') || (b == 'X')) {
+			s->state = STRING;
+		} else if (b < 0x30) {
+			s->state = ESCAPE_INTERMEDIATE;
+		} else {
+			s->state = GROUND;
+			esc_dispatch(s, b);
+		}
+		break;
+	case ESCAPE_INTERMEDIATE:
+		/* Character set designations and such */
+		if (b >= 0x30) {
+			s->state = GROUND;
+		}
+		break;
+	case CSI:
+		if ((b >= '0') && (b <= '9')) {
+			if (s->nparams == 0) s->nparams = 1;
+			if ((s->nparams <= MAX_PARAMS) && (s->params[s->nparams - 1] < 10000)) {
+				s->params[s->nparams - 1] = s->params[s->nparams - 1] * 10 + (b - '0');
+			}
+		} else if ((b == ';') || (b == ':')) {
+			if (s->nparams == 0) s->nparams = 1;
+			if (s->nparams < MAX_PARAMS) s->nparams++;
+		} else if ((b >= '<') && (b <= '?')) {
+			s->private = b;
+		} else if ((b >= 0x40) && (b <= 0x7e)) {
+			s->state = GROUND;
+			csi_dispatch(s, b);
+		} else if (b >= 0x7f) {
+			s->state = GROUND;
+		}
+		/* Intermediates, 0x20 to 0x2f, are just passed over. */
+		break;
+	default:
+		s->state = GROUND;
+		break;
+	}
+}
+
+void
+screen_feed(struct screen *s, const void *data, size_t count)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		feed_byte(s, p[i]);
+	}
+}
+
+static int
+reserve(struct screen *s, size_t n)
+{
+	size_t size;
+	char *out;
+
+	if (s->out_len + n <= s->out_size) {
+		return 0;
+	}
+	size = s->out_size ? s->out_size : 4096;
+	while (size < s->out_len + n) size *= 2;
+	out = realloc(s->out, size);
+	if (!out) {
+		return -1;
+	}
+	s->out = out;
+	s->out_size = size;
+	return 0;
+}
+
+/* Append at most 64 bytes of formatted output. */
+static void
+emit(struct screen *s, const char *fmt, int a, int b)
+{
+	int n;
+
+	if (reserve(s, 64) < 0) {
+		return;
+	}
+	n = snprintf(s->out + s->out_len, 64, fmt, a, b);
+	if ((n > 0) && (n < 64)) {
+		s->out_len += n;
+	}
+}
+
+static void
+emit_colour(struct screen *s, uint16_t colour, int base)
+{
+	int i = colour - 1;
+
+	if (i < 8) {
+		emit(s, ";%d", base + i, 0);
+	} else if (i < 16) {
+		emit(s, ";%d", base + 60 + i - 8, 0);
+	} else {
+		emit(s, ";%d;5;%d", base + 8, i);
+	}
+}
+
+static void
+emit_pen(struct screen *s, const struct cell *c)
+{
+	static const int codes[8] = { 1, 2, 3, 4, 5, 7, 8, 9 };
+	int i;
+
+	emit(s, "\033[0", 0, 0);
+	for (i = 0; i < 8; i++) {
+		if (c->attrs & (1 << i)) {
+			emit(s, ";%d", codes[i], 0);
+		}
+	}
+	if (c->fg) emit_colour(s, c->fg, 30);
+	if (c->bg) emit_colour(s, c->bg, 40);
+	emit(s, "m", 0, 0);
+}
+
+static int
+same_pen(const struct cell *a, const struct cell *b)
+{
+	return (a->fg == b->fg) && (a->bg == b->bg) && (a->attrs == b->attrs);
+}
+
+static void
+emit_char(struct screen *s, uint32_t ch)
+{
+	char *p;
+
+	if (reserve(s, 4) < 0) {
+		return;
+	}
+	p = s->out + s->out_len;
+	if (ch < 0x80) {
+		p[0] = ch;
+		s->out_len += 1;
+	} else if (ch < 0x800) {
+		p[0] = 0xc0 | (ch >> 6);
+		p[1] = 0x80 | (ch & 0x3f);
+		s->out_len += 2;
+	} else if (ch < 0x10000) {
+		p[0] = 0xe0 | (ch >> 12);
+		p[1] = 0x80 | ((ch >> 6) & 0x3f);
+		p[2] = 0x80 | (ch & 0x3f);
+		s->out_len += 3;
+	} else {
+		p[0] = 0xf0 | (ch >> 18);
+		p[1] = 0x80 | ((ch >> 12) & 0x3f);
+		p[2] = 0x80 | ((ch >> 6) & 0x3f);
+		p[3] = 0x80 | (ch & 0x3f);
+		s->out_len += 4;
+	}
+}
+
+const char *
+screen_render(struct screen *s, size_t *len)
+{
+	struct cell pen;
+	struct cell *r;
+	int have_pen = 0;
+	int x, y;
+
+	s->out_len = 0;
+	if (s->full) {
+		/* Cancel whatever sequence the terminal was left in the
+		   middle of when output was cut off. */
+		emit(s, "\030", 0, 0);
+	}
+	if (s->full || (s->alternate != s->sent_alternate)) {
+		emit(s, "\033[?1049%c", s->alternate ? 'h' : 'l', 0);
+	}
+	if (s->full || (s->top != s->sent_top) || (s->bottom != s->sent_bottom)) {
+		emit(s, "\033[%d;%dr", s->top + 1, s->bottom + 1);
+	}
+	if (s->full || (s->autowrap != s->sent_autowrap)) {
+		emit(s, "\033[?7%c", s->autowrap ? 'h' : 'l', 0);
+	}
+	if (s->full || (s->cursor_hidden != s->sent_cursor_hidden)) {
+		emit(s, "\033[?25%c", s->cursor_hidden ? 'l' : 'h', 0);
+	}
+	for (y = 0; y < s->rows; y++) {
+		if (s->dirty_first[y] > s->dirty_last[y]) {
+			continue;
+		}
+		r = row(s, y);
+		emit(s, "\033[%d;%dH", y + 1, s->dirty_first[y] + 1);
+		for (x = s->dirty_first[y]; x <= s->dirty_last[y]; x++) {
+			if ((!have_pen) || (!same_pen(&pen, &(r[x])))) {
+				pen = r[x];
+				have_pen = 1;
+				emit_pen(s, &pen);
+			}
+			emit_char(s, r[x].ch);
+		}
+		s->dirty_first[y] = s->cols;
+		s->dirty_last[y] = -1;
+	}
+	if (s->wrap_pending) {
+		/* The next character is to go on the next line. Moving the
+		   cursor would lose that, so write the last cell over again
+		   to leave the terminal in the same state. */
+		r = row(s, s->y);
+		emit(s, "\033[%d;%dH", s->y + 1, s->cols);
+		if ((!have_pen) || (!same_pen(&pen, &(r[s->cols - 1])))) {
+			pen = r[s->cols - 1];
+			have_pen = 1;
+			emit_pen(s, &pen);
+		}
+		emit_char(s, r[s->cols - 1].ch);
+	} else {
+		emit(s, "\033[%d;%dH", s->y + 1, s->x + 1);
+	}
+	if ((!have_pen) || (!same_pen(&pen, &(s->pen)))) {
+		emit_pen(s, &(s->pen));
+	}
+
+	s->sent_alternate = s->alternate;
+	s->sent_top = s->top;
+	s->sent_bottom = s->bottom;
+	s->sent_autowrap = s->autowrap;
+	s->sent_cursor_hidden = s->cursor_hidden;
+	s->damaged = 0;
+	s->full = 0;
+	*len = s->out_len;
+	return s->out;
+}
@@ -0,0 +1,40 @@
+#ifndef _DECK_SCREEN_H
+#define _DECK_SCREEN_H
+
+/* A model of what a card's output has drawn on a terminal: the grid of
+   characters with their attributes, the cursor and the pen, kept by
+   following the usual VT100/xterm control sequences. It remembers which
+   cells have changed since it was last rendered, and can render those
+   as a stream of control sequences which brings a terminal that showed
+   the previous rendering (or the raw output up to then) up to date.
+
+   That lets a card which produces output faster than the tty can take
+   it send only what has changed, now and again, instead of every byte.
+
+   Only as much of the terminal is modelled as affects what is on the
+   screen. Characters all take one cell, and colours are the 256 indexed
+   ones. Sequences it does not know are skipped. */
+
+#include <stddef.h>
+
+struct screen;
+
+struct screen *screen_new(int cols, int rows);
+void screen_free(struct screen *);
+
+/* Interpret more output. */
+void screen_feed(struct screen *, const void *data, size_t count);
+
+/* Whether anything has changed since the last rendering. */
+int screen_damaged(struct screen *);
+
+/* Forget what the terminal was last sent, so the next rendering is
+   all of it, and starts by cancelling any control sequence the
+   terminal might be in the middle of. */
+void screen_damage_all(struct screen *);
+
+/* Render what has changed, and count it as sent. The result is in a
+   buffer owned by the screen which stays valid until the next call. */
+const char *screen_render(struct screen *, size_t *len);
+
+#endif /* _DECK_SCREEN_H */
@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "scrollback.h"
+
+/* The spill file is made longer this many segments at a time. */
+#define SPILL_GROW_SLOTS 64
+
+struct sb_segment {
+	/* In the card's list, from oldest to newest */
+	struct sb_segment *next;
+	/* In one of the store's queues, oldest first */
+	struct sb_segment *older;
+	struct sb_segment *newer;
+	struct scrollback *owner;
+
+	unsigned long long start;
+	/* Only the appender writes to the segment, and only below SIZE
+	   and above fill, so readers can use anything below fill. */
+	atomic_size_t fill;
+	/* malloc'd, or mapped from the spill file if slot >= 0. Only
+	   changed while refs == 0, and both protected by owner->lock. */
+	unsigned char *data;
+	long slot;
+	int refs;
+};
+
+struct sb_queue {
+	struct sb_segment *oldest;
+	struct sb_segment *newest;
+};
+
+struct scrollback_store {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+
+	size_t memory_budget;
+	size_t memory_used;
+	/* Full segments still in memory */
+	struct sb_queue in_memory;
+	/* Segments in the spill file */
+	struct sb_queue on_disk;
+
+	int fd;
+	long max_slots;
+	long nslots;
+	/* How many slots the file is long enough for. Only the spill
+	   thread uses this, without the lock. */
+	long file_slots;
+	long *free_slots;
+	long nfree_slots;
+	/* Set once the spill file could not be made or grown. From then
+	   on the oldest output is dropped instead. */
+	int no_spill;
+	/* Bytes of output forgotten to stay within the budgets */
+	unsigned long long dropped;
+
+	/* The segment the spill thread is writing out, if any, and
+	   whether its card has gone and left it to the spill thread to
+	   free. */
+	struct sb_segment *busy;
+	int busy_orphaned;
+};
+
+/* Must hold store lock for these two. */
+
+static void
+queue_push(struct sb_queue *q, struct sb_segment *seg)
+{
+	seg->newer = NULL;
+	seg->older = q->newest;
+	if (q->newest) {
+		q->newest->newer = seg;
+	} else {
+		q->oldest = seg;
+	}
+	q->newest = seg;
+}
+
+static void
+queue_remove(struct sb_queue *q, struct sb_segment *seg)
+{
+	if (seg->older) {
+		seg->older->newer = seg->newer;
+	} else {
+		q->oldest = seg->newer;
+	}
+	if (seg->newer) {
+		seg->newer->older = seg->older;
+	} else {
+		q->newest = seg->older;
+	}
+	seg->older = seg->newer = NULL;
+}
+
+/* Must hold store lock. Returns -1 if there is nowhere to put a segment.
+   A new slot may be beyond the end of the file, see grow_spill_file(). */
+static long
+get_slot(struct scrollback_store *store)
+{
+	struct sb_segment *victim;
+	struct scrollback *owner;
+	long slot;
+
+	if (store->nfree_slots > 0) {
+		return store->free_slots[--(store->nfree_slots)];
+	}
+	victim = store->on_disk.oldest;
+	if ((store->nslots >= store->max_slots) && victim) {
+		/* Forget the oldest output there is to make room. It has to
+		   be the oldest of its card too, and not being read. */
+		owner = victim->owner;
+		pthread_mutex_lock(&(owner->lock));
+		if ((victim->refs == 0) && (owner->oldest == victim) && (owner->newest != victim)) {
+			owner->oldest = victim->next;
+			pthread_mutex_unlock(&(owner->lock));
+			queue_remove(&(store->on_disk), victim);
+			munmap(victim->data, SCROLLBACK_SEGMENT_SIZE);
+			slot = victim->slot;
+			free(victim);
+			store->dropped += SCROLLBACK_SEGMENT_SIZE;
+			return slot;
+		}
+		pthread_mutex_unlock(&(owner->lock));
+		/* Go over budget rather than wait. */
+	}
+	return store->nslots++;
+}
+
+/* Make the spill file long enough for slot. Called without any lock,
+   so that appends never wait for the filesystem. */
+static int
+grow_spill_file(struct scrollback_store *store, long slot)
+{
+	long want;
+
+	if (slot < store->file_slots) {
+		return 0;
+	}
+	want = store->file_slots + SPILL_GROW_SLOTS;
+	if (want > store->max_slots) want = store->max_slots;
+	if (want <= slot) want = slot + 1;
+	if (ftruncate(store->fd, (off_t)want * SCROLLBACK_SEGMENT_SIZE) < 0) {
+		perror("scrollback: grow spill file");
+		return -1;
+	}
+	store->file_slots = want;
+	return 0;
+}
+
+/* Must hold store lock */
+static void
+put_slot(struct scrollback_store *store, long slot)
+{
+	long *slots;
+
+	if ((store->nfree_slots % 64) == 0) {
+		slots = realloc(store->free_slots, (store->nfree_slots + 64) * sizeof(long));
+		if (!slots) {
+			/* Lose it. */
+			return;
+		}
+		store->free_slots = slots;
+	}
+	store->free_slots[store->nfree_slots++] = slot;
+}
+
+/* Must hold store lock. Forget the oldest segment in memory that can go,
+   which must be the oldest its card has left and not being read, along
+   with anything older its card has on disk. Returns -1 if there was
+   nothing to forget. */
+static int
+drop_oldest(struct scrollback_store *store)
+{
+	struct sb_segment *seg, *old;
+	struct scrollback *owner;
+
+	for (seg = store->in_memory.oldest; seg; seg = seg->newer) {
+		owner = seg->owner;
+		pthread_mutex_lock(&(owner->lock));
+		while (((old = owner->oldest) != seg) && (old->slot >= 0) && (old->refs == 0)) {
+			owner->oldest = old->next;
+			queue_remove(&(store->on_disk), old);
+			munmap(old->data, SCROLLBACK_SEGMENT_SIZE);
+			put_slot(store, old->slot);
+			free(old);
+			store->dropped += SCROLLBACK_SEGMENT_SIZE;
+		}
+		if ((owner->oldest == seg) && (seg->refs == 0) && (owner->newest != seg)) {
+			owner->oldest = seg->next;
+			pthread_mutex_unlock(&(owner->lock));
+			queue_remove(&(store->in_memory), seg);
+			free(seg->data);
+			free(seg);
+			store->memory_used -= SCROLLBACK_SEGMENT_SIZE;
+			store->dropped += SCROLLBACK_SEGMENT_SIZE;
+			return 0;
+		}
+		pthread_mutex_unlock(&(owner->lock));
+	}
+	return -1;
+}
+
+/* Must hold store lock. Give readers and the appender a moment. */
+static void
+wait_a_bit(struct scrollback_store *store)
+{
+	struct timespec retry;
+
+	clock_gettime(CLOCK_REALTIME, &retry);
+	retry.tv_nsec += 10*1000*1000;
+	if (retry.tv_nsec >= 1000000000) {
+		retry.tv_nsec -= 1000000000;
+		retry.tv_sec++;
+	}
+	pthread_cond_timedwait(&(store->cv), &(store->lock), &retry);
+}
+
+static int
+open_spill_file(struct scrollback_store *store)
+{
+	char name[] = "/tmp/carddeck-scrollback.XXXXXX";
+
+	store->fd = mkstemp(name);
+	if (store->fd < 0) {
+		perror("scrollback: mkstemp");
+		return -1;
+	}
+	unlink(name);
+	return 0;
+}
+
+/* Write seg out to slot and map it back in. Called without any lock:
+   nobody writes to a full segment and nobody else moves its data. */
+static unsigned char *
+spill(struct scrollback_store *store, struct sb_segment *seg, long slot)
+{
+	off_t off = (off_t)slot * SCROLLBACK_SEGMENT_SIZE;
+	size_t done = 0;
+	ssize_t n;
+	void *map;
+
+	while (done < SCROLLBACK_SEGMENT_SIZE) {
+		n = pwrite(store->fd, seg->data + done, SCROLLBACK_SEGMENT_SIZE - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("scrollback: write spill file");
+			return NULL;
+		}
+		done += n;
+	}
+	map = mmap(NULL, SCROLLBACK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, store->fd, off);
+	if (map == MAP_FAILED) {
+		perror("scrollback: mmap");
+		return NULL;
+	}
+	return map;
+}
+
+static void *
+spill_thread(void *arg)
+{
+	struct scrollback_store *store = (struct scrollback_store *)arg;
+	struct sb_segment *seg;
+	struct scrollback *owner;
+	unsigned char *map, *old;
+	long slot;
+	int no_room;
+
+	pthread_mutex_lock(&(store->lock));
+	for (;;) {
+		seg = store->in_memory.oldest;
+		if ((store->memory_used <= store->memory_budget) || (!seg)) {
+			pthread_cond_wait(&(store->cv), &(store->lock));
+			continue;
+		}
+		if ((store->fd < 0) && (!(store->no_spill)) && (open_spill_file(store) < 0)) {
+			store->no_spill = 1;
+		}
+		slot = store->no_spill ? -1 : get_slot(store);
+		if (slot < 0) {
+			/* Nowhere to put it, so make room in memory instead. */
+			if (drop_oldest(store) < 0) {
+				wait_a_bit(store);
+			}
+			continue;
+		}
+		queue_remove(&(store->in_memory), seg);
+		store->busy = seg;
+		pthread_mutex_unlock(&(store->lock));
+
+		no_room = (grow_spill_file(store, slot) < 0);
+		map = no_room ? NULL : spill(store, seg, slot);
+
+		pthread_mutex_lock(&(store->lock));
+		store->busy = NULL;
+		if (store->busy_orphaned) {
+			store->busy_orphaned = 0;
+			if (map) {
+				munmap(map, SCROLLBACK_SEGMENT_SIZE);
+			}
+			put_slot(store, slot);
+			free(seg->data);
+			free(seg);
+			store->memory_used -= SCROLLBACK_SEGMENT_SIZE;
+			continue;
+		}
+		old = NULL;
+		owner = seg->owner;
+		pthread_mutex_lock(&(owner->lock));
+		if (map && (seg->refs == 0)) {
+			old = seg->data;
+			seg->data = map;
+			seg->slot = slot;
+		}
+		pthread_mutex_unlock(&(owner->lock));
+		if (old) {
+			free(old);
+			store->memory_used -= SCROLLBACK_SEGMENT_SIZE;
+			queue_push(&(store->on_disk), seg);
+			continue;
+		}
+		if (no_room) {
+			store->no_spill = 1;
+		}
+		/* Somebody was reading it, or it could not be written.
+		   Put it back where it was and try again in a bit. */
+		if (map) {
+			munmap(map, SCROLLBACK_SEGMENT_SIZE);
+		}
+		put_slot(store, slot);
+		seg->newer = store->in_memory.oldest;
+		seg->older = NULL;
+		if (seg->newer) {
+			seg->newer->older = seg;
+		} else {
+			store->in_memory.newest = seg;
+		}
+		store->in_memory.oldest = seg;
+		wait_a_bit(store);
+	}
+	return NULL;
+}
+
+struct scrollback_store *
+scrollback_store_new(size_t memory_budget, size_t disk_budget)
+{
+	pthread_t thread_id;
+	pthread_attr_t thread_attr;
+	struct scrollback_store *store = malloc(sizeof(*store));
+
+	if (!store) {
+		return NULL;
+	}
+	memset(store, 0, sizeof(*store));
+	pthread_mutex_init(&(store->lock), NULL);
+	pthread_cond_init(&(store->cv), NULL);
+	store->memory_budget = memory_budget;
+	store->max_slots = disk_budget / SCROLLBACK_SEGMENT_SIZE;
+	store->fd = -1;
+
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread_id, &thread_attr, spill_thread, store) != 0) {
+		free(store);
+		return NULL;
+	}
+	return store;
+}
+
+void
+scrollback_store_get_stats(struct scrollback_store *store, struct scrollback_stats *stats)
+{
+	pthread_mutex_lock(&(store->lock));
+	stats->memory_used = store->memory_used;
+	stats->disk_used = (size_t)(store->nslots - store->nfree_slots) * SCROLLBACK_SEGMENT_SIZE;
+	stats->dropped = store->dropped;
+	pthread_mutex_unlock(&(store->lock));
+}
+
+void
+scrollback_init(struct scrollback *sb, struct scrollback_store *store)
+{
+	sb->store = store;
+	pthread_mutex_init(&(sb->lock), NULL);
+	sb->oldest = NULL;
+	sb->newest = NULL;
+}
+
+void
+scrollback_free(struct scrollback *sb)
+{
+	struct scrollback_store *store = sb->store;
+	struct sb_segment *seg;
+
+	pthread_mutex_lock(&(store->lock));
+	while ((seg = sb->oldest)) {
+		sb->oldest = seg->next;
+		if (seg == store->busy) {
+			/* Being written out. The spill thread frees it
+			   once it is done, rather than us waiting. */
+			store->busy_orphaned = 1;
+			continue;
+		}
+		if (seg->slot >= 0) {
+			queue_remove(&(store->on_disk), seg);
+			munmap(seg->data, SCROLLBACK_SEGMENT_SIZE);
+			put_slot(store, seg->slot);
+		} else {
+			if (atomic_load(&(seg->fill)) == SCROLLBACK_SEGMENT_SIZE) {
+				queue_remove(&(store->in_memory), seg);
+			}
+			free(seg->data);
+			store->memory_used -= SCROLLBACK_SEGMENT_SIZE;
+		}
+		free(seg);
+	}
+	sb->newest = NULL;
+	pthread_mutex_unlock(&(store->lock));
+	pthread_mutex_destroy(&(sb->lock));
+}
+
+static struct sb_segment *
+new_segment(struct scrollback *sb)
+{
+	struct scrollback_store *store = sb->store;
+	struct sb_segment *seg = malloc(sizeof(*seg));
+
+	if (!seg) {
+		return NULL;
+	}
+	seg->data = malloc(SCROLLBACK_SEGMENT_SIZE);
+	if (!(seg->data)) {
+		free(seg);
+		return NULL;
+	}
+	seg->next = NULL;
+	seg->older = seg->newer = NULL;
+	seg->owner = sb;
+	seg->start = sb->newest ? (sb->newest->start + SCROLLBACK_SEGMENT_SIZE) : 0;
+	atomic_init(&(seg->fill), 0);
+	seg->slot = -1;
+	seg->refs = 0;
+
+	pthread_mutex_lock(&(store->lock));
+	store->memory_used += SCROLLBACK_SEGMENT_SIZE;
+	pthread_mutex_unlock(&(store->lock));
+
+	pthread_mutex_lock(&(sb->lock));
+	if (sb->newest) {
+		sb->newest->next = seg;
+	} else {
+		sb->oldest = seg;
+	}
+	sb->newest = seg;
+	pthread_mutex_unlock(&(sb->lock));
+	return seg;
+}
+
+void
+scrollback_append(struct scrollback *sb, const void *data, size_t count)
+{
+	struct scrollback_store *store = sb->store;
+	struct sb_segment *seg;
+	size_t fill, n;
+
+	while (count > 0) {
+		seg = sb->newest;
+		if ((!seg) || (atomic_load_explicit(&(seg->fill), memory_order_relaxed) == SCROLLBACK_SEGMENT_SIZE)) {
+			seg = new_segment(sb);
+			if (!seg) {
+				return;
+			}
+		}
+		fill = atomic_load_explicit(&(seg->fill), memory_order_relaxed);
+		n = SCROLLBACK_SEGMENT_SIZE - fill;
+		if (n > count) n = count;
+		memcpy(seg->data + fill, data, n);
+		atomic_store_explicit(&(seg->fill), fill + n, memory_order_release);
+		data = (const char *)data + n;
+		count -= n;
+
+		if (fill + n == SCROLLBACK_SEGMENT_SIZE) {
+			/* Full, so it can be spilled now. */
+			pthread_mutex_lock(&(store->lock));
+			queue_push(&(store->in_memory), seg);
+			if (store->memory_used > store->memory_budget) {
+				pthread_cond_broadcast(&(store->cv));
+			}
+			pthread_mutex_unlock(&(store->lock));
+		}
+	}
+}
+
+void
+scrollback_range(struct scrollback *sb,
+	unsigned long long *start, unsigned long long *end)
+{
+	pthread_mutex_lock(&(sb->lock));
+	if (sb->oldest) {
+		*start = sb->oldest->start;
+		*end = sb->newest->start + atomic_load(&(sb->newest->fill));
+	} else {
+		*start = *end = 0;
+	}
+	pthread_mutex_unlock(&(sb->lock));
+}
+
+size_t
+scrollback_read(struct scrollback *sb, unsigned long long offset,
+	void *buf, size_t count)
+{
+	struct sb_segment *seg;
+	const unsigned char *data;
+	size_t done = 0, fill, n;
+
+	while (done < count) {
+		pthread_mutex_lock(&(sb->lock));
+		for (seg = sb->oldest; seg; seg = seg->next) {
+			if (offset < seg->start + SCROLLBACK_SEGMENT_SIZE) break;
+		}
+		if ((!seg) || (offset < seg->start)) {
+			pthread_mutex_unlock(&(sb->lock));
+			break;
+		}
+		fill = atomic_load_explicit(&(seg->fill), memory_order_acquire);
+		if (offset >= seg->start + fill) {
+			pthread_mutex_unlock(&(sb->lock));
+			break;
+		}
+		/* Copy without the lock, which could mean reading from the
+		   disk, but make sure the data stays put meanwhile. */
+		seg->refs++;
+		data = seg->data;
+		pthread_mutex_unlock(&(sb->lock));
+
+		n = seg->start + fill - offset;
+		if (n > count - done) n = count - done;
+		memcpy((char *)buf + done, data + (offset - seg->start), n);
+
+		pthread_mutex_lock(&(sb->lock));
+		seg->refs--;
+		pthread_mutex_unlock(&(sb->lock));
+		done += n;
+		offset += n;
+	}
+	return done;
+}
@@ -0,0 +1,65 @@
+#ifndef _DECK_SCROLLBACK_H
+#define _DECK_SCROLLBACK_H
+
+/* Everything each card has output, kept so that it can be read back
+   later from anywhere in it, independently of other cards.
+
+   A card's output is stored in fixed-size segments. Recent segments
+   are kept in memory. When all the cards of a cardserver together
+   have more than the memory budget, a background thread moves the
+   oldest full segments to a temporary file and maps them back in
+   from there. When that file reaches its own budget, the oldest
+   output of all is forgotten, and if there is no file to be had, the
+   oldest output in memory is forgotten instead.
+
+   Offsets are counted in bytes from the start of the card's output. */
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define SCROLLBACK_SEGMENT_SIZE 65536
+
+struct scrollback_store;
+struct sb_segment;
+
+struct scrollback {
+	struct scrollback_store *store;
+	/* Protects the list of segments, not what is in them. */
+	pthread_mutex_t lock;
+	struct sb_segment *oldest;
+	struct sb_segment *newest;
+};
+
+struct scrollback_stats {
+	size_t memory_used;
+	size_t disk_used;
+	/* Forgotten to stay within the budgets */
+	unsigned long long dropped;
+};
+
+/* Starts the background thread. */
+struct scrollback_store *scrollback_store_new(size_t memory_budget, size_t disk_budget);
+
+void scrollback_store_get_stats(struct scrollback_store *, struct scrollback_stats *);
+
+void scrollback_init(struct scrollback *sb, struct scrollback_store *store);
+
+/* Nothing else may be using sb any more. Never waits for the disk. */
+void scrollback_free(struct scrollback *sb);
+
+/* Add output at the end. Only one thread may do this. It never waits
+   for readers or for the disk. */
+void scrollback_append(struct scrollback *sb, const void *data, size_t count);
+
+/* The offsets of the oldest byte still kept and of the end. */
+void scrollback_range(struct scrollback *sb,
+	unsigned long long *start, unsigned long long *end);
+
+/* Copy out up to count bytes starting at offset. Returns how many were
+   copied, which is short only at the end of what is kept. Can be called
+   from any thread at the same time as scrollback_append(). */
+size_t scrollback_read(struct scrollback *sb, unsigned long long offset,
+	void *buf, size_t count);
+
+#endif /* _DECK_SCROLLBACK_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -5,393 +6,1099 @@
 #include <poll.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "global.h"
 #include "cardmux.h"
 #include "stub.h"
+#include "registry.h"
 #include "util.h"
 #include "renderer.h"
+#include "record.h"
 
-/* Give up the tty no matter what this amount of time after
-   writing anything to it. This will cause us to emit the
-   escape sequence for telling the other end our card is no
-   longer active. */
-const long always_give_up_anyway_nsec = 500*1000*1000;  /* 500ms */
-
-/* If we still have stuff to write and we haven't been able
-   to get it out in this amount of time, and somebody else
-   wants the tty, give it up. */
-const long short_give_up_nsec = 10*1000*1000;  /* 10ms */
-
-/* If we have written this many bytes, do offer to give up
-   the tty even if we have more to write, if we've already
-   written this much. */
-const int maybe_give_up_if_written_bytes = 50;
-
-struct cardinput {
-	struct cardinput *next;
-	void *data;
-	size_t size;
-};
+/* Give up the tty this long after last writing anything to it even
+   if nobody else wants it. This will cause us to emit the escape
+   sequence for telling the other end our card is no longer active. */
+const long idle_give_up_nsec = 500*1000*1000;  /* 500ms */
 
-/* Return the number of milliseconds of (t1+t1_offset)-(t0+t0_offset). */
-static int
-msec_until(struct timespec *t0, long t0_offset, struct timespec *t1, long t1_offset)
+/* Input up to this size is written straight to the client's socket
+   from the renderer's input thread when nothing is queued ahead of it. */
+const size_t direct_input_max = 512;
+
+/* Let the renderer's input thread go on once the input queue of the card
+   it is waiting for is down to this. */
+const size_t input_low_water = RING_SIZE / 2;
+
+/* A card with a screen which has had output waiting for this long
+   falls back to sending what changes on its screen, no more often than
+   this either. */
+const long screen_frame_nsec = 33*1000*1000;  /* about 30 a second */
+
+/* Output from a card is read into a buffer of this size to start with,
+   which can grow to the second if the tty keeps it waiting. */
+const size_t card_buffer_min = 4096;
+const size_t card_buffer_max = 16384;
+
+/* A newly attached tty is given at most this much of what a card
+   without a screen last output. */
+#define RESYNC_TAIL 4096
+
+/* A card that wants only the tail of its output when the tty cannot
+   keep up lets this much wait for the tty. Past that, all but the last
+   TAIL_KEEP bytes of what is waiting are cut out. */
+const size_t tail_buffer_max = 262144;
+#define TAIL_KEEP 4096
+
+static void
+timespec_add_nsec(struct timespec *t, long nsec)
 {
-	int t1ms = (t1->tv_nsec + t1_offset) / 1000000;
-	int t1s = t1->tv_sec;
-	while (t1ms >= 1000) {
-		t1ms -= 1000;
-		t1s++;
+	t->tv_nsec += nsec;
+	while (t->tv_nsec >= 1000000000) {
+		t->tv_nsec -= 1000000000;
+		t->tv_sec++;
 	}
+}
 
-	int t0ms = (t0->tv_nsec + t0_offset) / 1000000;
-	int t0s = t0->tv_sec;
-	while (t0ms >= 1000) {
-		t0ms -= 1000;
-		t0s++;
+static int
+timespec_passed(const struct timespec *now, const struct timespec *t)
+{
+	if (now->tv_sec != t->tv_sec) return now->tv_sec > t->tv_sec;
+	return now->tv_nsec >= t->tv_nsec;
+}
+
+/* Free c and everything it holds. Nothing else may know of it. */
+static void
+card_release(struct cardclient *c)
+{
+	ring_release(&(c->input), c->srv->input_pool);
+	buffer_release(&(c->buf));
+	scrollback_free(&(c->scrollback));
+	if (c->screen) {
+		screen_free(c->screen);
 	}
+	free(c);
+}
 
-	return (t1s-t0s) * 1000 + (t1ms-t0ms);
+static void
+card_free(struct iowatch *w)
+{
+	card_release((struct cardclient *)((char *)w - offsetof(struct cardclient, watch)));
 }
 
-static void *
-copy_to_client(void *arg)
+static void
+card_destroy(struct cardclient *c)
 {
-	struct cardclient *c = (struct cardclient *)arg;
-	struct cardinput *i;
-	struct pollfd pollfd;
+	forget_tty(c->srv, c);
 
-	pollfd.fd = c->sock;
-	pollfd.events = POLLOUT;
+	registry_remove(c->srv->registry, c);
+	if (c->srv->record) {
+		record_add(c->srv->record, RECORD_GONE, c->id, NULL, 0);
+	}
+	/* From here on nobody else can find us to give us input. */
+	input_drained(c->srv, c);
 
-	pthread_mutex_lock(&(c->input_lock));
-	while (!((c->input_stop) || (c->input_broken))) {
-		i = c->input_head;
-		if (!i) {
-			pthread_cond_wait(&(c->input_cv), &(c->input_lock));
-			continue;
+	if (c->tty_watch_fd >= 0) {
+		ioloop_del(&(c->tty_watch), c->tty_watch_fd);
+		close(c->tty_watch_fd);
+	}
+	if (c->flow_sock >= 0) {
+		ioloop_del(&(c->flow_watch), c->flow_sock);
+		close(c->flow_sock);
+	}
+	ioloop_del(&(c->watch), c->sock);
+	close(c->sock);
+	/* Retired watches are destroyed in order, and card_free() takes
+	   the tty and flow watches down with the card, so they go first. */
+	ioloop_retire(&(c->tty_watch), NULL);
+	ioloop_retire(&(c->flow_watch), NULL);
+	ioloop_retire(&(c->watch), card_free);
+}
+
+/* The renderer cannot take more output right now. Arrange to be called
+   when it can. Returns 0 if we should just try again. */
+static int
+wait_for_renderer(struct cardclient *c)
+{
+	struct renderer *r = c->srv->renderer;
+	struct pollfd pfd;
+
+	if (!(r->intf->check_ready_for_output(r, &pfd))) {
+		return 0;
+	}
+	if ((c->tty_watch_fd >= 0) && (c->tty_watch_gen != c->srv->renderer_gen)) {
+		/* That was for a renderer which has since been replaced. */
+		ioloop_del(&(c->tty_watch), c->tty_watch_fd);
+		close(c->tty_watch_fd);
+		c->tty_watch_fd = -1;
+	}
+	if (c->tty_watch_fd < 0) {
+		/* Our own dup so that cards on the same loop do not
+		   step on each other's registration of the same fd. */
+		c->tty_watch_fd = dup(pfd.fd);
+		c->tty_watch_gen = c->srv->renderer_gen;
+		if (c->tty_watch_fd < 0) {
+			perror("dup renderer fd");
+			return 0;
 		}
-		c->input_head = i->next;
-		if (c->input_tail == i) {
-			c->input_tail = NULL;
+		if (ioloop_add(&(c->tty_watch), c->tty_watch_fd, EPOLLOUT | EPOLLONESHOT) < 0) {
+			perror("watch renderer fd");
+			close(c->tty_watch_fd);
+			c->tty_watch_fd = -1;
+			return 0;
 		}
+	} else {
+		ioloop_mod(&(c->tty_watch), c->tty_watch_fd, EPOLLOUT | EPOLLONESHOT);
+	}
+	c->tty_blocked = 1;
+	return 1;
+}
+
+/* Send input from the renderer to the client for as long as the socket
+   takes it. */
+static void
+copy_to_client(struct cardclient *c)
+{
+	const void *data;
+	size_t count;
+	ssize_t nwritten;
+	unsigned long long credit;
 
-		if (i->data == NULL) {
-			c->input_broken = 1;
-			free(i);
+	while (c->sock_writable && (count = ring_peek(&(c->input), &data))) {
+		credit = stat_get(&(c->input_limit)) - stat_get(&(c->input_sent));
+		if (credit == 0) {
+			/* Wait for the client to take some in. */
 			break;
 		}
-
-		while (i->size > 0) {
-			int n = poll(&pollfd, 1, -1);
-			if (n <= 0) {
-				if (n == 0) continue;
-				if (errno == EAGAIN) continue;
-				if (errno == EINTR) continue;
-				sleep(1);
-				continue;
-			}
-			ssize_t nwritten = write(c->sock, i->data, i->size);
-			if (nwritten <= 0) {
-				c->input_broken = 1;
+		if (count > credit) {
+			count = credit;
+		}
+		nwritten = write(c->sock, data, count);
+		if (nwritten < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) {
+				c->sock_writable = 0;
 				break;
 			}
-			i->data += nwritten;
-			i->size -= nwritten;
+			/* The client does not want any more. Throw away
+			   whatever is queued so the renderer is not kept
+			   waiting for it. */
+			atomic_store(&(c->input_closed), 1);
+			while ((count = ring_peek(&(c->input), &data))) {
+				ring_consume(&(c->input), count);
+			}
+			break;
 		}
-		free(i);
+		/* Before the ring is seen to be empty by card_input(). */
+		stat_add(&(c->input_sent), nwritten);
+		ring_consume(&(c->input), nwritten);
 	}
-	while (!(c->input_stop)) {
-		/* Quit because input_broken? */
-		/* Do nothing until the copy_from_client thread quits */
-		pthread_cond_wait(&(c->input_cv), &(c->input_lock));
+	if (ring_fill(&(c->input)) <= input_low_water) {
+		input_drained(c->srv, c);
 	}
-	while (c->input_head) {
-		i = c->input_head;
-		c->input_head = i->next;
-		free(i);
+}
+
+/* buf is full and the client has more: cut out all but the last
+   TAIL_KEEP bytes, from the start of a line if there is one in there,
+   and make a note of how much to tell the tty. Everything was kept in
+   the scrollback on the way in. */
+static void
+cut_to_tail(struct cardclient *c)
+{
+	struct iovec iov[2];
+	char tail[TAIL_KEEP];
+	size_t fill = buffer_fill(&(c->buf));
+	size_t cut = fill - TAIL_KEEP;
+	size_t n = 0;
+	char *p, *nl;
+	int i, iovcnt;
+
+	buffer_consume(&(c->buf), cut);
+	iovcnt = buffer_data(&(c->buf), TAIL_KEEP, iov);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(tail + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
 	}
-	pthread_mutex_unlock(&(c->input_lock));
-	free(c);
-	return NULL;
+	buffer_consume(&(c->buf), n);
+	p = tail;
+	if ((nl = memchr(tail, '\n', n)) && (nl + 1 < tail + n)) {
+		p = nl + 1;
+		cut += p - tail;
+		n -= p - tail;
+	}
+	buffer_put(&(c->buf), p, n);
+	c->tail_cut += cut;
+	stat_add(&(c->bytes_elided), cut);
 }
 
-static void *
-copy_from_client(void *arg)
+/* Read output from the client. Returns 1 if anything happened. */
+static int
+copy_from_client(struct cardclient *c)
 {
-	struct cardclient *c = (struct cardclient *)arg;
-	int i_own_the_tty = 0;
-	int somebody_else_may_want_the_tty = 0;
-	struct timespec time_last_written_anything;
 	struct timespec now;
-	
-	struct pollfd pollfd[3];
-	int nfds, n;
-	int client_running = 1;
-	int tty_running = 1;
-	char buf[4096];
-	char scratch[10];
-	size_t buf_fill = 0;
-	size_t written_since_owning_tty;
-	int try_writing;
+	struct iovec iov[2];
+	ssize_t nread;
+	size_t n;
+	int i, iovcnt;
+
+	if ((!(c->sock_readable)) || (!(c->client_running))) {
+		return 0;
+	}
+	if (buffer_full(&(c->buf))) {
+		if (!(c->tail_only)) {
+			return 0;
+		}
+		cut_to_tail(c);
+	}
+	if (c->eliding && (c->frame_off == c->frame_len) && (!screen_damaged(c->screen))) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_passed(&now, &(c->next_frame))) {
+			/* The last frame is out, nothing has happened
+			   since, so the terminal is up to date and the
+			   output can go straight there again. */
+			c->eliding = 0;
+		}
+	}
+	iovcnt = buffer_space(&(c->buf), c->buf.max_size, iov);
+	if (iovcnt == 0) {
+		/* No memory for it. Try again later. */
+		return 0;
+	}
+	nread = readv(c->sock, iov, iovcnt);
+	if (nread < 0) {
+		if (errno == EINTR) return 1;
+		if (errno == EAGAIN) {
+			c->sock_readable = 0;
+			return 0;
+		}
+		perror("read from cardclient");
+		c->client_running = 0;
+		return 1;
+	}
+	if (nread == 0) {
+		c->client_running = 0;
+		return 1;
+	}
+	for (i = 0, n = nread; n > 0; n -= iov[i++].iov_len) {
+		if (iov[i].iov_len > n) {
+			iov[i].iov_len = n;
+		}
+		scrollback_append(&(c->scrollback), iov[i].iov_base, iov[i].iov_len);
+		if (c->srv->record) {
+			record_add(c->srv->record, RECORD_OUTPUT, c->id, iov[i].iov_base, iov[i].iov_len);
+		}
+		if (c->screen) {
+			screen_feed(c->screen, iov[i].iov_base, iov[i].iov_len);
+		}
+	}
+	stat_add(&(c->bytes_from_client), nread);
+	if (c->eliding) {
+		stat_add(&(c->bytes_elided), nread);
+	} else {
+		buffer_produce(&(c->buf), nread);
+	}
+	return 1;
+}
 
-	pollfd[0].fd = c->notify_pipe_read;
-	pollfd[0].events = POLLIN;
+/* Take up credit the client gives us for input, and give it credit
+   for output as we get it out of the way. */
+static void
+exchange_credit(struct cardclient *c)
+{
+	unsigned long long limit;
 
-	setnonblock(c->sock);
-	setnonblock(c->notify_pipe_read);
-	while (tty_running) {
-		if ((!i_own_the_tty) && (buf_fill > 0)) {
-			/* We need the tty before we can do anything else. */
-			claim_tty(c->srv, c);
-			i_own_the_tty = 1;
-			written_since_owning_tty = 0;
-			clock_gettime(CLOCK_MONOTONIC, &time_last_written_anything);
+	if (c->flow_sock < 0) {
+		return;
+	}
+	if (c->flow_readable) {
+		c->flow_readable = 0;
+		limit = stat_get(&(c->input_limit));
+		if (credit_receive(c->flow_sock, &limit) < 0) {
+			/* The client has gone, or at least will not
+			   be keeping count any more. */
+			limit = ULLONG_MAX;
 		}
-		if ((!client_running) && (buf_fill == 0)) {
-			break;
+		atomic_store(&(c->input_limit), limit);
+	}
+	if (c->flow_blocked) {
+		return;
+	}
+	limit = credit_due(&(c->output_credit), stat_get(&(c->bytes_from_client)), buffer_fill(&(c->buf)) > 0);
+	if (limit) {
+		c->flow_blocked = (credit_send(&(c->output_credit), c->flow_sock, limit) < 0);
+	}
+}
+
+static int
+frame_due(struct cardclient *c)
+{
+	struct timespec now;
+
+	if (!screen_damaged(c->screen)) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_passed(&now, &(c->next_frame));
+}
+
+/* Whether there is anything to write to the tty right now. */
+static int
+output_ready(struct cardclient *c)
+{
+	if (c->eliding) {
+		return (c->frame_off < c->frame_len) || frame_due(c);
+	}
+	return (buffer_fill(&(c->buf)) > 0) || (c->cut_note_off < c->cut_note_len);
+}
+
+/* Whether there is anything still to write to the tty, now or later. */
+static int
+output_left(struct cardclient *c)
+{
+	if (c->eliding) {
+		return (c->frame_off < c->frame_len) || screen_damaged(c->screen);
+	}
+	return (buffer_fill(&(c->buf)) > 0) || (c->cut_note_off < c->cut_note_len);
+}
+
+/* A card that is eliding and has changes to send wants to run again
+   when the next frame is due. */
+static void
+set_frame_timer(struct cardclient *c)
+{
+	if (c->eliding && (c->frame_off == c->frame_len) && screen_damaged(c->screen)) {
+		ioloop_set_timer(&(c->watch), &(c->next_frame));
+	} else {
+		ioloop_set_timer(&(c->watch), NULL);
+	}
+}
+
+/* Send frames from the screen instead of output as it comes. The screen
+   already has what is in buf. The first frame repaints everything,
+   after cancelling any sequence the terminal was left in the middle
+   of. */
+static void
+start_eliding(struct cardclient *c, const struct timespec *now)
+{
+	stat_add(&(c->bytes_elided), buffer_fill(&(c->buf)));
+	buffer_consume(&(c->buf), buffer_fill(&(c->buf)));
+	c->backlogged = 0;
+	c->eliding = 1;
+	c->frame_off = c->frame_len = 0;
+	c->next_frame = *now;
+	screen_damage_all(c->screen);
+}
+
+/* Go over to sending frames if output has been stuck for too long.
+   Returns 1 if it did. */
+static int
+watch_backlog(struct cardclient *c)
+{
+	struct timespec now, deadline;
+
+	if ((!(c->screen)) || c->eliding) {
+		return 0;
+	}
+	if ((buffer_fill(&(c->buf)) == 0) && (!(c->sock_readable && c->client_running))) {
+		/* Caught up with everything the client had sent. */
+		c->backlogged = 0;
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!(c->backlogged)) {
+		c->backlogged = 1;
+		c->backlog_since = now;
+		return 0;
+	}
+	deadline = c->backlog_since;
+	timespec_add_nsec(&deadline, screen_frame_nsec);
+	if (!timespec_passed(&now, &deadline)) {
+		return 0;
+	}
+	start_eliding(c, &now);
+	return 1;
+}
+
+/* Called when a new tty has been attached, which has seen nothing of
+   this card. Rather than everything since the card started, it gets
+   what the card's terminal should look like now: a frame of the whole
+   screen if the card keeps one, or else the last buffer-full of its
+   output, from the start of a line. Returns 1 if it did anything. */
+static int
+resync(struct cardclient *c)
+{
+	unsigned long long start, end, from;
+	struct timespec now;
+	char tail[RESYNC_TAIL];
+	char *p, *nl;
+	size_t n;
+
+	if ((!atomic_load(&(c->resync))) || (!atomic_exchange(&(c->resync), 0))) {
+		return 0;
+	}
+	if (c->screen) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		start_eliding(c, &now);
+		return 1;
+	}
+	/* What is in buf is at the end of the scrollback already. */
+	buffer_consume(&(c->buf), buffer_fill(&(c->buf)));
+	c->tail_cut = 0;
+	c->cut_note_off = c->cut_note_len = 0;
+	scrollback_range(&(c->scrollback), &start, &end);
+	from = (end - start > sizeof(tail)) ? (end - sizeof(tail)) : start;
+	n = scrollback_read(&(c->scrollback), from, tail, end - from);
+	p = tail;
+	if ((from > start) && (nl = memchr(tail, '\n', n)) && (nl + 1 < tail + n)) {
+		p = nl + 1;
+		n -= p - tail;
+	}
+	buffer_put(&(c->buf), p, n);
+	return 1;
+}
+
+/* Write buffered output, or the current frame, to the renderer, if we
+   own it. Returns 1 if anything happened. */
+static int
+copy_to_tty(struct cardclient *c)
+{
+	struct renderer *r = c->srv->renderer;
+	struct timespec now;
+	ssize_t nwritten;
+	const char *data;
+	size_t count;
+
+	if ((c->tty_state != TTY_OWNED) || c->tty_blocked) {
+		return 0;
+	}
+	if (c->eliding) {
+		if ((c->frame_off == c->frame_len) && frame_due(c)) {
+			c->frame = screen_render(c->screen, &(c->frame_len));
+			c->frame_off = 0;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			c->next_frame = now;
+			timespec_add_nsec(&(c->next_frame), screen_frame_nsec);
+		}
+		data = c->frame + c->frame_off;
+		count = c->frame_len - c->frame_off;
+	} else {
+		if ((c->cut_note_off == c->cut_note_len) && c->tail_cut) {
+			/* Cancel whatever sequence the terminal was left in
+			   the middle of where the output was cut. */
+			c->cut_note_len = snprintf(c->cut_note, sizeof(c->cut_note),
+				"\030\r\n[%llu bytes elided]\r\n", c->tail_cut);
+			c->cut_note_off = 0;
+			c->tail_cut = 0;
 		}
+		if (c->cut_note_off < c->cut_note_len) {
+			data = c->cut_note + c->cut_note_off;
+			count = c->cut_note_len - c->cut_note_off;
+		} else {
+			count = buffer_peek(&(c->buf), (const void **)&data);
+		}
+	}
+	if (count > c->deficit) {
+		count = c->deficit;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	nwritten = r->intf->write(r, data, count);
+	if (nwritten < 0) {
+		if (errno == EINTR) return 1;
+		if (errno != EAGAIN) {
+			perror("write to tty");
+			c->tty_running = 0;
+			return 1;
+		}
+		nwritten = 0;
+	}
+	if (nwritten == 0) {
+		return !wait_for_renderer(c);
+	}
+	if (c->eliding) {
+		c->frame_off += nwritten;
+	} else if (c->cut_note_off < c->cut_note_len) {
+		c->cut_note_off += nwritten;
+	} else {
+		buffer_consume(&(c->buf), nwritten);
+	}
+	c->deficit -= nwritten;
+	c->turn_bytes += nwritten;
+	clock_gettime(CLOCK_MONOTONIC, &(c->time_last_written_anything));
+	return 1;
+}
 
-		int timeout = -1;
-		if (i_own_the_tty) {
-			long give_up_anyway_nsec = always_give_up_anyway_nsec;
-			/* Should we give it up? */
-			if (buf_fill) {
-				/* if we have a write backlog, we really
-				   don't want to give up the tty. */
-				if (
-					(written_since_owning_tty > maybe_give_up_if_written_bytes) &&
-					somebody_else_may_want_the_tty
-				) {
-					/* on the other hand, we've had our chance.
-					   Definitely give up in this case. */
-					give_up_tty(c->srv);
-					i_own_the_tty = 0;
-					continue;
-				}
-				if (somebody_else_may_want_the_tty) {
-					/* Sure, but we need it too. */
-					/* Don't keep it too long though. */
-					give_up_anyway_nsec = short_give_up_nsec;
-				}
-			}
-			if ((written_since_owning_tty > 0) || (buf_fill == 0)) {
-				clock_gettime(CLOCK_MONOTONIC, &now);
-				timeout = msec_until(&now, 0, &time_last_written_anything, give_up_anyway_nsec);
-				if (timeout <= 0) {
-					give_up_tty(c->srv);
-					i_own_the_tty = 0;
-					continue;
-				}
-			} /* else we keep the tty indefinitely in order that we can make 
-			     any progress at all. */
-		}
-
-		/* entry 0 is always the notify pipe */
-		nfds = 1;
-		try_writing = 0;
-		if (buf_fill && i_own_the_tty) {
-			/* (Note that if buf_fill > 0, i_own_the_tty is guaranteed already) */
-			int using_poll = c->srv->renderer->intf->check_ready_for_output(
-				c->srv->renderer, &(pollfd[nfds])
-			);
-			if (using_poll) {
-				nfds++;
-			} else {
-				/* The renderer told us it was ready without needing to poll. */
-				timeout = 0;
-				try_writing = 1;
-			}
+/* Decide whether to keep the tty. Returns 1 if we gave it up. */
+static int
+tty_ownership_policy(struct cardclient *c)
+{
+	struct timespec now, deadline;
+
+	if (output_ready(c)) {
+		/* Keep going until the quantum runs out, however long
+		   the renderer makes us wait. */
+		ioloop_set_timer(&(c->watch), NULL);
+		if (tty_give_way(c->srv, c)) {
+			/* Somebody is typing at another card. */
+			return 1;
 		}
-		if (buf_fill < sizeof(buf)) {
-			pollfd[nfds].fd = c->sock;
-			pollfd[nfds++].events = POLLIN;
+		if (c->deficit == 0) {
+			return tty_quantum_spent(c->srv, c);
 		}
-		n = poll(&(pollfd[0]), nfds, timeout);
-		if (n < 0) {
-			if (errno == EAGAIN) continue;
-			if (errno == EINTR) continue;
-			perror("poll");
-			sleep(1);
+		return 0;
+	}
+
+	if (c->sock_readable && c->client_running) {
+		/* There may be more to read right away. */
+		ioloop_set_timer(&(c->watch), NULL);
+		return 0;
+	}
+	/* Nothing to write, so no reason to hold anybody up, and no
+	   claim on the rest of the quantum next time either. */
+	if (tty_is_wanted(c->srv)) {
+		c->deficit = 0;
+		give_up_tty(c->srv, c);
+		return 1;
+	}
+	deadline = c->time_last_written_anything;
+	timespec_add_nsec(&deadline, idle_give_up_nsec);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_passed(&now, &deadline)) {
+		c->deficit = 0;
+		give_up_tty(c->srv, c);
+		return 1;
+	}
+	if (c->eliding && screen_damaged(c->screen) &&
+			timespec_passed(&deadline, &(c->next_frame))) {
+		deadline = c->next_frame;
+	}
+	ioloop_set_timer(&(c->watch), &deadline);
+	return 0;
+}
+
+/* The state machine for one card. Called on the card's loop thread whenever
+   anything might have changed: socket or renderer readiness, input queued,
+   the tty handed to us or wanted by somebody else, or a timer. It makes as
+   much progress as it can without blocking and then returns. */
+static void
+card_run(struct cardclient *c)
+{
+	struct cardserver *srv = c->srv;
+	enum tty_state state;
+	int progress;
+
+	do {
+		progress = resync(c);
+
+		copy_to_client(c);
+		progress |= copy_from_client(c);
+
+		state = c->tty_state;
+		if (state == TTY_WAITING) {
+			state = get_tty_state(srv, c);
+		}
+		if (state == TTY_GRANTED) {
+			take_tty(srv, c);
+			clock_gettime(CLOCK_MONOTONIC, &(c->time_last_written_anything));
+		}
+		if ((c->tty_state == TTY_NONE) && output_ready(c)) {
+			/* We need the tty before we can do anything else. */
+			claim_tty(srv, c);
+			progress = 1;
 			continue;
 		}
-
-		if (pollfd[0].revents) {
-			if (i_own_the_tty) {
-				somebody_else_may_want_the_tty = 1;
-			}
-			/* soak it up but throw it away. */
-			read(pollfd[0].fd, &(scratch[0]), sizeof(scratch));
-		}
-		for (n = 1; n < nfds; n++) {
-			if (!pollfd[n].revents) continue;
-			if (pollfd[n].fd == c->sock) {
-				if (pollfd[n].revents & POLLHUP) {
-					client_running = 0;
-					continue;
-				}
-				size_t nread = read(c->sock, &(buf[buf_fill]), sizeof(buf)-buf_fill);
-				if (nread < 0) {
-					perror("read from cardclient");
-					client_running = 0;
-					continue;
-				}
-				if (nread == 0) {
-					client_running = 0;
-					continue;
-				}
-				buf_fill += nread;
-			} else {
-				/* must be the renderer */
-				if (pollfd[n].revents & POLLHUP) {
-					tty_running = 0;
-					break;
-				}
-				try_writing = 1;
-			}
+		if ((!(c->tty_running)) || ((!(c->client_running)) && (!output_left(c)))) {
+			card_destroy(c);
+			return;
 		}
-		if (try_writing) {
-			size_t nwritten = c->srv->renderer->intf->write(c->srv->renderer, &(buf[0]), buf_fill);
-			if (nwritten < 0) {
-				perror("write to tty");
-				tty_running = 0;
-				break;
-			}
-			if (buf_fill == nwritten) {
-				buf_fill = 0;
-			} else {
-				memmove(&(buf[0]), &(buf[nwritten]), buf_fill-nwritten);
-				buf_fill -= nwritten;
-			}
+
+		progress |= copy_to_tty(c);
+		progress |= watch_backlog(c);
+		exchange_credit(c);
+
+		if (c->tty_state == TTY_OWNED) {
+			progress |= tty_ownership_policy(c);
+		} else {
+			set_frame_timer(c);
 		}
+	} while (progress);
+}
+
+static void
+card_ready(struct iowatch *w, uint32_t events)
+{
+	struct cardclient *c = (struct cardclient *)((char *)w - offsetof(struct cardclient, watch));
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+		c->sock_readable = 1;
 	}
-	if (i_own_the_tty) {
-		give_up_tty(c->srv);
-		i_own_the_tty = 0;
+	if (events & (EPOLLOUT | EPOLLERR)) {
+		c->sock_writable = 1;
 	}
+	card_run(c);
+}
 
-	close(c->sock);
-	close(c->notify_pipe_read);
+static void
+card_flow_ready(struct iowatch *w, uint32_t events)
+{
+	struct cardclient *c = (struct cardclient *)((char *)w - offsetof(struct cardclient, flow_watch));
 
-	pthread_mutex_lock(&(c->srv->clients_lock));
-	if (c->prev == NULL) {
-		c->srv->clients_head = c->next;
-	} else {
-		c->prev->next = c->next;
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+		c->flow_readable = 1;
 	}
-	if (c->next == NULL) {
-		c->srv->clients_tail = c->prev;
-	} else {
-		c->next->prev = c->prev;
+	if (events & EPOLLOUT) {
+		c->flow_blocked = 0;
 	}
-	pthread_mutex_unlock(&(c->srv->clients_lock));
+	card_run(c);
+}
 
-	pthread_mutex_lock(&c->input_lock);
-	c->input_stop = 1;
-	pthread_cond_signal(&c->input_cv);
-	pthread_mutex_unlock(&c->input_lock);
+static void
+card_tty_ready(struct iowatch *w, uint32_t events)
+{
+	struct cardclient *c = (struct cardclient *)((char *)w - offsetof(struct cardclient, tty_watch));
+
+	/* Even if the tty has hung up: the renderer will take output
+	   and drop it until the deck detaches from that tty. */
+	c->tty_blocked = 0;
+	card_run(c);
+}
+
+/* What a card says about itself in the message it arrives with. */
+struct card_hello {
+	unsigned int weight;
+	uint64_t token;
+	uint64_t parent;
+	int has_parent;
+	int screen_cols;	/* 0 for no screen */
+	int screen_rows;
+	int wants_pty;
+	int tail_only;
+};
 
-	/* It's up to the copy_to_client thread to free the client */
+/* Parse the options that follow the name. */
+static void
+card_options(struct card_hello *h, const char *opt)
+{
+	unsigned long weight;
+	char *end;
 
-	return NULL;
+	while (opt && *opt) {
+		opt++;	/* the '\n' */
+		if (0 == strncmp(opt, CARD_OPTION_WEIGHT "=", sizeof(CARD_OPTION_WEIGHT))) {
+			weight = strtoul(opt + sizeof(CARD_OPTION_WEIGHT), &end, 10);
+			if ((end != opt + sizeof(CARD_OPTION_WEIGHT)) && (weight > 0)) {
+				h->weight = (weight > CARD_MAX_WEIGHT) ? CARD_MAX_WEIGHT : weight;
+			}
+		} else if (0 == strncmp(opt, CARD_OPTION_TOKEN "=", sizeof(CARD_OPTION_TOKEN))) {
+			h->token = strtoull(opt + sizeof(CARD_OPTION_TOKEN), NULL, 16);
+		} else if (0 == strncmp(opt, CARD_OPTION_PARENT "=", sizeof(CARD_OPTION_PARENT))) {
+			h->parent = strtoull(opt + sizeof(CARD_OPTION_PARENT), NULL, 16);
+			h->has_parent = 1;
+		} else if (0 == strncmp(opt, CARD_OPTION_PTY "=", sizeof(CARD_OPTION_PTY))) {
+			h->wants_pty = (opt[sizeof(CARD_OPTION_PTY)] == '1');
+		} else if (0 == strncmp(opt, CARD_OPTION_TAIL "=", sizeof(CARD_OPTION_TAIL))) {
+			h->tail_only = (opt[sizeof(CARD_OPTION_TAIL)] == '1');
+		} else if (0 == strncmp(opt, CARD_OPTION_SCREEN "=", sizeof(CARD_OPTION_SCREEN))) {
+			if (2 != sscanf(opt + sizeof(CARD_OPTION_SCREEN), "%dx%d",
+					&(h->screen_cols), &(h->screen_rows))) {
+				h->screen_cols = h->screen_rows = 0;
+			}
+		}
+		/* Ignore anything we do not know about. */
+		opt = strchr(opt, '\n');
+	}
 }
 
+/* Name a card nested in the one whose token is parent, the way names
+   always went: the parent's name followed by a number counting the
+   cards nested in it. If the parent is the deck's first card or is not
+   around any more, the card goes at the top level. The name is put in
+   buf with the '.' on the end, as on the wire. Returns -1 if it does not
+   fit. Only on the loop that creates cards. */
+static int
+nested_card_name(struct cardserver *srv, uint64_t parent, char *buf, size_t size)
+{
+	struct cardclient *found;
+	unsigned int *counter = &(srv->next_top_level);
+	const char *parent_name = "";
+	unsigned int section;
+	int n;
+
+	section = registry_read_lock(srv->registry);
+	found = registry_lookup_token(srv->registry, parent);
+	if (found && *(found->card_name)) {
+		parent_name = found->card_name;
+		counter = &(found->next_child);
+	}
+	n = snprintf(buf, size, "%s.%u.", parent_name, *counter);
+	(*counter)++;
+	registry_read_unlock(srv->registry, section);
+	return ((n >= 0) && ((size_t)n < size)) ? 0 : -1;
+}
+
+/* Answer a card that asked for a pty on conn, with one from the pool
+   if there is one. */
 static void
-new_card(void *arg, int fd, const char *name)
+hand_pty(struct cardserver *srv, int conn)
 {
-	struct cardserver *srv = (struct cardserver *)arg;
+	int fds[2];
+
+	if (pty_pool_take(&(srv->ptys), &(fds[0]), &(fds[1])) < 0) {
+		send_fds(conn, "", 0, NULL, 0);
+		return;
+	}
+	if (send_fds(conn, CARD_OPTION_PTY, sizeof(CARD_OPTION_PTY)-1, &(fds[0]), 2) < 0) {
+		perror("hand_pty: sendmsg");
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
 
-	pthread_t thread_id;
-	pthread_attr_t thread_attr;
-	int pipefd[2];
+/* Make a card from the message it came with on conn. Returns 1 if that
+   was the last the connection will bring. */
+static int
+new_card(struct cardserver *srv, int conn, int fd, int flow, const char *name, pid_t pid)
+{
+	struct card_hello hello;
+	char nested_name[256];
+	const char *options;
 	size_t namelen;
 
+	memset(&hello, 0, sizeof(hello));
 	if ((!name) || (!(*name))) {
-		close(fd);
-		return;
+		goto reject;
 	}
-	namelen = strlen(name);
+	options = strchr(name, '\n');
+	namelen = options ? (options - name) : strlen(name);
 	/* Card names must be .-terminated on the wire. This is because they
 	   cannot be empty and .-terminating them is the easiest way to
 	   generate appropriate names for the root card on down. But we do
 	   not want this dot for presentation. */
-	if (name[namelen-1] != '.') {
-		close(fd);
-		return;
+	if ((namelen == 0) || (name[namelen-1] != '.')) {
+		goto reject;
+	}
+	hello.weight = CARD_DEFAULT_WEIGHT;
+	card_options(&hello, options);
+	if (hello.wants_pty) {
+		/* First, so that the card can get on with starting its
+		   command while we set up our side of it. */
+		hand_pty(srv, conn);
+	}
+	/* Only the deck's own first card, which comes from this process,
+	   gets to name itself. */
+	if (hello.has_parent || (pid != getpid())) {
+		if (nested_card_name(srv, hello.parent, nested_name, sizeof(nested_name)) < 0) {
+			fprintf(stderr, "Cards are nested too deep\n");
+			goto reject;
+		}
+		name = nested_name;
+		namelen = strlen(nested_name);
 	}
 
-	struct cardclient *c = malloc(sizeof(struct cardclient) + strlen(name));
+	struct cardclient *c = malloc(sizeof(struct cardclient) + namelen);
 	if (!c) {
 		perror("new_stub: malloc failure");
-		close(fd);
-		return;
+		goto reject;
 	}
 	memset(c, 0, sizeof(*c));
 	c->card_name = (const char *)(&(c[1]));
 	memcpy((char *)(&(c[1])), name, namelen-1);
 	((char *)(&(c[1])))[namelen-1] = 0;
 	c->sock = fd;
-	c->next = NULL;
 	c->srv = srv;
-	pthread_mutex_init(&(c->input_lock), NULL);
-	pthread_cond_init(&(c->input_cv), NULL);
+	c->tty_watch_fd = -1;
+	c->flow_sock = flow;
+	c->client_running = 1;
+	c->tty_running = 1;
+	c->pid = pid;
+	c->token = hello.token;
+	c->weight = hello.weight;
+	ring_init(&(c->input));
+	atomic_init(&(c->input_closed), 0);
+	atomic_init(&(c->input_wanted), 0);
+	atomic_init(&(c->bytes_from_client), 0);
+	atomic_init(&(c->bytes_to_client), 0);
+	atomic_init(&(c->bytes_elided), 0);
+	atomic_init(&(c->resync), 0);
+	if (hello.screen_cols) {
+		/* Without it the card just never elides anything. */
+		c->screen = screen_new(hello.screen_cols, hello.screen_rows);
+	}
+	/* A screen does better than a tail if there is one. */
+	c->tail_only = hello.tail_only && (!(c->screen));
+	buffer_init(&(c->buf), card_buffer_min, c->tail_only ? tail_buffer_max : card_buffer_max);
+	/* Without a credit socket the client cannot hold us back. */
+	atomic_init(&(c->input_limit), (flow >= 0) ? CARD_CREDIT_INITIAL : ULLONG_MAX);
+	atomic_init(&(c->input_sent), 0);
+	credit_init(&(c->output_credit));
+	scrollback_init(&(c->scrollback), srv->scrollback);
+	setnonblock(c->sock);
+	if (flow >= 0) {
+		setnonblock(flow);
+	}
 
-	if (pipe(&(pipefd[0])) < 0) {
-		perror("new_stub: pipe failure");
-		close(fd);
-		free(c);
+	c->id = registry_new_id(srv->registry);
+	ioloop_watch_init(&(c->watch), srv->loops[c->id % srv->nloops], card_ready);
+	ioloop_watch_init(&(c->tty_watch), srv->loops[c->id % srv->nloops], card_tty_ready);
+	ioloop_watch_init(&(c->flow_watch), srv->loops[c->id % srv->nloops], card_flow_ready);
+	if (registry_add(srv->registry, c) < 0) {
+		perror("new_stub: registry_add");
+		card_release(c);
+		goto reject;
+	}
+	if (srv->record) {
+		/* Only once it exists, and before its loop can read
+		   anything from it. */
+		record_add(srv->record, RECORD_CARD, c->id, c->card_name, strlen(c->card_name));
+	}
+
+	/* Edge triggered: card_run() keeps track of readiness itself. */
+	if (ioloop_add(&(c->watch), c->sock,
+			EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0) {
+		perror("new_stub: epoll_ctl");
+		c->client_running = 0;
+		ioloop_kick(&(c->watch));
+	} else if ((flow >= 0) && (ioloop_add(&(c->flow_watch), flow,
+			EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)) {
+		perror("new_stub: epoll_ctl");
+		c->client_running = 0;
+		ioloop_kick(&(c->watch));
+	}
+	return hello.wants_pty;
+
+reject:
+	close(fd);
+	if (flow >= 0) {
+		close(flow);
+	}
+	return hello.wants_pty;
+}
+
+struct stub {
+	struct iowatch watch;
+	struct cardserver *srv;
+	int fd;
+	pid_t pid;
+};
+
+static void
+stub_free(struct iowatch *w)
+{
+	free(w);
+}
+
+/* Take whatever cards the connection has brought. Returns 0 if it may
+   bring more later, or -1 once it is done with. */
+static int
+take_cards(struct cardserver *srv, int fd, pid_t pid)
+{
+	char buf[4096];
+	ssize_t n;
+	int fds[2], nfds;
+
+	for (;;) {
+		nfds = 2;
+		n = recv_fds(fd, buf, sizeof(buf), &(fds[0]), &nfds);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return 0;
+			perror("recvmsg");
+			return -1;
+		}
+		if ((n == 0) && (nfds == 0)) {
+			return -1;
+		}
+		if (nfds > 0) {
+			/* The second is the credit socket, if any. */
+			if (new_card(srv, fd, fds[0], (nfds > 1) ? fds[1] : -1, buf, pid)) {
+				return -1;
+			}
+		}
+	}
+}
+
+static void
+stub_ready(struct iowatch *w, uint32_t events)
+{
+	struct stub *stub = (struct stub *)w;
+
+	if (take_cards(stub->srv, stub->fd, stub->pid) == 0) {
 		return;
 	}
-	c->notify_pipe = pipefd[1];
-	c->notify_pipe_read = pipefd[0];
+	ioloop_del(&(stub->watch), stub->fd);
+	close(stub->fd);
+	ioloop_retire(&(stub->watch), stub_free);
+}
+
+void
+new_stub(struct cardserver *srv, int fd, pid_t pid)
+{
+	struct stub *stub = malloc(sizeof(*stub));
 
-	pthread_mutex_lock(&(srv->clients_lock));
-	c->prev = srv->clients_tail;
-	if (srv->clients_tail) {
-		srv->clients_tail->next = c;
+	if (!stub) {
+		perror("new_stub: malloc failure");
+		close(fd);
+		return;
 	}
-	srv->clients_tail = c;
-	if (!(srv->clients_head)) {
-		srv->clients_head = c;
+	ioloop_watch_init(&(stub->watch), srv->loops[0], stub_ready);
+	stub->srv = srv;
+	stub->fd = fd;
+	stub->pid = pid;
+	setnonblock(fd);
+	if (ioloop_add(&(stub->watch), fd, EPOLLIN) < 0) {
+		perror("new_stub: epoll_ctl");
+		close(fd);
+		free(stub);
 	}
-	pthread_mutex_unlock(&(srv->clients_lock));
+}
+
+struct listener {
+	struct iowatch watch;
+	struct cardserver *srv;
+	int fd;
+	atomic_int stopping;
+	/* Set once the loop is done with the listener */
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int retired;
+};
+
+static void
+listener_retired(struct iowatch *w)
+{
+	struct listener *l = (struct listener *)w;
+
+	pthread_mutex_lock(&(l->lock));
+	l->retired = 1;
+	pthread_cond_signal(&(l->cv));
+	pthread_mutex_unlock(&(l->lock));
+}
 
-	pthread_attr_init(&thread_attr);
-	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+static void
+listener_ready(struct iowatch *w, uint32_t events)
+{
+	struct listener *l = (struct listener *)w;
+	struct ucred cred;
+	socklen_t len;
+	int fd;
 
-	pthread_create(&thread_id, &thread_attr, copy_from_client, c);
-	pthread_create(&thread_id, &thread_attr, copy_to_client, c);
+	if (atomic_load(&(l->stopping))) {
+		ioloop_del(&(l->watch), l->fd);
+		close(l->fd);
+		ioloop_retire(&(l->watch), listener_retired);
+		return;
+	}
+	for (;;) {
+		fd = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+			if (errno != EAGAIN) {
+				perror("accept card");
+			}
+			return;
+		}
+		/* The socket is in the abstract namespace, so there are
+		   no file permissions to keep other users out. */
+		len = sizeof(cred);
+		if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) ||
+				(cred.uid != geteuid())) {
+			close(fd);
+			continue;
+		}
+		/* A card sends its hello as soon as it has connected and
+		   then hangs up, so it is usually all here already and the
+		   connection never needs watching. */
+		if (take_cards(l->srv, fd, cred.pid) < 0) {
+			close(fd);
+			continue;
+		}
+		new_stub(l->srv, fd, cred.pid);
+	}
 }
 
 void
-new_stub(struct cardserver *srv, int fd)
+new_listener(struct cardserver *srv, int fd)
 {
-	receive_fds(fd, new_card, srv, NULL);
+	struct listener *l = malloc(sizeof(*l));
+
+	if (!l) {
+		perror("new_listener: malloc failure");
+		close(fd);
+		return;
+	}
+	/* On the same loop as the stubs, so that cards are only ever
+	   created from the one thread. */
+	ioloop_watch_init(&(l->watch), srv->loops[0], listener_ready);
+	l->srv = srv;
+	l->fd = fd;
+	atomic_init(&(l->stopping), 0);
+	pthread_mutex_init(&(l->lock), NULL);
+	pthread_cond_init(&(l->cv), NULL);
+	l->retired = 0;
+	setnonblock(fd);
+	if (ioloop_add(&(l->watch), fd, EPOLLIN) < 0) {
+		perror("new_listener: epoll_ctl");
+		close(fd);
+		pthread_mutex_destroy(&(l->lock));
+		pthread_cond_destroy(&(l->cv));
+		free(l);
+		return;
+	}
+	srv->listener = l;
 }
 
 void
-card_input(struct cardclient *c, void *data, size_t count)
+stop_listener(struct cardserver *srv)
 {
-	struct cardinput *i = malloc(sizeof(struct cardinput) + count);
-	if (!i) return;
-	i->data = &(i[1]);
-	if (data != NULL) {
-		memcpy(i->data, data, count);
+	struct listener *l = srv->listener;
+
+	if (!l) {
+		return;
+	}
+	srv->listener = NULL;
+	atomic_store(&(l->stopping), 1);
+	ioloop_kick(&(l->watch));
+	pthread_mutex_lock(&(l->lock));
+	while (!(l->retired)) {
+		pthread_cond_wait(&(l->cv), &(l->lock));
 	}
-	i->size = count;
-	i->next = NULL;
+	pthread_mutex_unlock(&(l->lock));
+	pthread_mutex_destroy(&(l->lock));
+	pthread_cond_destroy(&(l->cv));
+	free(l);
+}
 
-	pthread_mutex_lock(&(c->input_lock));
-	if ((c->input_stop) || (c->input_broken)) {
-		free(i);
-	} else {
-		if (c->input_tail) {
-			c->input_tail->next = i;
+size_t
+card_input(struct cardclient *c, void *data, size_t count)
+{
+	size_t n = 0;
+	ssize_t nwritten;
+
+	if (data == NULL) {
+		atomic_store(&(c->input_closed), 1);
+		return count;
+	}
+	if (atomic_load(&(c->input_closed))) {
+		return count;
+	}
+	if ((count <= direct_input_max) && (ring_fill(&(c->input)) == 0) &&
+			(stat_get(&(c->input_sent)) + count <= stat_get(&(c->input_limit)))) {
+		/* Nothing is queued, so the loop is not writing to the
+		   socket and cannot until we queue something. */
+		nwritten = write(c->sock, data, count);
+		if (nwritten > 0) {
+			n = nwritten;
+			stat_add(&(c->input_sent), n);
 		}
-		c->input_tail = i;
-		if (!(c->input_head)) {
-			c->input_head = i;
+		if (n == count) {
+			stat_add(&(c->bytes_to_client), n);
+			return count;
 		}
-		pthread_cond_signal(&c->input_cv);
 	}
-	pthread_mutex_unlock(&(c->input_lock));
+	n += ring_put(&(c->input), c->srv->input_pool, (char *)data + n, count - n);
+	stat_add(&(c->bytes_to_client), n);
+	ioloop_kick(&(c->watch));
+	return n;
 }
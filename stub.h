@@ -4,12 +4,24 @@
 /* Defines the bit that accepts io from connected cardclients and interacts
    with cardserver to mux this io. Only cardserver calls here. */
 
+#include <sys/types.h>
+
 /* Create a new cardclient stub on the given server. The fd is a socket
-   that is already accepted. */
-void new_stub(struct cardserver *, int fd);
+   that is already accepted, from process pid. */
+void new_stub(struct cardserver *, int fd, pid_t pid);
+
+/* Accept connections on fd, the deck's socket, and make stubs of them. */
+void new_listener(struct cardserver *, int fd);
+
+/* Stop accepting connections and close the socket. Returns once the
+   loop is done with it. Not from a loop thread. */
+void stop_listener(struct cardserver *);
 
 /* Some input has been received for this card. Send it out to the
-   cardclient through and socket. */
-void card_input(struct cardclient *, void *data, size_t count);
+   cardclient through the socket, or queue it to be sent. Only called
+   from the renderer's input thread, inside a registry read section.
+   data == NULL means there will be no more input. Returns how much of
+   data was taken, which is less than count if the queue is full. */
+size_t card_input(struct cardclient *, void *data, size_t count);
 
 #endif /* _DECK_STUB_H */
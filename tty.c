@@ -7,93 +7,369 @@
 #include <errno.h>
 #include <termios.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "renderer.h"
 #include "util.h"
+#include "buffer.h"
 
 /* This is a dumb sample implementation of the renderer.
-   It assumes all input if the card 0.
    It brackets output for non-0 cards in
    "From card # {{{foobar}}}".
+   Input is for card 0, except that the far end can address input to
+   any card with a frame like
+
+     ^] name : length : payload
+
+   (without the spaces) where ^] is the byte 0x1d, name is the card
+   name as it appears in output, length is in decimal and payload is
+   that many bytes, which go to that card as they are. ^]^] sends a
+   single ^] to card 0.
    That's it.
+
+   Output never blocks the card writing it. The brackets are queued by
+   claim() and claim_none() and go out in the same writev() as the
+   payload that follows them. Whatever the tty does not take right away
+   is queued too, with output from other cards behind it, and the next
+   writev() takes the lot: either the next card's write or, once the
+   tty is writable again, the input thread's.
 */
 
+/* Stop accepting output when this much is waiting for the tty. */
+#define TTY_OUT_BUFFER 16384
+/* Room kept on top of that for the brackets. */
+#define TTY_OUT_SLACK 1024
+/* The queue starts this big, and may grow to the next power of 2 up
+   from both of those. */
+#define TTY_OUT_MIN 4096
+#define TTY_OUT_MAX 32768
+
+#define TTY_INPUT_ESC 0x1d
+#define TTY_INPUT_MAX_NAME 64
+#define TTY_INPUT_MAX_LENGTH_DIGITS 9
+
+enum tty_input_state {
+	IN_PLAIN,
+	IN_ESC,
+	IN_NAME,
+	IN_LENGTH,
+	IN_PAYLOAD,
+};
+
+/* Where we are in the input stream. Frames can be split across reads
+   at any byte. */
+struct tty_input {
+	enum tty_input_state state;
+	char name[TTY_INPUT_MAX_NAME + 1];
+	size_t name_len;
+	size_t length;
+	int length_digits;
+};
+
 struct tty_renderer {
 	struct renderer base;
 	int fd;
-	const char *active_card;
-	void (*input_callback)(void *data, size_t count, const char *card_name, void *arg);
+	int wake_pipe[2];
+
+	pthread_mutex_t lock;
+	uint32_t active_card;
+	int active_card_is_bracketed;
+	/* Output waiting for the tty */
+	struct buffer out;
+	/* The input thread is waiting for the tty to be writable. */
+	int flush_pending;
+	/* Writing to the tty failed, most likely because it was hung up.
+	   Output is thrown away from then on, see flush(). */
+	int gone;
+
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg);
 	void *callback_arg;
+	/* The input thread has been started, and has finished. */
+	int input_started;
+	int input_done;
+	/* destroy() has been called. The last of it and the input thread
+	   to finish frees the renderer. */
+	int destroyed;
+	struct tty_input input;
 	int can_restore_termios;
 	struct termios termios_for_restore;
 };
 
+/* Must hold lock. Add as much of data as fits without going over limit
+   to the output queue and return how much that was. */
+static size_t
+out_queue(struct tty_renderer *tty, const void *data, size_t count, size_t limit)
+{
+	size_t fill = buffer_fill(&(tty->out));
+
+	if (fill >= limit) {
+		return 0;
+	}
+	if (count > limit - fill) {
+		count = limit - fill;
+	}
+	return buffer_put(&(tty->out), data, count);
+}
+
+/* Must hold lock. Get the input thread to write out the queue once the
+   tty is writable. */
 static void
-write_sequence(int fd, const char *seq, size_t len)
+wait_for_tty(struct tty_renderer *tty)
 {
-	size_t written = 0;
-	struct pollfd pollfd;
-	pollfd.fd = fd;
-	pollfd.events = POLLOUT;
-	while (written < len) {
-		if (poll(&pollfd, 1, -1) < 0) {
-			sleep(1);
-			continue;
+	const char dummy = 0;
+
+	if (!(tty->flush_pending)) {
+		tty->flush_pending = 1;
+		write(tty->wake_pipe[1], &dummy, 1);
+	}
+}
+
+/* Must hold lock. Write out the queue as far as the tty takes it right
+   now, followed by count bytes of data if given, all in one writev().
+   Returns how much of data was written, which is all of it once the
+   tty has gone. If some of the queue is left, get the input thread to
+   wait for the tty. */
+static size_t
+flush(struct tty_renderer *tty, const void *data, size_t count)
+{
+	struct iovec iov[3];
+	size_t queued, total, written = 0;
+	ssize_t n;
+	int iovcnt;
+
+	while (!(tty->gone)) {
+		queued = buffer_fill(&(tty->out));
+		iovcnt = buffer_data(&(tty->out), queued, iov);
+		if (written < count) {
+			iov[iovcnt].iov_base = (char *)data + written;
+			iov[iovcnt].iov_len = count - written;
+			iovcnt++;
 		}
-		size_t n = write(fd, seq+written, len-written);
-		if (n <= 0) {
-			sleep(1);
-			continue;
+		if (iovcnt == 0) {
+			break;
 		}
-		written += n;
+		total = queued + (count - written);
+		n = writev(tty->fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) {
+				/* Nobody will see any of it. Take it all
+				   so that cards are not held up, until the
+				   input thread notices and the deck
+				   detaches from this tty. */
+				tty->gone = 1;
+			}
+			break;
+		}
+		if (n <= queued) {
+			buffer_consume(&(tty->out), n);
+		} else {
+			buffer_consume(&(tty->out), queued);
+			written += n - queued;
+		}
+		if (n < total) {
+			/* The tty is full. */
+			break;
+		}
+	}
+	if (tty->gone) {
+		buffer_consume(&(tty->out), buffer_fill(&(tty->out)));
+		return count;
+	}
+	if (buffer_fill(&(tty->out))) {
+		wait_for_tty(tty);
 	}
+	return written;
 }
 
 static void
-tty_renderer_claim(struct renderer *i, const char *card_name)
+tty_renderer_claim(struct renderer *i, uint32_t card_id, const char *card_name)
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
-
 	char buf[100];
-	if (tty->active_card == card_name) {
-		return;
-	}
-	if (*card_name) {
-		sprintf(buf, "From card \"%s\" {{{", card_name);
-		write_sequence(tty->fd, buf, strlen(buf));
+
+	pthread_mutex_lock(&(tty->lock));
+	if (tty->active_card != card_id) {
+		if (*card_name) {
+			snprintf(buf, sizeof(buf), "From card \"%s\" {{{", card_name);
+			/* Goes out with the first write for the card. */
+			out_queue(tty, buf, strlen(buf), TTY_OUT_MAX);
+		}
+		tty->active_card = card_id;
+		tty->active_card_is_bracketed = (*card_name != 0);
 	}
-	tty->active_card = card_name;
+	pthread_mutex_unlock(&(tty->lock));
 }
 
 static void
 tty_renderer_claim_none(struct renderer *i)
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
-
 	const char *seq = "}}}\n";
-	if ((*(tty->active_card)) == 0) return;
-	write_sequence(tty->fd, seq, strlen(seq));
-	tty->active_card = NULL;
+
+	pthread_mutex_lock(&(tty->lock));
+	if (tty->active_card_is_bracketed) {
+		out_queue(tty, seq, strlen(seq), TTY_OUT_MAX);
+		tty->active_card = CARD_ID_NONE;
+		tty->active_card_is_bracketed = 0;
+		if (!(tty->flush_pending)) {
+			flush(tty, NULL, 0);
+		}
+	}
+	pthread_mutex_unlock(&(tty->lock));
 }
 
 static ssize_t
 tty_renderer_write(struct renderer *i, const void *buf, size_t count)
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
-	return write(tty->fd, buf, count);
+	size_t n = 0;
+
+	pthread_mutex_lock(&(tty->lock));
+	n = flush(tty, buf, count);
+	if (n < count) {
+		n += out_queue(tty, (const char *)buf + n, count - n, TTY_OUT_BUFFER);
+	}
+	if (buffer_fill(&(tty->out))) {
+		wait_for_tty(tty);
+	}
+	pthread_mutex_unlock(&(tty->lock));
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
+
+/* Split what was read into runs of bytes for one card each and hand them
+   to the input callback. Nothing is copied: the callback gets pointers
+   into buf. */
+static void
+demux_input(struct tty_renderer *tty, char *buf, size_t count)
+{
+	struct tty_input *in = &(tty->input);
+	char *p = buf;
+	char *end = buf + count;
+	char *run, *esc;
+
+	if (in->state == IN_PLAIN) {
+		/* The usual case by far is plain typing with no frames.
+		   memchr is vectorized so this costs next to nothing. */
+		esc = memchr(p, TTY_INPUT_ESC, count);
+		if (!esc) {
+			tty->input_callback(p, count, CARD_ID_NONE, "", tty->callback_arg);
+			return;
+		}
+		if (esc > p) {
+			tty->input_callback(p, esc - p, CARD_ID_NONE, "", tty->callback_arg);
+		}
+		p = esc + 1;
+		in->state = IN_ESC;
+	}
+
+	run = NULL;
+	while (p < end) {
+		switch (in->state) {
+		case IN_PLAIN:
+			if (!run) {
+				run = p;
+			}
+			esc = memchr(p, TTY_INPUT_ESC, end - p);
+			if (!esc) {
+				p = end;
+				break;
+			}
+			if (esc > run) {
+				tty->input_callback(run, esc - run, CARD_ID_NONE, "", tty->callback_arg);
+			}
+			run = NULL;
+			p = esc + 1;
+			in->state = IN_ESC;
+			break;
+		case IN_ESC:
+			if (*p == TTY_INPUT_ESC) {
+				/* Escaped escape. It starts the next run. */
+				in->state = IN_PLAIN;
+				run = p++;
+				break;
+			}
+			in->state = IN_NAME;
+			in->name_len = 0;
+			break;
+		case IN_NAME:
+			if (*p == ':') {
+				in->name[in->name_len] = 0;
+				in->state = IN_LENGTH;
+				in->length = 0;
+				in->length_digits = 0;
+			} else if (in->name_len < TTY_INPUT_MAX_NAME) {
+				in->name[in->name_len++] = *p;
+			} else {
+				/* Garbage. Drop it. */
+				in->state = IN_PLAIN;
+			}
+			p++;
+			break;
+		case IN_LENGTH:
+			if ((*p >= '0') && (*p <= '9') && (in->length_digits < TTY_INPUT_MAX_LENGTH_DIGITS)) {
+				in->length = in->length * 10 + (*p - '0');
+				in->length_digits++;
+			} else if ((*p == ':') && (in->length_digits > 0)) {
+				in->state = (in->length > 0) ? IN_PAYLOAD : IN_PLAIN;
+			} else {
+				in->state = IN_PLAIN;
+			}
+			p++;
+			break;
+		case IN_PAYLOAD: {
+			size_t n = end - p;
+			if (n > in->length) n = in->length;
+			tty->input_callback(p, n, CARD_ID_NONE, in->name, tty->callback_arg);
+			in->length -= n;
+			p += n;
+			if (in->length == 0) {
+				in->state = IN_PLAIN;
+			}
+			break;
+		}
+		}
+	}
+	if (run && (end > run)) {
+		tty->input_callback(run, end - run, CARD_ID_NONE, "", tty->callback_arg);
+	}
+}
+
+static void
+tty_renderer_free(struct tty_renderer *tty)
+{
+	close(tty->wake_pipe[0]);
+	close(tty->wake_pipe[1]);
+	buffer_release(&(tty->out));
+	pthread_mutex_destroy(&(tty->lock));
+	free(tty);
 }
 
 static void *
 get_input(void *arg)
 {
-	struct pollfd pollfd;
+	struct pollfd pollfd[2];
 	struct tty_renderer *tty = (struct tty_renderer *)arg;
 	char buf[4096];
+	int done;
 
-	pollfd.fd = tty->fd;
-	pollfd.events = POLLIN;
+	pollfd[0].fd = tty->wake_pipe[0];
+	pollfd[0].events = POLLIN;
+	pollfd[1].fd = tty->fd;
 
 	for (;;) {
-		int n = poll(&pollfd, 1, -1);
+		pthread_mutex_lock(&(tty->lock));
+		if (tty->destroyed) {
+			pthread_mutex_unlock(&(tty->lock));
+			break;
+		}
+		pollfd[1].events = POLLIN | (tty->flush_pending ? POLLOUT : 0);
+		pthread_mutex_unlock(&(tty->lock));
+
+		int n = poll(&(pollfd[0]), 2, -1);
 		if (n <= 0) {
 			if (n == 0) continue;
 			if (errno == EINTR) continue;
@@ -101,20 +377,44 @@ get_input(void *arg)
 			sleep(1);
 			continue;
 		}
-		if (pollfd.revents & POLLHUP) {
+		if (pollfd[0].revents) {
+			read(tty->wake_pipe[0], buf, sizeof(buf));
+		}
+		if (pollfd[1].revents & POLLOUT) {
+			pthread_mutex_lock(&(tty->lock));
+			tty->flush_pending = 0;
+			flush(tty, NULL, 0);
+			pthread_mutex_unlock(&(tty->lock));
+		}
+		if (pollfd[1].revents & POLLHUP) {
 			break;
 		}
-		size_t nread = read(tty->fd, &(buf[0]), sizeof(buf));
+		if (!(pollfd[1].revents & POLLIN)) {
+			continue;
+		}
+		ssize_t nread = read(tty->fd, &(buf[0]), sizeof(buf));
 		if (nread <= 0) {
 			if ((nread < 0) && (errno == EAGAIN)) continue;
 			if ((nread < 0) && (errno == EINTR)) continue;
 			break;
 		}
 
-		/* blindly assume that all input is for card 0 for now. */
-		tty->input_callback(&(buf[0]), nread, "", tty->callback_arg);
+		demux_input(tty, &(buf[0]), nread);
+	}
+	pthread_mutex_lock(&(tty->lock));
+	done = tty->destroyed;
+	pthread_mutex_unlock(&(tty->lock));
+	if (!done) {
+		/* Which may well destroy the renderer, on this thread. */
+		tty->input_callback(NULL, 0, CARD_ID_NONE, "", tty->callback_arg);
+	}
+	pthread_mutex_lock(&(tty->lock));
+	tty->input_done = 1;
+	done = tty->destroyed;
+	pthread_mutex_unlock(&(tty->lock));
+	if (done) {
+		tty_renderer_free(tty);
 	}
-	tty->input_callback(NULL, 0, "", tty->callback_arg);
 	return NULL;
 }
 
@@ -122,28 +422,75 @@ static void
 tty_renderer_destroy(struct renderer *i)
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
+	const char dummy = 0;
+	struct pollfd pollfd;
+	int tries = 0;
+	int done;
+
+	/* Give what is still queued a chance to get out. */
+	pthread_mutex_lock(&(tty->lock));
+	pollfd.fd = tty->fd;
+	pollfd.events = POLLOUT;
+	while (buffer_fill(&(tty->out)) && (tries++ < 100)) {
+		pthread_mutex_unlock(&(tty->lock));
+		poll(&pollfd, 1, 10);
+		pthread_mutex_lock(&(tty->lock));
+		flush(tty, NULL, 0);
+	}
+	buffer_release(&(tty->out));
+	pthread_mutex_unlock(&(tty->lock));
+
 	if (tty->can_restore_termios) {
 		tcsetattr(tty->fd, TCSANOW, &(tty->termios_for_restore));
 	}
+
+	pthread_mutex_lock(&(tty->lock));
+	tty->destroyed = 1;
+	done = (!(tty->input_started)) || tty->input_done;
+	if (!done) {
+		/* Get the input thread to stop and free it. */
+		write(tty->wake_pipe[1], &dummy, 1);
+	}
+	pthread_mutex_unlock(&(tty->lock));
+	if (done) {
+		tty_renderer_free(tty);
+	}
 }
 
 static void
 tty_set_input_callback(
 	struct renderer *i,
-	void (*input_callback)(void *data, size_t count, const char *card_name, void *arg),
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg),
 	void *callback_arg
 )
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
+	pthread_t thread_id;
+	pthread_attr_t thread_attr;
+
 	tty->input_callback = input_callback;
 	tty->callback_arg = callback_arg;
+	/* Nothing is read until there is somewhere for it to go. */
+	if (!(tty->input_started)) {
+		tty->input_started = 1;
+		pthread_attr_init(&thread_attr);
+		pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+		pthread_create(&thread_id, &thread_attr, get_input, tty);
+	}
 }
 
 static int
 tty_renderer_check_ready(struct renderer *i, struct pollfd *pfd)
 {
 	struct tty_renderer *tty = (struct tty_renderer *)i;
+	int full;
 
+	pthread_mutex_lock(&(tty->lock));
+	full = (buffer_fill(&(tty->out)) >= TTY_OUT_BUFFER);
+	pthread_mutex_unlock(&(tty->lock));
+	if (!full) {
+		return 0;
+	}
 	pfd->fd = tty->fd;
 	pfd->events = POLLOUT;
 	return 1;
@@ -159,18 +506,26 @@ const struct renderer_interface tty_renderer_interface = {
 };
 
 struct renderer *
-new_renderer(int fd)
+new_tty_renderer(int fd)
 {
-	pthread_t thread_id;
-	pthread_attr_t thread_attr;
 	struct termios tio;
 
 	struct tty_renderer *tty = malloc(sizeof(struct tty_renderer));
 	if (!tty) return NULL;
+	memset(tty, 0, sizeof(*tty));
 	tty->base.intf = &tty_renderer_interface;
 	tty->fd = fd;
-	tty->active_card = 0;
+	tty->active_card = CARD_ID_NONE;
+	tty->active_card_is_bracketed = 0;
+	buffer_init(&(tty->out), TTY_OUT_MIN, TTY_OUT_MAX);
+	tty->input.state = IN_PLAIN;
 	tty->can_restore_termios = 0;
+	pthread_mutex_init(&(tty->lock), NULL);
+	if (pipe(&(tty->wake_pipe[0])) < 0) {
+		free(tty);
+		return NULL;
+	}
+	setnonblock(tty->wake_pipe[0]);
 	setnonblock(fd);
 
 	if (tcgetattr(fd, &tio) == 0) {
@@ -181,9 +536,5 @@ new_renderer(int fd)
 		tcsetattr(fd, TCSANOW, &tio);
 	}
 
-	pthread_attr_init(&thread_attr);
-	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-	pthread_create(&thread_id, &thread_attr, get_input, tty);
-
 	return (struct renderer *)tty;
 }
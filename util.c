@@ -4,8 +4,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include "util.h"
 
 int
@@ -40,82 +44,100 @@ setnonblock(int fd)
 	fcntl(fd, F_SETFL, flags);
 }
 
-struct fd_receiver {
-	void (*callback)(void *arg, int fd, const char *data);
-	void *callback_arg;
-	int fd;
-};
-
-static void fd_receiver_cleanup(void *arg)
-{
-	struct fd_receiver *r = (struct fd_receiver *)arg;
-	close(r->fd);
-	free(r);
-}
-
-static void *
-run_fd_receiver(void *arg)
+ssize_t
+recv_fds(int sock, char *buf, size_t buf_size, int *fds, int *nfds)
 {
-	struct fd_receiver *r = (struct fd_receiver *)arg;
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
 	struct iovec io;
 	ssize_t n;
-	int card_fd;
-	char m_buffer[4096];
 	char c_buffer[256];
+	int i, count, fd;
 
-	pthread_cleanup_push(fd_receiver_cleanup, arg);
-	for (;;) {
-		io.iov_base = m_buffer;
-		io.iov_len = sizeof(m_buffer) - 1;
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_iov = &io;
-		msg.msg_iovlen = 1;
-		msg.msg_control = c_buffer;
-		msg.msg_controllen = sizeof(c_buffer);
+	io.iov_base = buf;
+	io.iov_len = buf_size - 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	msg.msg_control = c_buffer;
+	msg.msg_controllen = sizeof(c_buffer);
 
-		n = recvmsg(r->fd, &msg, 0);
-		if (n == 0) {
-			break;
-		}
-		if (n < 0) {
-			if (errno == EAGAIN) continue;
-			if (errno == EINTR) continue;
-			perror("recvmsg");
-			break;
+	count = 0;
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0) {
+		*nfds = 0;
+		return n;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+		for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+			memmove(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+			if (count < *nfds) {
+				fds[count++] = fd;
+			} else {
+				close(fd);
+			}
 		}
+	}
+	*nfds = count;
+	buf[n] = 0;
+	return n;
+}
+
+ssize_t
+send_fds(int sock, const void *buf, size_t count, const int *fds, int nfds)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec io;
+	char c_buffer[CMSG_SPACE(4 * sizeof(int))];
 
+	io.iov_base = (void *)buf;
+	io.iov_len = count;
+	memset(&msg, 0, sizeof(msg));
+	memset(c_buffer, 0, sizeof(c_buffer));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		msg.msg_control = c_buffer;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
 		cmsg = CMSG_FIRSTHDR(&msg);
-		memmove(&card_fd, CMSG_DATA(cmsg), sizeof(card_fd));
-		m_buffer[n] = 0;
-		r->callback(r->callback_arg, card_fd, m_buffer);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
 	}
-	pthread_cleanup_pop(1);
-	return NULL;
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
 }
 
-void
-receive_fds(int fd, void (*callback)(void *arg, int fd, const char *data), void *callback_arg, pthread_t *thread_id)
+socklen_t
+unix_socket_address(const char *name, struct sockaddr_un *sa)
 {
-	pthread_t unused_thread_id;
-	pthread_attr_t thread_attr;
-	struct fd_receiver *r = malloc(sizeof(struct fd_receiver));
+	size_t len = strlen(name);
 
-	if (!r) {
-		perror("receive_fds: malloc");
-		close(fd);
-		return;
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (len >= sizeof(sa->sun_path)) {
+		return 0;
+	}
+	memcpy(sa->sun_path, name, len);
+	if (name[0] != '@') {
+		return sizeof(*sa);
 	}
-	r->callback = callback;
-	r->callback_arg = callback_arg;
-	r->fd = fd;
+	/* Abstract: the name is exactly as long as the address says, with
+	   no terminating NUL. */
+	sa->sun_path[0] = 0;
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+uint64_t
+random_u64(void)
+{
+	uint64_t r;
 
-	pthread_attr_init(&thread_attr);
-	if (thread_id == NULL) {
-		/* Caller wants to forget the thread. */
-		pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-		thread_id = &unused_thread_id;
+	if (getrandom(&r, sizeof(r), 0) == sizeof(r)) {
+		return r;
 	}
-	pthread_create(thread_id, &thread_attr, run_fd_receiver, r);
+	/* Better than nothing */
+	return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)clock();
 }
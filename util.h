@@ -1,6 +1,10 @@
 #ifndef _DECK_UTIL_H
 #define _DECK_UTIL_H
 
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 /* returns -1 if stdio is not connected to our tty or we have no tty */
 /* returns a fd to our tty otherwise. */
 /* In the latter case, stdio_is_my_tty[0] says if stdio is attached to
@@ -10,12 +14,23 @@ int stdio_connected_to_tty(int *stdio_is_my_tty);
 
 void setnonblock(int fd);
 
-/* Launch a thread to receive fds on a socket, one at a time. Each time
-   one is received, the callback is called with the new fd and the byte
-   data that came with it, NUL-terminated. */
-void receive_fds(int fd,
-	void (*callback)(void *arg, int fd, const char *data), void *callback_arg,
-	pthread_t *ret_thread_id
-);
+/* Receive one message from sock which is expected to carry fds.
+   The message data is put in buf and NUL-terminated, so it gets at most
+   buf_size-1 bytes of it. Up to *nfds received fds are put in fds, and
+   any more are closed; *nfds is set to how many were kept. Returns the
+   same as recvmsg(). */
+ssize_t recv_fds(int sock, char *buf, size_t buf_size, int *fds, int *nfds);
+
+/* Send count bytes of buf as one message on sock, with nfds (at most
+   4) fds attached. Returns the same as sendmsg(). */
+ssize_t send_fds(int sock, const void *buf, size_t count, const int *fds, int nfds);
+
+/* Fill in sa for the unix socket called name, which is in the abstract
+   namespace if it starts with '@'. Returns the address length to bind
+   or connect with, or 0 if name is too long. */
+socklen_t unix_socket_address(const char *name, struct sockaddr_un *sa);
+
+/* 64 random bits, for names and tokens that should not be guessable. */
+uint64_t random_u64(void);
 
 #endif /* _DECK_UTIL_H */
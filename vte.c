@@ -1,22 +1,53 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <alloca.h>
 #include <vte/vte.h>
-#include <X11/Xlib.h>
 #include "renderer.h"
+#include "ring.h"
 
-/* This is a dumb sample implementation of the renderer.
+/* This is a sample implementation of the renderer.
    It opens a new GTK+ VTE window for each card.
-   It is totally lacking treading synchronization and works by luck!!
-   That's it.
+
+   GTK+ may only be used from the thread that runs its main loop, and
+   the renderer is called from the cardserver's threads, so those never
+   touch GTK+. Output for each card goes into a ring of its own, and
+   the card goes onto a lock-free list of cards with something for the
+   GTK+ thread to do. That thread takes the whole list at once, opens
+   windows for the cards that are new and feeds each terminal all its
+   pending output in one go, no more than once a frame, so that VTE
+   does not go through a redraw for every little write.
+
+   The cardserver only ever has one card writing at a time, and it
+   hands the tty over under a lock, so each ring has one producer at
+   a time as ring.h wants.
+
+   When a card's ring is full the write is refused and the card waits
+   for the wake pipe to be writable. The pipe is filled up while anyone
+   is waiting, and emptied by the GTK+ thread once it has taken some
+   output.
 */
 
+#define VTE_FRAME_USEC 16667
+
 struct vte_card {
+	/* All the cards, for the cardserver threads */
 	struct vte_card *next;
+	/* On the pending list, if pending is set */
+	struct vte_card *next_pending;
+	atomic_int pending;
 	struct vte_renderer *vtei;
+	uint32_t card_id;
 	const char *card_name;
+	struct ring output;
+	/* Only the GTK+ thread touches these. */
 	GtkWidget *vte;
 	GtkWidget *window;
 };
@@ -26,13 +57,28 @@ struct vte_renderer {
 	struct vte_card *cards;
 	struct vte_card *active_card;
 	int initted;
-	void (*input_callback)(void *data, size_t count, const char *card_name, void *arg);
+	pthread_t gtk_thread;
+	struct ring_pool *pool;
+	/* Cards with something for the GTK+ thread to do */
+	_Atomic(struct vte_card *) pending;
+	/* Some card is waiting for room in its ring */
+	atomic_int blocked;
+	int wake_pipe[2];
+	/* Only the GTK+ thread touches these. */
+	gint64 last_flush;
+	char feed_buf[RING_SIZE];
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg);
 	void *callback_arg;
 };
 
 static void *
 run_gtk_main(void *arg)
 {
+	int argc = 1;
+	char *args[] = { "vtedeck", NULL };
+	char **argv = args;
+
+	gtk_init(&argc, &argv);
 	gtk_main();
 	return NULL;
 }
@@ -40,63 +86,148 @@ run_gtk_main(void *arg)
 static void
 vte_init(struct vte_renderer *vtei)
 {
-	pthread_t thread_id;
-	pthread_attr_t thread_attr;
-
 	vtei->initted = 1;
+	pthread_create(&(vtei->gtk_thread), NULL, run_gtk_main, NULL);
+}
 
-	int argc = 1;
-	char **argv = malloc(sizeof(char *) * 2);
+/* GTK+ thread */
+static void
+commit(VteTerminal *v, gchar *text, guint size, gpointer user_data)
+{
+	struct vte_card *card = (struct vte_card *)user_data;
+	card->vtei->input_callback(text, size, card->card_id, card->card_name, card->vtei->callback_arg);
+}
 
-	argv[0] = "vtei";
-	argv[1] = NULL;
+/* GTK+ thread */
+static void
+open_window(struct vte_card *card)
+{
+	char *buf = alloca(strlen(card->card_name) + 10);
 
-	XInitThreads();
-	gtk_init(&argc, &argv);
+	card->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	sprintf(buf, "Card \"%s\"", card->card_name);
+	gtk_window_set_title(GTK_WINDOW(card->window), buf);
+	card->vte = vte_terminal_new();
 
-        pthread_attr_init(&thread_attr);
-        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-        pthread_create(&thread_id, &thread_attr, run_gtk_main, NULL);
+	g_signal_connect(card->vte, "commit", G_CALLBACK(commit), card);
+
+	gtk_container_add(GTK_CONTAINER(card->window), card->vte);
+	gtk_widget_show_all(card->window);
 }
 
+/* GTK+ thread. Everything in the ring goes to VTE in one feed. */
 static void
-commit(VteTerminal *v, gchar *text, guint size, gpointer user_data)
+feed(struct vte_card *card)
 {
-	struct vte_card *card = (struct vte_card *)user_data;
-	card->vtei->input_callback(text, size, card->card_name, card->vtei->callback_arg);
+	struct vte_renderer *vtei = card->vtei;
+	const void *data;
+	size_t count, more;
+
+	count = ring_peek(&(card->output), &data);
+	if (count == 0) {
+		return;
+	}
+	if (ring_fill(&(card->output)) == count) {
+		/* The usual case: all in one piece. */
+		vte_terminal_feed(VTE_TERMINAL(card->vte), data, count);
+		ring_consume(&(card->output), count);
+		return;
+	}
+	/* It wraps around the end of the ring, or there is more since. */
+	memcpy(vtei->feed_buf, data, count);
+	ring_consume(&(card->output), count);
+	more = ring_peek(&(card->output), &data);
+	if (more > sizeof(vtei->feed_buf) - count) {
+		/* Came since, and the card is on the list again for it. */
+		more = sizeof(vtei->feed_buf) - count;
+	}
+	memcpy(vtei->feed_buf + count, data, more);
+	ring_consume(&(card->output), more);
+	vte_terminal_feed(VTE_TERMINAL(card->vte), vtei->feed_buf, count + more);
+}
+
+/* GTK+ thread */
+static gboolean
+flush_cards(gpointer arg)
+{
+	struct vte_renderer *vtei = (struct vte_renderer *)arg;
+	struct vte_card *card, *next;
+	gint64 now = g_get_monotonic_time();
+	char buf[4096];
+
+	if (now - vtei->last_flush < VTE_FRAME_USEC) {
+		/* Too soon after the last lot. The list is not empty, so
+		   nobody else will ask for this again meanwhile. */
+		g_timeout_add((VTE_FRAME_USEC - (now - vtei->last_flush)) / 1000 + 1,
+			flush_cards, vtei);
+		return G_SOURCE_REMOVE;
+	}
+	vtei->last_flush = now;
+
+	card = atomic_exchange(&(vtei->pending), NULL);
+	for (; card; card = next) {
+		next = card->next_pending;
+		/* Before looking in the ring, so that output which comes
+		   after that puts the card back on the list. */
+		atomic_store(&(card->pending), 0);
+		if (!(card->window)) {
+			open_window(card);
+		}
+		feed(card);
+	}
+	if (atomic_exchange(&(vtei->blocked), 0)) {
+		while (read(vtei->wake_pipe[0], buf, sizeof(buf)) > 0);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Cardserver thread. Get the GTK+ thread to look at the card. */
+static void
+make_pending(struct vte_card *card)
+{
+	struct vte_renderer *vtei = card->vtei;
+	struct vte_card *head;
+
+	if (atomic_exchange(&(card->pending), 1)) {
+		return;
+	}
+	head = atomic_load(&(vtei->pending));
+	do {
+		card->next_pending = head;
+	} while (!atomic_compare_exchange_weak(&(vtei->pending), &head, card));
+	if (!head) {
+		g_idle_add(flush_cards, vtei);
+	}
 }
 
 static void
-vte_renderer_claim(struct renderer *i, const char *card_name)
+vte_renderer_claim(struct renderer *i, uint32_t card_id, const char *card_name)
 {
 	struct vte_renderer *vtei = (struct vte_renderer *)i;
 	struct vte_card *card;
-	char *buf = alloca(strlen(card_name) + 10);
 
 	if (!vtei->initted) {
 		vte_init(vtei);
 	}
 	for (card = vtei->cards; card; card = card->next) {
-		if (0 == strcmp(card->card_name, card_name)) break;
+		if (card->card_id == card_id) break;
 	}
 	if (!card) {
 		card = malloc(sizeof(*card) + strlen(card_name) + 1);
-		card->card_name = (const char *)(&(card[1]));
-		strcpy((char *)(&(card[1])), card_name);
-		card->vtei = vtei;
-
-		card->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-		sprintf(buf, "Card \"%s\"", card_name);
-		gtk_window_set_title(GTK_WINDOW(card->window), buf);
-		card->vte = vte_terminal_new();
-
-		g_signal_connect(card->vte, "commit", G_CALLBACK(commit), card);
-
-		gtk_container_add(GTK_CONTAINER(card->window), card->vte);
-		gtk_widget_show_all(card->window);
+		if (card) {
+			memset(card, 0, sizeof(*card));
+			card->card_id = card_id;
+			card->card_name = (const char *)(&(card[1]));
+			strcpy((char *)(&(card[1])), card_name);
+			card->vtei = vtei;
+			ring_init(&(card->output));
+			atomic_init(&(card->pending), 0);
 
-		card->next = vtei->cards;
-		vtei->cards = card;
+			card->next = vtei->cards;
+			vtei->cards = card;
+			/* For its window. */
+			make_pending(card);
+		}
 	}
 	vtei->active_card = card;
 }
@@ -112,20 +243,59 @@ static ssize_t
 vte_renderer_write(struct renderer *i, const void *buf, size_t count)
 {
 	struct vte_renderer *vtei = (struct vte_renderer *)i;
-	vte_terminal_feed(VTE_TERMINAL(vtei->active_card->vte), buf, count);
-	return count;
+	struct vte_card *card = vtei->active_card;
+	static const char fill[4096];
+	size_t n;
+
+	if (!card) {
+		/* Out of memory when claiming. Nowhere to send this. */
+		return count;
+	}
+	n = ring_put(&(card->output), vtei->pool, buf, count);
+	if (n == 0) {
+		atomic_store(&(vtei->blocked), 1);
+		while (write(vtei->wake_pipe[1], fill, sizeof(fill)) > 0);
+		/* In case the GTK+ thread made room before it could see
+		   that we were waiting. */
+		n = ring_put(&(card->output), vtei->pool, buf, count);
+		if (n == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	make_pending(card);
+	return n;
+}
+
+/* GTK+ thread */
+static gboolean
+close_windows(gpointer arg)
+{
+	struct vte_renderer *vtei = (struct vte_renderer *)arg;
+	struct vte_card *card;
+
+	for (card = vtei->cards; card; card = card->next) {
+		if (card->window) {
+			gtk_widget_destroy(card->window);
+		}
+	}
+	gtk_main_quit();
+	return G_SOURCE_REMOVE;
 }
 
 static void
 vte_renderer_destroy(struct renderer *i)
 {
 	struct vte_renderer *vtei = (struct vte_renderer *)i;
+
+	if (vtei->initted) {
+		g_idle_add(close_windows, vtei);
+		pthread_join(vtei->gtk_thread, NULL);
+	}
 	while (vtei->cards) {
 		struct vte_card *card = vtei->cards;
 		vtei->cards = card->next;
-
-		gtk_widget_destroy(card->vte);
-		gtk_widget_destroy(card->window);
+		ring_release(&(card->output), vtei->pool);
 		free(card);
 	}
 }
@@ -133,7 +303,7 @@ vte_renderer_destroy(struct renderer *i)
 static void
 vte_set_input_callback(
 	struct renderer *i,
-	void (*input_callback)(void *data, size_t count, const char *card_name, void *arg),
+	void (*input_callback)(void *data, size_t count, uint32_t card_id, const char *card_name, void *arg),
 	void *callback_arg
 )
 {
@@ -145,7 +315,14 @@ vte_set_input_callback(
 static int
 vte_renderer_check_ready(struct renderer *i, struct pollfd *pfd)
 {
-	return 0;
+	struct vte_renderer *vtei = (struct vte_renderer *)i;
+
+	if (!atomic_load(&(vtei->blocked))) {
+		return 0;
+	}
+	pfd->fd = vtei->wake_pipe[1];
+	pfd->events = POLLOUT;
+	return 1;
 }
 
 const struct renderer_interface vte_renderer_interface = {
@@ -158,11 +335,24 @@ const struct renderer_interface vte_renderer_interface = {
 };
 
 struct renderer *
-new_renderer(int unused_fd)
+new_renderer(const char *name, int unused_fd)
 {
+	if (name && strcmp(name, "vte")) {
+		return NULL;
+	}
 	struct vte_renderer *vtei = malloc(sizeof(struct vte_renderer));
 	if (!vtei) return NULL;
 	memset(vtei, 0, sizeof(*vtei));
 	vtei->base.intf = &vte_renderer_interface;
+	atomic_init(&(vtei->pending), NULL);
+	atomic_init(&(vtei->blocked), 0);
+	vtei->pool = ring_pool_new();
+	if ((!(vtei->pool)) || (pipe2(&(vtei->wake_pipe[0]), O_NONBLOCK | O_CLOEXEC) < 0)) {
+		free(vtei->pool);
+		free(vtei);
+		return NULL;
+	}
+	/* As small as it goes, there is nothing in it worth having. */
+	fcntl(vtei->wake_pipe[1], F_SETPIPE_SZ, 4096);
 	return (struct renderer *)vtei;
 }